@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of rucksack, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#include "config.h"
+#include "hash.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#ifdef RUCKSACK_HAVE_SSE42_CRC32
+#include <nmmintrin.h>
+#endif
+
+static const uint64_t PRIME1 = 11400714785074694791ULL;
+static const uint64_t PRIME2 = 14029467366897019727ULL;
+static const uint64_t PRIME3 = 1609587929392839161ULL;
+static const uint64_t PRIME4 = 9650029242287828579ULL;
+static const uint64_t PRIME5 = 2870177450012600261ULL;
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// compilers do not always turn the byte by byte version into a single load
+static uint64_t read_uint64le(const unsigned char *p) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t x;
+    memcpy(&x, p, 8);
+    return x;
+#else
+    uint64_t x = 0;
+    for (int i = 7; i >= 0; i -= 1)
+        x = (x << 8) | p[i];
+    return x;
+#endif
+}
+
+static uint64_t read_uint32le(const unsigned char *p) {
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) |
+        ((uint64_t)p[3] << 24);
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME1;
+}
+
+static uint64_t merge_round(uint64_t acc, uint64_t val) {
+    acc ^= round64(0, val);
+    return acc * PRIME1 + PRIME4;
+}
+
+// the four lanes are independent, so they are computed side by side
+static void consume_stripes(struct RuckSackHash *hash, const unsigned char *p, long count) {
+    uint64_t v1 = hash->acc[0];
+    uint64_t v2 = hash->acc[1];
+    uint64_t v3 = hash->acc[2];
+    uint64_t v4 = hash->acc[3];
+    for (long i = 0; i < count; i += 1, p += 32) {
+        v1 = round64(v1, read_uint64le(p));
+        v2 = round64(v2, read_uint64le(p + 8));
+        v3 = round64(v3, read_uint64le(p + 16));
+        v4 = round64(v4, read_uint64le(p + 24));
+    }
+    hash->acc[0] = v1;
+    hash->acc[1] = v2;
+    hash->acc[2] = v3;
+    hash->acc[3] = v4;
+}
+
+void rucksack_hash_init(struct RuckSackHash *hash) {
+    memset(hash, 0, sizeof(struct RuckSackHash));
+    hash->acc[0] = PRIME1 + PRIME2;
+    hash->acc[1] = PRIME2;
+    hash->acc[2] = 0;
+    hash->acc[3] = -PRIME1;
+}
+
+void rucksack_hash_update(struct RuckSackHash *hash, const void *data, long size) {
+    const unsigned char *p = data;
+    hash->total_len += size;
+
+    if (hash->stripe_len) {
+        long amt = 32 - hash->stripe_len;
+        if (amt > size)
+            amt = size;
+        memcpy(hash->stripe + hash->stripe_len, p, amt);
+        hash->stripe_len += amt;
+        p += amt;
+        size -= amt;
+        if (hash->stripe_len < 32)
+            return;
+        consume_stripes(hash, hash->stripe, 1);
+        hash->stripe_len = 0;
+    }
+
+    long count = size / 32;
+    consume_stripes(hash, p, count);
+    p += count * 32;
+    size -= count * 32;
+
+    memcpy(hash->stripe, p, size);
+    hash->stripe_len = size;
+}
+
+uint64_t rucksack_hash_final(const struct RuckSackHash *hash) {
+    uint64_t h;
+    if (hash->total_len >= 32) {
+        h = rotl64(hash->acc[0], 1) + rotl64(hash->acc[1], 7) +
+            rotl64(hash->acc[2], 12) + rotl64(hash->acc[3], 18);
+        for (int i = 0; i < 4; i += 1)
+            h = merge_round(h, hash->acc[i]);
+    } else {
+        h = hash->acc[2] + PRIME5;
+    }
+    h += hash->total_len;
+
+    const unsigned char *p = hash->stripe;
+    const unsigned char *end = p + hash->stripe_len;
+    for (; p + 8 <= end; p += 8) {
+        h ^= round64(0, read_uint64le(p));
+        h = rotl64(h, 27) * PRIME1 + PRIME4;
+    }
+    if (p + 4 <= end) {
+        h ^= read_uint32le(p) * PRIME1;
+        h = rotl64(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p += 1) {
+        h ^= *p * PRIME5;
+        h = rotl64(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t rucksack_hash(const void *data, long size) {
+    struct RuckSackHash hash;
+    rucksack_hash_init(&hash);
+    rucksack_hash_update(&hash, data, size);
+    return rucksack_hash_final(&hash);
+}
+
+static const uint32_t CRC32C_POLY = 0x82f63b78;
+
+// slicing by 8: crc_table[k][i] is the CRC of byte i followed by k zero bytes
+static uint32_t crc_table[8][256];
+static uint32_t (*crc_update)(uint32_t crc, const unsigned char *p, long size);
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc_update_portable(uint32_t crc, const unsigned char *p, long size) {
+    for (; size >= 8; size -= 8, p += 8) {
+        uint32_t lo = crc ^ (uint32_t)read_uint32le(p);
+        uint32_t hi = read_uint32le(p + 4);
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+            crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+            crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+            crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+    }
+    for (; size > 0; size -= 1, p += 1)
+        crc = crc_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef RUCKSACK_HAVE_SSE42_CRC32
+__attribute__((target("sse4.2")))
+static uint32_t crc_update_sse42(uint32_t crc, const unsigned char *p, long size) {
+    uint64_t crc64 = crc;
+    for (; size >= 8; size -= 8, p += 8)
+        crc64 = _mm_crc32_u64(crc64, read_uint64le(p));
+    crc = crc64;
+    for (; size > 0; size -= 1, p += 1)
+        crc = _mm_crc32_u8(crc, *p);
+    return crc;
+}
+#endif
+
+static void crc_init(void) {
+    for (int i = 0; i < 256; i += 1) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit += 1)
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+        crc_table[0][i] = crc;
+    }
+    for (int k = 1; k < 8; k += 1) {
+        for (int i = 0; i < 256; i += 1) {
+            uint32_t prev = crc_table[k - 1][i];
+            crc_table[k][i] = (prev >> 8) ^ crc_table[0][prev & 0xff];
+        }
+    }
+
+    crc_update = crc_update_portable;
+#ifdef RUCKSACK_HAVE_SSE42_CRC32
+    if (__builtin_cpu_supports("sse4.2"))
+        crc_update = crc_update_sse42;
+#endif
+}
+
+uint32_t rucksack_crc32c(uint32_t crc, const void *data, long size) {
+    pthread_once(&crc_once, crc_init);
+    return ~crc_update(~crc, data, size);
+}
+
+uint32_t rucksack_crc32c_portable(uint32_t crc, const void *data, long size) {
+    pthread_once(&crc_once, crc_init);
+    return ~crc_update_portable(~crc, data, size);
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of rucksack, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#ifndef RUCKSACK_HASH_H_INCLUDED
+#define RUCKSACK_HASH_H_INCLUDED
+
+#include <stdint.h>
+
+// XXH64 with a seed of 0, the content hash of the entries of a bundle. the
+// contents can be hashed a piece at a time as they are written.
+
+struct RuckSackHash {
+    uint64_t acc[4];
+    uint64_t total_len;
+    // bytes which do not fill a 32 byte stripe yet
+    unsigned char stripe[32];
+    long stripe_len;
+};
+
+void rucksack_hash_init(struct RuckSackHash *hash);
+void rucksack_hash_update(struct RuckSackHash *hash, const void *data, long size);
+uint64_t rucksack_hash_final(const struct RuckSackHash *hash);
+
+// hashes size bytes in one go
+uint64_t rucksack_hash(const void *data, long size);
+
+// CRC-32C (Castagnoli), the checksum of the superblocks and of the stored
+// bytes of entries. pass 0 as crc to start and the previous result to
+// continue. uses the crc32 instruction of SSE 4.2 when the CPU has it.
+uint32_t rucksack_crc32c(uint32_t crc, const void *data, long size);
+// the same without the crc32 instruction, for comparing against
+uint32_t rucksack_crc32c_portable(uint32_t crc, const void *data, long size);
+
+#endif /* RUCKSACK_HASH_H_INCLUDED */
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of rucksack, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// a compressed block is a list of sequences. each sequence is a token byte
+// whose high nibble is the literal count and low nibble the match length
+// minus MIN_MATCH, then more literal count bytes if the nibble is 15, the
+// literals, a uint16le match offset, and more match length bytes if the
+// nibble is 15. the last sequence has only literals.
+
+static const long MIN_MATCH = 4;
+// the last match must start this many bytes before the end
+static const long MATCH_START_LIMIT = 12;
+// the last bytes are always literals
+static const long LAST_LITERALS = 5;
+static const long MAX_OFFSET = 65535;
+
+#define HASH_BITS 12
+
+static uint32_t read_uint32(const unsigned char *p) {
+    uint32_t x;
+    memcpy(&x, p, 4);
+    return x;
+}
+
+static uint32_t hash_uint32(uint32_t x) {
+    return (x * 2654435761U) >> (32 - HASH_BITS);
+}
+
+long rucksack_lz_compress_bound(long src_size) {
+    return src_size + src_size / 255 + 16;
+}
+
+// writes a count which did not fit in its nibble
+static long write_length(unsigned char *dst, long op, long length) {
+    while (length >= 255) {
+        dst[op++] = 255;
+        length -= 255;
+    }
+    dst[op++] = length;
+    return op;
+}
+
+// returns the position after the sequence, or -1 if it does not fit
+static long write_sequence(unsigned char *dst, long op, long dst_size,
+        const unsigned char *literals, long literal_count, long offset, long match_len)
+{
+    long worst = 1 + literal_count + literal_count / 255 + 1 + 2 + match_len / 255 + 1;
+    if (worst > dst_size - op)
+        return -1;
+
+    long match_code = match_len - MIN_MATCH;
+    unsigned char *token = &dst[op++];
+    *token = (literal_count < 15 ? literal_count : 15) << 4;
+    if (literal_count >= 15)
+        op = write_length(dst, op, literal_count - 15);
+    memcpy(&dst[op], literals, literal_count);
+    op += literal_count;
+
+    // the last sequence has no match
+    if (!match_len)
+        return op;
+
+    dst[op++] = offset & 0xff;
+    dst[op++] = offset >> 8;
+    *token |= (match_code < 15 ? match_code : 15);
+    if (match_code >= 15)
+        op = write_length(dst, op, match_code - 15);
+    return op;
+}
+
+long rucksack_lz_compress(const unsigned char *src, long src_size,
+        unsigned char *dst, long dst_size)
+{
+    // positions of the last 4 byte sequences with each hash
+    long table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    long op = 0;
+    long anchor = 0;
+    long ip = 0;
+    long limit = src_size - MATCH_START_LIMIT;
+    long match_limit = src_size - LAST_LITERALS;
+    while (ip < limit) {
+        uint32_t sequence = read_uint32(&src[ip]);
+        uint32_t h = hash_uint32(sequence);
+        long ref = table[h];
+        table[h] = ip;
+        if (ref >= ip || ip - ref > MAX_OFFSET || read_uint32(&src[ref]) != sequence) {
+            // look further apart the longer nothing matched
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+            ip -= 1;
+            ref -= 1;
+        }
+        long match_len = MIN_MATCH;
+        while (ip + match_len < match_limit && src[ip + match_len] == src[ref + match_len])
+            match_len += 1;
+
+        op = write_sequence(dst, op, dst_size, &src[anchor], ip - anchor, ip - ref, match_len);
+        if (op < 0)
+            return 0;
+        ip += match_len;
+        anchor = ip;
+    }
+
+    op = write_sequence(dst, op, dst_size, &src[anchor], src_size - anchor, 0, 0);
+    return (op < 0) ? 0 : op;
+}
+
+// reads a count which did not fit in its nibble. returns -1 at the end of src.
+static long read_length(const unsigned char *src, long src_size, long *ip) {
+    long length = 0;
+    unsigned char byte;
+    do {
+        if (*ip >= src_size)
+            return -1;
+        byte = src[*ip];
+        *ip += 1;
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+int rucksack_lz_decompress(const unsigned char *src, long src_size,
+        unsigned char *dst, long dst_size)
+{
+    long ip = 0;
+    long op = 0;
+    while (ip < src_size) {
+        unsigned char token = src[ip++];
+
+        long literal_count = token >> 4;
+        if (literal_count == 15) {
+            long more = read_length(src, src_size, &ip);
+            if (more < 0)
+                return -1;
+            literal_count += more;
+        }
+        if (literal_count > src_size - ip || literal_count > dst_size - op)
+            return -1;
+        if (literal_count <= 16 && src_size - ip >= 16 && dst_size - op >= 16)
+            memcpy(&dst[op], &src[ip], 16);
+        else
+            memcpy(&dst[op], &src[ip], literal_count);
+        ip += literal_count;
+        op += literal_count;
+
+        if (ip == src_size)
+            break;
+
+        if (src_size - ip < 2)
+            return -1;
+        long offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op)
+            return -1;
+
+        long match_len = (token & 15) + MIN_MATCH;
+        if ((token & 15) == 15) {
+            long more = read_length(src, src_size, &ip);
+            if (more < 0)
+                return -1;
+            match_len += more;
+        }
+        if (match_len > dst_size - op)
+            return -1;
+
+        // a match may overlap the bytes it produces. away from the end of
+        // dst, copy 8 bytes at a time and let the last copy run over.
+        unsigned char *out = &dst[op];
+        const unsigned char *match = out - offset;
+        if (offset >= 8 && match_len + 8 <= dst_size - op) {
+            for (long i = 0; i < match_len; i += 8)
+                memcpy(&out[i], &match[i], 8);
+        } else {
+            for (long i = 0; i < match_len; i += 1)
+                out[i] = match[i];
+        }
+        op += match_len;
+    }
+
+    return (op == dst_size) ? 0 : -1;
+}
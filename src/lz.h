@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of rucksack, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#ifndef RUCKSACK_LZ_H_INCLUDED
+#define RUCKSACK_LZ_H_INCLUDED
+
+// a fast LZ77 compressor producing the LZ4 block format, used for the
+// entries of a bundle which are stored with RuckSackCodecLz
+
+// the most bytes compressing src_size bytes can produce
+long rucksack_lz_compress_bound(long src_size);
+
+// returns the compressed size, or 0 if it would be more than dst_size bytes
+long rucksack_lz_compress(const unsigned char *src, long src_size,
+        unsigned char *dst, long dst_size);
+
+// returns 0 when src decompresses to exactly dst_size bytes, and -1 when src
+// is corrupt. never reads or writes outside of the buffers.
+int rucksack_lz_decompress(const unsigned char *src, long src_size,
+        unsigned char *dst, long dst_size);
+
+#endif /* RUCKSACK_LZ_H_INCLUDED */
@@ -61,12 +61,14 @@ enum State {
     StateFileObjectBegin,
     StateFilePropName,
     StateFilePropPath,
+    StateFilePropCompress,
     StateExpectGlobArray,
     StateGlobObject,
     StateGlobObjectProp,
     StateGlobValueGlob,
     StateGlobValuePrefix,
     StateGlobValuePath,
+    StateGlobValueCompress,
     StateGlobImageObject,
     StateGlobImageObjectProp,
     StateGlobImageValueGlob,
@@ -101,12 +103,14 @@ static const char *STATE_STR[] = {
     "StateFileObjectBegin",
     "StateFilePropName",
     "StateFilePropPath",
+    "StateFilePropCompress",
     "StateExpectGlobArray",
     "StateGlobObject",
     "StateGlobObjectProp",
     "StateGlobValueGlob",
     "StateGlobValuePrefix",
     "StateGlobValuePath",
+    "StateGlobValueCompress",
     "StateGlobImageObject",
     "StateGlobImageObjectProp",
     "StateGlobImageValueGlob",
@@ -128,13 +132,15 @@ static struct RuckSackTexture *texture = NULL;
 static struct RuckSackTexture *bundle_texture = NULL;
 static struct RuckSackFileEntry *bundle_texture_entry = NULL;
 static int dirty_texture_flag = 0;
-static long bundle_mtime = 0;
+static long long bundle_mtime_ns = 0;
 static long bundle_texture_image_count = 0;
 static struct RuckSackImage **bundle_texture_images = NULL;
 
 static char *file_key = NULL;
 static int file_key_size = 0;
 static char *file_path = NULL;
+// for the files and globFiles entry being parsed
+static enum RuckSackCodec file_codec = RuckSackCodecNone;
 
 struct RuckSackImage *image = NULL;
 
@@ -151,6 +157,8 @@ static enum State anchor_next_state;
 
 static char debug_mode = 0;
 static char verbose = 0;
+// --check hash: compare sizes and content hashes instead of mtimes
+static char check_hash = 0;
 
 static const char *ERR_STR[] = {
     "",
@@ -227,15 +235,25 @@ static int memneql(const char *mem1, int mem1_size, const char *mem2, int mem2_s
         return memcmp(mem1, mem2, mem1_size);
 }
 
+static int path_mtime_ns(const char *path, long long *mtime_ns) {
+    struct stat st;
+    if (stat(path, &st))
+        return -1;
+#ifdef RUCKSACK_HAVE_STAT_MTIM
+    *mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#else
+    *mtime_ns = st.st_mtime * 1000000000LL;
+#endif
+    return 0;
+}
+
 static void check_if_image_dirty(void) {
     // if already marked as dirty, we have no work to do.
     if (dirty_texture_flag)
         return;
 
-    struct stat st;
-    stat(image->path, &st);
-    long mtime = st.st_mtime;
-    if (mtime > bundle_mtime) {
+    long long mtime_ns;
+    if (path_mtime_ns(image->path, &mtime_ns) || mtime_ns > bundle_mtime_ns) {
         dirty_texture_flag = 1;
         return;
     }
@@ -291,11 +309,20 @@ static int add_file_if_outdated(struct RuckSackBundle *bundle,
 {
     struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, key_size);
     if (entry) {
-        long bundle_mtime = rucksack_file_mtime(entry);
-        struct stat st;
-        stat(path, &st);
-        long file_mtime = st.st_mtime;
-        if (file_mtime <= bundle_mtime) {
+        int up_to_date;
+        if (rucksack_file_written_codec(entry) != file_codec) {
+            // compress was turned on or off since the file was added
+            up_to_date = 0;
+        } else if (check_hash) {
+            // a file which cannot be read is not up to date, and adding it
+            // reports the error
+            rucksack_file_check_source(entry, path, &up_to_date);
+        } else {
+            long long file_mtime_ns;
+            up_to_date = !path_mtime_ns(path, &file_mtime_ns) &&
+                file_mtime_ns <= rucksack_file_mtime_ns(entry);
+        }
+        if (up_to_date) {
             if (verbose)
                 fprintf(stderr, "File up to date: %s\n", key);
             rucksack_file_touch(entry);
@@ -307,7 +334,7 @@ static int add_file_if_outdated(struct RuckSackBundle *bundle,
         fprintf(stderr, "New file: %s\n", key);
     }
     append_dep(path);
-    int err = rucksack_bundle_add_file(bundle, key, key_size, path);
+    int err = rucksack_bundle_add_file_codec(bundle, key, key_size, path, file_codec);
     if (err) {
         snprintf(strbuf, sizeof(strbuf), "unable to add %s: %s", path, rucksack_err_str(err));
         return parse_error(strbuf);
@@ -427,7 +454,7 @@ static int on_string(struct LaxJsonContext *json, enum LaxJsonType type,
             if (bundle_texture_entry) {
                 rucksack_file_open_texture(bundle_texture_entry, &bundle_texture);
                 if (bundle_texture) {
-                    bundle_mtime = rucksack_file_mtime(bundle_texture_entry);
+                    bundle_mtime_ns = rucksack_file_mtime_ns(bundle_texture_entry);
                     bundle_texture_image_count = rucksack_texture_image_count(bundle_texture);
                     bundle_texture_images = malloc(sizeof(struct RuckSackImage *) *
                             bundle_texture_image_count);
@@ -463,6 +490,8 @@ static int on_string(struct LaxJsonContext *json, enum LaxJsonType type,
         case StateFilePropName:
             if (strcmp(value, "path") == 0) {
                 state = StateFilePropPath;
+            } else if (strcmp(value, "compress") == 0) {
+                state = StateFilePropCompress;
             } else {
                 snprintf(strbuf, sizeof(strbuf), "unknown file property: %s", value);
                 return parse_error(strbuf);
@@ -554,6 +583,8 @@ static int on_string(struct LaxJsonContext *json, enum LaxJsonType type,
                 state = StateGlobValuePrefix;
             } else if (strcmp(value, "path") == 0) {
                 state = StateGlobValuePath;
+            } else if (strcmp(value, "compress") == 0) {
+                state = StateGlobValueCompress;
             } else {
                 snprintf(strbuf, sizeof(strbuf), "unknown globFiles property: %s", value);
                 return parse_error(strbuf);
@@ -682,6 +713,20 @@ static int on_primitive(struct LaxJsonContext *json, enum LaxJsonType type) {
             }
             state = StateTextureProp;
             break;
+        case StateFilePropCompress:
+        case StateGlobValueCompress:
+            switch (type) {
+                case LaxJsonTypeTrue:
+                    file_codec = RuckSackCodecLz;
+                    break;
+                case LaxJsonTypeFalse:
+                    file_codec = RuckSackCodecNone;
+                    break;
+                default:
+                    return parse_error("expected true or false");
+            }
+            state = (state == StateFilePropCompress) ? StateFilePropName : StateGlobObjectProp;
+            break;
         default:
             return parse_error("unexpected primitive");
     }
@@ -724,6 +769,7 @@ static int on_begin(struct LaxJsonContext *json, enum LaxJsonType type) {
                 break;
             case StateFileObjectBegin:
                 state = StateFilePropName;
+                file_codec = RuckSackCodecNone;
                 break;
             case StateImagePropAnchor:
                 state = StateImagePropAnchorObject;
@@ -737,6 +783,7 @@ static int on_begin(struct LaxJsonContext *json, enum LaxJsonType type) {
                 glob_glob = NULL;
                 glob_path = NULL;
                 glob_prefix = NULL;
+                file_codec = RuckSackCodecNone;
                 break;
             case StateGlobImageObject:
                 state = StateGlobImageObjectProp;
@@ -849,6 +896,14 @@ static int bundle_usage(char *arg0) {
             "  [--verbose]      print what is happening while it is happening\n"
             "  [--deps path]    generate a .d dependencies file\n"
             "  [--force-r90]    force all spritesheet images to be rotated\n"
+            "  [--sync mode]    none, close (default) or stream. when to sync the\n"
+            "                   bundle to disk\n"
+            "  [--align bytes]  start files at a multiple of this power of 2. the\n"
+            "                   bundle keeps it for later builds\n"
+            "  [--check mode]   mtime (default) or hash. how to tell whether a file\n"
+            "                   changed. hash compares the size and, when the mtime\n"
+            "                   differs, the contents, so it also notices files\n"
+            "                   replaced by older ones\n"
             , arg0);
     return 1;
 }
@@ -866,6 +921,8 @@ static int command_bundle(char *arg0, int argc, char *argv[]) {
     char *input_filename = NULL;
     char *bundle_filename = NULL;
     char *deps_filename = NULL;
+    struct RuckSackBundleOptions options;
+    rucksack_bundle_options_init(&options);
 
     for (int i = 0; i < argc; i += 1) {
         char *arg = argv[i];
@@ -881,6 +938,30 @@ static int command_bundle(char *arg0, int argc, char *argv[]) {
                 path_prefix = argv[++i];
             } else if (strcmp(arg, "deps") == 0) {
                 deps_filename = argv[++i];
+            } else if (strcmp(arg, "sync") == 0) {
+                char *mode = argv[++i];
+                if (strcmp(mode, "none") == 0) {
+                    options.durability = RuckSackDurabilityNone;
+                } else if (strcmp(mode, "close") == 0) {
+                    options.durability = RuckSackDurabilityOnClose;
+                } else if (strcmp(mode, "stream") == 0) {
+                    options.durability = RuckSackDurabilityPerStream;
+                } else {
+                    return bundle_usage(arg0);
+                }
+            } else if (strcmp(arg, "align") == 0) {
+                options.alignment = atol(argv[++i]);
+                if (options.alignment <= 0)
+                    return bundle_usage(arg0);
+            } else if (strcmp(arg, "check") == 0) {
+                char *mode = argv[++i];
+                if (strcmp(mode, "mtime") == 0) {
+                    check_hash = 0;
+                } else if (strcmp(mode, "hash") == 0) {
+                    check_hash = 1;
+                } else {
+                    return bundle_usage(arg0);
+                }
             } else {
                 return bundle_usage(arg0);
             }
@@ -915,7 +996,7 @@ static int command_bundle(char *arg0, int argc, char *argv[]) {
         }
     }
 
-    int rs_err = rucksack_bundle_open(bundle_filename, &bundle);
+    int rs_err = rucksack_bundle_open_options(bundle_filename, &bundle, &options);
     if (rs_err) {
         fprintf(stderr, "unable to open bundle: %s\n", rucksack_err_str(rs_err));
         return 1;
@@ -952,7 +1033,27 @@ static int command_bundle(char *arg0, int argc, char *argv[]) {
         return 1;
     }
 
-    rucksack_bundle_delete_untouched(bundle);
+    rs_err = rucksack_bundle_delete_untouched(bundle);
+    if (rs_err) {
+        fprintf(stderr, "unable to delete stale files: %s\n", rucksack_err_str(rs_err));
+        rucksack_bundle_close(bundle);
+        return 1;
+    }
+
+    rs_err = rucksack_bundle_commit(bundle);
+    if (rs_err) {
+        fprintf(stderr, "unable to write bundle: %s\n", rucksack_err_str(rs_err));
+        rucksack_bundle_close(bundle);
+        return 1;
+    }
+
+    if (verbose) {
+        struct RuckSackSyncStats stats;
+        rucksack_bundle_sync_stats(bundle, &stats);
+        fprintf(stderr, "Commits: %ld in %.3fs, syncs: %ld in %.3fs\n",
+                stats.commit_count, stats.commit_seconds,
+                stats.sync_count, stats.sync_seconds);
+    }
 
     rs_err = rucksack_bundle_close(bundle);
     if (rs_err) {
@@ -1095,27 +1196,28 @@ static int command_cat(char *arg0, int argc, char *argv[]) {
         }
         rucksack_texture_close(texture);
     } else {
-        long size = rucksack_file_size(entry);
-
-        unsigned char *buffer = malloc(size);
-        if (!buffer) {
-            fprintf(stderr, "out of memory\n");
-            return 1;
-        }
-
-        rs_err = rucksack_file_read(entry, buffer);
-
+        struct RuckSackInStream *stream;
+        rs_err = rucksack_file_open_stream(entry, &stream);
         if (rs_err) {
             fprintf(stderr, "unable to read file entry: %s\n", rucksack_err_str(rs_err));
             return 1;
         }
 
-        if (fwrite(buffer, 1, size, stdout) != size) {
-            fprintf(stderr, "error writing to stdout\n");
-            return 1;
-        }
+        unsigned char buffer[65536];
+        long amt_read;
+        do {
+            rs_err = rucksack_instream_read(stream, buffer, sizeof(buffer), &amt_read);
+            if (rs_err) {
+                fprintf(stderr, "unable to read file entry: %s\n", rucksack_err_str(rs_err));
+                return 1;
+            }
+            if (fwrite(buffer, 1, amt_read, stdout) != amt_read) {
+                fprintf(stderr, "error writing to stdout\n");
+                return 1;
+            }
+        } while (amt_read > 0);
 
-        free(buffer);
+        rucksack_instream_close(stream);
     }
 
     rs_err = rucksack_bundle_close(bundle);
@@ -1171,7 +1273,11 @@ static int command_list(char *arg0, int argc, char *argv[]) {
         return 1;
     }
 
-    rucksack_bundle_get_files(bundle, entries);
+    rs_err = rucksack_bundle_get_files(bundle, entries);
+    if (rs_err) {
+        fprintf(stderr, "unable to read file entries: %s\n", rucksack_err_str(rs_err));
+        return 1;
+    }
 
     for (int i = 0; i < count; i += 1) {
         struct RuckSackFileEntry *e = entries[i];
@@ -1189,6 +1295,197 @@ static int command_list(char *arg0, int argc, char *argv[]) {
     return 0;
 }
 
+static int verify_usage(char *arg0) {
+    fprintf(stderr, "Usage: %s verify bundlefile\n"
+            "\n"
+            "Options:\n"
+            "  [--threads n]  check this many files at once. defaults to 4\n"
+            , arg0);
+    return 1;
+}
+
+static int command_verify(char *arg0, int argc, char *argv[]) {
+    char *bundle_filename = NULL;
+    int thread_count = 4;
+
+    for (int i = 0; i < argc; i += 1) {
+        char *arg = argv[i];
+        if (arg[0] == '-' && arg[1] == '-') {
+            arg += 2;
+            if (i + 1 >= argc) {
+                return verify_usage(arg0);
+            } else if (strcmp(arg, "threads") == 0) {
+                thread_count = atoi(argv[++i]);
+                if (thread_count <= 0)
+                    return verify_usage(arg0);
+            } else {
+                return verify_usage(arg0);
+            }
+        } else if (!bundle_filename) {
+            bundle_filename = arg;
+        } else {
+            return verify_usage(arg0);
+        }
+    }
+
+    if (!bundle_filename)
+        return verify_usage(arg0);
+
+    int rs_err = rucksack_bundle_open_read(bundle_filename, &bundle);
+    if (rs_err) {
+        fprintf(stderr, "unable to open %s: %s\n", bundle_filename, rucksack_err_str(rs_err));
+        return 1;
+    }
+
+    long count = rucksack_bundle_file_count(bundle);
+    struct RuckSackFileEntry **entries = malloc(count * sizeof(struct RuckSackFileEntry *));
+    int *errs = malloc(count * sizeof(int));
+    if (count && (!entries || !errs)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    rs_err = rucksack_bundle_get_files(bundle, entries);
+    if (rs_err) {
+        fprintf(stderr, "unable to read file entries: %s\n", rucksack_err_str(rs_err));
+        return 1;
+    }
+    rs_err = rucksack_bundle_verify(bundle, errs, thread_count);
+    if (rs_err) {
+        fprintf(stderr, "unable to verify bundle: %s\n", rucksack_err_str(rs_err));
+        return 1;
+    }
+
+    long bad_count = 0;
+    long unchecked_count = 0;
+    for (long i = 0; i < count; i += 1) {
+        if (errs[i] == RuckSackErrorNoChecksum) {
+            unchecked_count += 1;
+        } else if (errs[i]) {
+            bad_count += 1;
+            printf("%s: %s\n", rucksack_file_name(entries[i]), rucksack_err_str(errs[i]));
+        }
+    }
+    fprintf(stderr, "%ld files, %ld bad, %ld without a checksum\n",
+            count, bad_count, unchecked_count);
+
+    free(errs);
+    free(entries);
+
+    rs_err = rucksack_bundle_close(bundle);
+    if (rs_err) {
+        fprintf(stderr, "unable to close bundle: %s\n", rucksack_err_str(rs_err));
+        return 1;
+    }
+
+    return bad_count ? 1 : 0;
+}
+
+static int diff_usage(char *arg0) {
+    fprintf(stderr, "Usage: %s diff oldbundle newbundle patchbundle\n"
+            "\n"
+            "Writes the files which changed between the two bundles and tombstones\n"
+            "for deleted ones to a new patch bundle.\n"
+            , arg0);
+    return 1;
+}
+
+static int command_diff(char *arg0, int argc, char *argv[]) {
+    if (argc != 3 || argv[0][0] == '-' || argv[1][0] == '-' || argv[2][0] == '-')
+        return diff_usage(arg0);
+    char *old_filename = argv[0];
+    char *new_filename = argv[1];
+    char *patch_filename = argv[2];
+
+    struct RuckSackBundle *old_bundle;
+    int rs_err = rucksack_bundle_open_read(old_filename, &old_bundle);
+    if (rs_err) {
+        fprintf(stderr, "unable to open %s: %s\n", old_filename, rucksack_err_str(rs_err));
+        return 1;
+    }
+    struct RuckSackBundle *new_bundle;
+    rs_err = rucksack_bundle_open_read(new_filename, &new_bundle);
+    if (rs_err) {
+        fprintf(stderr, "unable to open %s: %s\n", new_filename, rucksack_err_str(rs_err));
+        return 1;
+    }
+
+    // the patch starts out empty and keeps the alignment of the new bundle
+    struct RuckSackBundleOptions options;
+    rucksack_bundle_options_init(&options);
+    options.alignment = rucksack_bundle_alignment(new_bundle);
+    remove(patch_filename);
+    rs_err = rucksack_bundle_open_options(patch_filename, &bundle, &options);
+    if (rs_err) {
+        fprintf(stderr, "unable to open %s: %s\n", patch_filename, rucksack_err_str(rs_err));
+        return 1;
+    }
+
+    rs_err = rucksack_bundle_diff(old_bundle, new_bundle, bundle);
+    if (rs_err) {
+        fprintf(stderr, "unable to write patch: %s\n", rucksack_err_str(rs_err));
+        return 1;
+    }
+    long patch_count = rucksack_bundle_file_count(bundle);
+
+    rs_err = rucksack_bundle_close(bundle);
+    if (!rs_err)
+        rs_err = rucksack_bundle_close(new_bundle);
+    if (!rs_err)
+        rs_err = rucksack_bundle_close(old_bundle);
+    if (rs_err) {
+        fprintf(stderr, "unable to close bundle: %s\n", rucksack_err_str(rs_err));
+        return 1;
+    }
+
+    fprintf(stderr, "%ld changed or deleted files\n", patch_count);
+    return 0;
+}
+
+static int apply_usage(char *arg0) {
+    fprintf(stderr, "Usage: %s apply bundlefile patchbundle\n"
+            "\n"
+            "Updates a bundle with the files and tombstones of a patch bundle made\n"
+            "with diff.\n"
+            , arg0);
+    return 1;
+}
+
+static int command_apply(char *arg0, int argc, char *argv[]) {
+    if (argc != 2 || argv[0][0] == '-' || argv[1][0] == '-')
+        return apply_usage(arg0);
+    char *bundle_filename = argv[0];
+    char *patch_filename = argv[1];
+
+    struct RuckSackBundle *patch;
+    int rs_err = rucksack_bundle_open_read(patch_filename, &patch);
+    if (rs_err) {
+        fprintf(stderr, "unable to open %s: %s\n", patch_filename, rucksack_err_str(rs_err));
+        return 1;
+    }
+    rs_err = rucksack_bundle_open(bundle_filename, &bundle);
+    if (rs_err) {
+        fprintf(stderr, "unable to open %s: %s\n", bundle_filename, rucksack_err_str(rs_err));
+        return 1;
+    }
+
+    rs_err = rucksack_bundle_apply(bundle, patch);
+    if (rs_err) {
+        fprintf(stderr, "unable to apply patch: %s\n", rucksack_err_str(rs_err));
+        return 1;
+    }
+
+    rs_err = rucksack_bundle_close(bundle);
+    if (!rs_err)
+        rs_err = rucksack_bundle_close(patch);
+    if (rs_err) {
+        fprintf(stderr, "unable to close bundle: %s\n", rucksack_err_str(rs_err));
+        return 1;
+    }
+
+    return 0;
+}
+
 static int strip_usage(char *arg0) {
     fprintf(stderr, "Usage: %s strip bundlefile\n", arg0);
     return 1;
@@ -1242,54 +1539,35 @@ static int command_strip(char *arg0, int argc, char *argv[]) {
         return 1;
     }
 
-    rucksack_bundle_get_files(bundle, entries);
+    rs_err = rucksack_bundle_get_files(bundle, entries);
+    if (rs_err) {
+        fprintf(stderr, "unable to read file entries: %s\n", rucksack_err_str(rs_err));
+        return 1;
+    }
 
-    long headers_size = rucksack_bundle_get_headers_byte_count(bundle);
+    // files keep their alignment
+    struct RuckSackBundleOptions options;
+    rucksack_bundle_options_init(&options);
+    options.headers_size = rucksack_bundle_get_headers_byte_count(bundle);
+    options.alignment = rucksack_bundle_alignment(bundle);
 
     struct RuckSackBundle *out_bundle;
-    rs_err = rucksack_bundle_open_precise(tmp_filename, &out_bundle, headers_size);
+    rs_err = rucksack_bundle_open_options(tmp_filename, &out_bundle, &options);
     if (rs_err) {
         fprintf(stderr, "unable to open %s: %s\n", tmp_filename, rucksack_err_str(rs_err));
         return 1;
     }
-    // determine max file size
-    long max_file_size = 0;
-    for (int i = 0; i < count; i += 1) {
-        struct RuckSackFileEntry *e = entries[i];
-        long file_size = rucksack_file_size(e);
-        if (file_size > max_file_size)
-            max_file_size = file_size;
-    }
-    unsigned char *buffer = malloc(max_file_size);
+    // the stored bytes are copied as they are, with the mtime and content hash
     for (int i = 0; i < count; i += 1) {
         struct RuckSackFileEntry *e = entries[i];
-        long file_size = rucksack_file_size(e);
-        const char *file_name = rucksack_file_name(e);
-        int file_name_size = rucksack_file_name_size(e);
-        long file_mtime = rucksack_file_mtime(e);
-        struct RuckSackOutStream *stream;
-        rs_err = rucksack_bundle_add_stream_precise(out_bundle, file_name,
-            file_name_size, file_size, &stream, file_mtime);
-        if (rs_err) {
-            fprintf(stderr, "unable to add stream: %s\n", rucksack_err_str(rs_err));
-            remove(tmp_filename);
-            return 1;
-        }
-        rs_err = rucksack_file_read(e, buffer);
+        rs_err = rucksack_bundle_copy_file(out_bundle, e);
         if (rs_err) {
-            fprintf(stderr, "unable to read %s: %s\n", file_name, rucksack_err_str(rs_err));
+            fprintf(stderr, "unable to write %s: %s\n", rucksack_file_name(e),
+                    rucksack_err_str(rs_err));
             remove(tmp_filename);
             return 1;
         }
-        rs_err = rucksack_stream_write(stream, buffer, file_size);
-        if (rs_err) {
-            fprintf(stderr, "unable to write %s: %s\n", file_name, rucksack_err_str(rs_err));
-            remove(tmp_filename);
-            return 1;
-        }
-        rucksack_stream_close(stream);
     }
-    free(buffer);
     free(entries);
 
     rs_err = rucksack_bundle_close(out_bundle);
@@ -1314,18 +1592,27 @@ static int command_strip(char *arg0, int argc, char *argv[]) {
 }
 
 static int rm_usage(char *arg0) {
-    fprintf(stderr, "Usage: %s rm bundlefile resourcename\n", arg0);
+    fprintf(stderr, "Usage: %s rm bundlefile resourcename\n"
+            "\n"
+            "Options:\n"
+            "  [--tombstone]  leave a tombstone, which hides the file in the bundles\n"
+            "                 below this one when they are laid over each other\n"
+            , arg0);
     return 1;
 }
 
 static int command_rm(char *arg0, int argc, char *argv[]) {
     char *bundle_filename = NULL;
     char *resource_name = NULL;
+    int tombstone = 0;
 
     for (int i = 0; i < argc; i += 1) {
         char *arg = argv[i];
         if (arg[0] == '-' && arg[1] == '-') {
-            return rm_usage(arg0);
+            if (strcmp(arg + 2, "tombstone") == 0)
+                tombstone = 1;
+            else
+                return rm_usage(arg0);
         } else if (!bundle_filename) {
             bundle_filename = arg;
         } else if (!resource_name) {
@@ -1347,7 +1634,10 @@ static int command_rm(char *arg0, int argc, char *argv[]) {
         return 1;
     }
 
-    rs_err = rucksack_bundle_delete_file(bundle, resource_name, -1);
+    if (tombstone)
+        rs_err = rucksack_bundle_add_tombstone(bundle, resource_name, -1);
+    else
+        rs_err = rucksack_bundle_delete_file(bundle, resource_name, -1);
     if (rs_err) {
         fprintf(stderr, "unable to delete %s: %s\n", resource_name, rucksack_err_str(rs_err));
         return 1;
@@ -1447,7 +1737,11 @@ static int command_unpack(char *arg0, int argc, char *argv[]) {
         fprintf(stderr, "out of memory\n");
         return 1;
     }
-    rucksack_bundle_get_files(bundle, entries);
+    rs_err = rucksack_bundle_get_files(bundle, entries);
+    if (rs_err) {
+        fprintf(stderr, "unable to read file entries: %s\n", rucksack_err_str(rs_err));
+        return 1;
+    }
 
     // determine max file size
     long max_file_size = 0;
@@ -1468,6 +1762,9 @@ static int command_unpack(char *arg0, int argc, char *argv[]) {
         }
         for (int i = 0; i < count; i += 1) {
             struct RuckSackFileEntry *e = entries[i];
+            // there is no file to write for a deleted key
+            if (rucksack_file_is_tombstone(e))
+                continue;
 
             const char *name = rucksack_file_name(e);
             json_escape(name, strbuf4);
@@ -1555,6 +1852,12 @@ static struct Command commands[] = {
         "make an existing bundle as small as possible"},
     {"unpack", command_unpack, unpack_usage,
         "create a directory with the bundle contents"},
+    {"verify", command_verify, verify_usage,
+        "check the files of a bundle against their checksums"},
+    {"diff", command_diff, diff_usage,
+        "make a patch bundle with the changes between two bundles"},
+    {"apply", command_apply, apply_usage,
+        "update a bundle with a patch bundle"},
     {NULL, NULL, NULL},
 };
 
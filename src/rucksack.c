@@ -6,9 +6,17 @@
  */
 
 #include "config.h"
+
+#if defined(RUCKSACK_HAVE_COPY_FILE_RANGE) || defined(RUCKSACK_HAVE_IO_URING)
+// for copy_file_range and syscall. must come before any system header.
+#define _GNU_SOURCE
+#endif
+
 #include "rucksack.h"
 #include "shared.h"
 #include "util.h"
+#include "lz.h"
+#include "test_hooks.h"
 
 #include <stdlib.h>
 #include <assert.h>
@@ -20,15 +28,51 @@
 #include <unistd.h>
 #include <time.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
 
+#ifdef RUCKSACK_HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#ifdef RUCKSACK_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
 
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 
 static const char *BUNDLE_UUID = "\x60\x70\xc8\x99\x82\xa1\x41\x84\x89\x51\x08\xc9\x1c\xc9\xb6\x20";
 
-static const int BUNDLE_VERSION = 1;
-static const int MAIN_HEADER_LEN = 28;
+static const int BUNDLE_VERSION = 2;
+static const int MAIN_HEADER_LEN = 108;
+static const int MAIN_HEADER_LEN_V1 = 28;
+static const int SUPERBLOCK_OFFSET = 20;
+static const int SUPERBLOCK_LEN = 44;
+static const long MAX_ALIGNMENT = 1048576;
 static const int HEADER_ENTRY_LEN = 36; // not taking into account key bytes
+// after the key of entries which are stored with a codec
+static const int CODEC_FIELDS_LEN = 16;
+// after the codec fields of entries with a content hash
+static const int HASH_FIELD_LEN = 8;
+// after the content hash of entries with a checksum of the stored bytes
+static const int CHECKSUM_FIELD_LEN = 4;
+// after the checksum of entries with flags
+static const int FLAGS_FIELD_LEN = 4;
+// the key was deleted, see rucksack_bundle_add_tombstone
+static const uint32_t ENTRY_FLAG_TOMBSTONE = 1;
+// written with RuckSackCodecLz but stored as it is, as it did not get smaller
+static const uint32_t ENTRY_FLAG_CODEC_SKIPPED = 2;
+// after the flags of entries with the mtime in nanoseconds
+static const int MTIME_NS_FIELD_LEN = 8;
+static const int64_t NS_PER_SECOND = 1000000000;
+// contents stored with a codec are encoded this many bytes at a time
+static const long CHUNK_SIZE = 65536;
+static const int CHUNK_END_LEN = 8;
+static const int DIRECTORY_SLOT_LEN = 8;
+static const long STREAM_BUFFER_SIZE = 65536;
 
 static const char *ERROR_STR[] = {
     "",
@@ -43,6 +87,27 @@ static const char *ERROR_STR[] = {
     "unrecognized image format",
     "key not found",
     "cannot delete while stream open",
+    "bundle is not in memory",
+    "bundle is read-only",
+    "invalid codec",
+    "file is compressed",
+    "invalid range",
+    "invalid alignment",
+    "checksum mismatch",
+    "file has no checksum",
+};
+
+#define HOLE_CLASS_COUNT 64
+
+// a free extent between two extents. each hole belongs to the extent right
+// before it, see RuckSackFileEntry.hole
+struct RuckSackHole {
+    long int offset;
+    long int size;
+    long int owner; // reference to the extent the hole belongs to
+    // neighbours in the list of holes of the same size class, index plus one
+    long int prev;
+    long int next;
 };
 
 struct RuckSackBundlePrivate {
@@ -56,41 +121,167 @@ struct RuckSackBundlePrivate {
     long int header_entry_mem_count; // allocated memory entry count
 
     // keep some stuff cached for quick access
-    struct RuckSackFileEntry *first_entry;
-    struct RuckSackFileEntry *last_entry;
     long int headers_byte_count;
     long int first_file_offset;
 
+    // the superblock generation the bundle was opened at or last committed,
+    // 0 when there is no version 2 main header in the file yet
+    uint64_t generation;
+    // size of the header region at first_header_offset
+    long int header_region_len;
+    // set when there is something to commit
+    bool dirty;
+    enum RuckSackDurability durability;
+    // the offsets of files are a multiple of this power of 2
+    long int alignment;
+    // streams which have not been closed yet
+    long int open_stream_count;
+    struct RuckSackSyncStats sync_stats;
+
+    // ranges of a bundle opened for writing which must not be overwritten
+    // although no entry refers to them: the header region of the last
+    // generation and the old extents of entries which were moved or deleted
+    // since. only offset, allocated_size and hole are used. see commit.
+    struct RuckSackFileEntry *reserved;
+    long int reserved_count;
+    long int reserved_mem_count;
+    // reference to the reserved extent holding the last header region, or 0
+    long int header_extent;
+
+    // references to extents sorted by offset, so that the neighbours of an
+    // extent in the file are found with a binary search. a reference is an
+    // index into entries plus one, or minus one minus an index into reserved.
+    // only maintained for bundles opened for writing.
+    long int *by_offset;
+    long int by_offset_count;
+    // room in by_offset and holes, header_entry_mem_count + reserved_mem_count
+    long int extent_mem_count;
+
+    // free extents between the extents, for bundles opened for writing. there
+    // is at most one hole per extent. hole_lists has a list of holes for each
+    // size class, which is the floor of the log2 of the size. the links are
+    // indexes plus one.
+    struct RuckSackHole *holes;
+    long int unused_holes;
+    long int hole_lists[HOLE_CLASS_COUNT];
+
+    // reused by every copy_data call which needs a buffer
+    char *copy_buffer;
+    long int copy_buffer_size;
+
+    // open addressing hash table (linear probing) mapping entry keys to
+    // entries. each slot holds an index into entries plus one; 0 means empty.
+    long int *index;
+    long int index_slot_count; // always a power of 2
+
+    // the same for content hashes, to find an entry with the same contents
+    // as one which was just written and the entries sharing an extent. built
+    // on first use and kept up to date after that, except that deleting
+    // untouched entries drops it.
+    long int *content_index;
+    long int content_slot_count;
+    long int content_used_count;
+
+    // keys of the entries loaded by read_header, stored back to back
+    char *key_arena;
+
+    // lazy bundles only index the keys when opened. the remaining fields of
+    // an entry are decoded from the raw header at this offset on first use.
+    // entries which have not been decoded yet have a NULL b field.
+    bool lazy;
+    long int *lazy_header_offsets;
+    // held while decoding an entry, so that threads reading the bundle can
+    // decode entries as they find them
+    pthread_mutex_t lazy_mutex;
+
+    // lazy version 2 bundles look keys up in the key directory stored in the
+    // file instead of building an index. these point into mem_buffer.
+    const unsigned char *dir_offsets;
+    const unsigned char *dir_slots;
+    long int dir_slot_count;
+
     bool read_only;
+    // check the checksum of files which are read whole
+    bool verify;
 
     long mem_buffer_size;
     const char *mem_buffer;
-    long mem_offset;
+    // set when mem_buffer was created by rucksack_bundle_open_mmap and must
+    // be released when the bundle is closed
+    bool mem_buffer_mapped;
 };
 
-static int bundle_seek(struct RuckSackBundlePrivate *b, long offset) {
-    if (b->f) {
-        if (fseek(b->f, offset, SEEK_SET))
+// reads size bytes at offset. there is no shared file position, so a
+// read-only bundle may be read from several threads at once. returns the
+// number of bytes read, which is less than size at end of file or on error.
+// the FILE of a bundle is only used for its file descriptor; nothing goes
+// through stdio buffers.
+static long bundle_read_at(struct RuckSackBundlePrivate *b, long offset,
+        void *buf, long size)
+{
+    if (b->mem_buffer) {
+        if (offset < 0 || offset >= b->mem_buffer_size)
+            return 0;
+        long amt_to_read = MIN(b->mem_buffer_size - offset, size);
+        memcpy(buf, b->mem_buffer + offset, amt_to_read);
+        return amt_to_read;
+    }
+
+    int fd = fileno(b->f);
+    long amt_read = 0;
+    while (amt_read < size) {
+        ssize_t amt = pread(fd, (char *)buf + amt_read, size - amt_read, offset + amt_read);
+        if (amt == -1 && errno == EINTR)
+            continue;
+        if (amt <= 0)
+            break;
+        amt_read += amt;
+    }
+    return amt_read;
+}
+
+static int bundle_write_at(struct RuckSackBundlePrivate *b, long offset,
+        const void *buf, long size)
+{
+    int fd = fileno(b->f);
+    long amt_written = 0;
+    while (amt_written < size) {
+        ssize_t amt = pwrite(fd, (const char *)buf + amt_written, size - amt_written,
+                offset + amt_written);
+        if (amt == -1 && errno == EINTR)
+            continue;
+        if (amt <= 0)
             return RuckSackErrorFileAccess;
-        return RuckSackErrorNone;
+        amt_written += amt;
     }
-    if (offset >= b->mem_buffer_size)
-        return RuckSackErrorFileAccess;
-    b->mem_offset = offset;
     return RuckSackErrorNone;
 }
 
-static long bundle_read(struct RuckSackBundlePrivate *b, void *buf, long size) {
-    if (b->f)
-        return fread(buf, 1, size, b->f);
-    long amt_left = b->mem_buffer_size - b->mem_offset;
-    long amt_to_read = MIN(amt_left, size);
-    memcpy(buf, b->mem_buffer + b->mem_offset, amt_to_read);
-    b->mem_offset += amt_to_read;
-    return amt_to_read;
+// borrow a pointer into the memory buffer instead of copying out of it
+static int bundle_data(struct RuckSackBundlePrivate *b, long offset, long size,
+        const unsigned char **ptr)
+{
+    *ptr = NULL;
+    if (!b->mem_buffer)
+        return RuckSackErrorNotInMemory;
+    if (offset < 0 || size < 0 || offset + size > b->mem_buffer_size)
+        return RuckSackErrorInvalidFormat;
+    *ptr = (const unsigned char *)b->mem_buffer + offset;
+    return RuckSackErrorNone;
+}
+
+static int unmap_file(const char *buffer, long size) {
+#ifdef RUCKSACK_HAVE_MMAP
+    return munmap((void *)buffer, size);
+#else
+    free((void *)buffer);
+    return 0;
+#endif
 }
 
 static int bundle_close(struct RuckSackBundlePrivate *b) {
+    if (b->mem_buffer_mapped)
+        return unmap_file(b->mem_buffer, b->mem_buffer_size);
     return b->f ? fclose(b->f) : 0;
 }
 
@@ -101,6 +292,116 @@ static int memneql(const char *mem1, int mem1_size, const char *mem2, int mem2_s
         return memcmp(mem1, mem2, mem1_size);
 }
 
+static uint64_t read_uint64le(const unsigned char *buf) {
+    uint64_t result = 0;
+    for (int i = 7; i >= 0; i -= 1)
+        result = (result << 8) | buf[i];
+    return result;
+}
+
+// consumes the key 8 bytes at a time; hashing is a noticeable part of
+// opening a bundle with many entries.
+static uint32_t hash_key(const char *key, int key_size) {
+    const unsigned char *ptr = (const unsigned char *)key;
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ (uint64_t)key_size;
+    int len = key_size;
+    while (len >= 8) {
+        hash = (hash ^ read_uint64le(ptr)) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+        ptr += 8;
+        len -= 8;
+    }
+    uint64_t tail = 0;
+    for (int i = len - 1; i >= 0; i -= 1)
+        tail = (tail << 8) | ptr[i];
+    hash = (hash ^ tail) * 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return (uint32_t)hash;
+}
+
+static void index_insert_no_grow(struct RuckSackBundlePrivate *b, long int entry_index) {
+    long int mask = b->index_slot_count - 1;
+    long int slot = b->entries[entry_index].key_hash & mask;
+    while (b->index[slot])
+        slot = (slot + 1) & mask;
+    b->index[slot] = entry_index + 1;
+}
+
+static long int index_slot_count_for(long int entry_count) {
+    // stay at most half full
+    long int slot_count = 64;
+    while (slot_count < 2 * entry_count)
+        slot_count *= 2;
+    return slot_count;
+}
+
+// replaces the index with an empty one with room for entry_count entries
+static int index_alloc(struct RuckSackBundlePrivate *b, long int entry_count) {
+    long int slot_count = index_slot_count_for(entry_count);
+    long int *new_index = calloc(slot_count, sizeof(long int));
+    if (!new_index)
+        return RuckSackErrorNoMem;
+    free(b->index);
+    b->index = new_index;
+    b->index_slot_count = slot_count;
+    return RuckSackErrorNone;
+}
+
+// makes room for at least entry_count entries, indexing all existing ones
+static int index_reserve(struct RuckSackBundlePrivate *b, long int entry_count) {
+    if (index_slot_count_for(entry_count) <= b->index_slot_count)
+        return RuckSackErrorNone;
+
+    int err = index_alloc(b, entry_count);
+    if (err)
+        return err;
+    for (long int i = 0; i < b->header_entry_count; i += 1)
+        index_insert_no_grow(b, i);
+    return RuckSackErrorNone;
+}
+
+// returns the slot which refers to the entry, or -1 if not found
+static long int index_find_slot(struct RuckSackBundlePrivate *b,
+        const char *key, int key_size)
+{
+    if (!b->index)
+        return -1;
+    uint32_t hash = hash_key(key, key_size);
+    long int mask = b->index_slot_count - 1;
+    for (long int slot = hash & mask; b->index[slot]; slot = (slot + 1) & mask) {
+        struct RuckSackFileEntry *e = &b->entries[b->index[slot] - 1];
+        if (e->key_hash == hash && memneql(key, key_size, e->key, e->key_size) == 0)
+            return slot;
+    }
+    return -1;
+}
+
+static long int index_slot_of_entry(struct RuckSackBundlePrivate *b, long int entry_index) {
+    long int mask = b->index_slot_count - 1;
+    long int slot = b->entries[entry_index].key_hash & mask;
+    while (b->index[slot] != entry_index + 1)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+// backward shift deletion so that no tombstones are needed
+static void index_remove_slot(struct RuckSackBundlePrivate *b, long int slot) {
+    long int mask = b->index_slot_count - 1;
+    long int hole = slot;
+    for (long int i = (slot + 1) & mask; b->index[i]; i = (i + 1) & mask) {
+        long int home = b->entries[b->index[i] - 1].key_hash & mask;
+        // move the item into the hole unless its home slot lies cyclically
+        // within (hole, i]
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            b->index[hole] = b->index[i];
+            hole = i;
+        }
+    }
+    b->index[hole] = 0;
+}
+
 static long alloc_size(long actual_size) {
     return 2 * actual_size + 8192;
 }
@@ -109,10 +410,297 @@ static long int alloc_size_precise(char precise, long actual_size) {
     return precise ? actual_size : alloc_size(actual_size);
 }
 
+static bool valid_alignment(long int alignment) {
+    return alignment > 0 && alignment <= MAX_ALIGNMENT && !(alignment & (alignment - 1));
+}
+
+static long int align_down(long int offset, long int alignment) {
+    return offset & ~(alignment - 1);
+}
+
+static long int align_up(long int offset, long int alignment) {
+    return align_down(offset + alignment - 1, alignment);
+}
+
 static long int alloc_count(long int actual_count) {
     return 2 * actual_count + 64;
 }
 
+// empty extents go before the extent which starts at the same offset, as in
+// extent_insert
+static int compare_entry_offsets(const void *a, const void *b) {
+    const struct RuckSackFileEntry *entry_a = *(struct RuckSackFileEntry * const *)a;
+    const struct RuckSackFileEntry *entry_b = *(struct RuckSackFileEntry * const *)b;
+    if (entry_a->offset != entry_b->offset)
+        return (entry_a->offset > entry_b->offset) - (entry_a->offset < entry_b->offset);
+    return (entry_a->allocated_size > 0) - (entry_b->allocated_size > 0);
+}
+
+static struct RuckSackFileEntry *extent_at(struct RuckSackBundlePrivate *b, long int ref) {
+    return (ref > 0) ? &b->entries[ref - 1] : &b->reserved[-ref - 1];
+}
+
+static long int entry_ref(struct RuckSackBundlePrivate *b, struct RuckSackFileEntry *entry) {
+    return (entry - b->entries) + 1;
+}
+
+static long int extent_end(struct RuckSackBundlePrivate *b, long int ref) {
+    struct RuckSackFileEntry *extent = extent_at(b, ref);
+    return extent->offset + extent->allocated_size;
+}
+
+// returns the position in by_offset of the first extent whose offset is not
+// less than offset
+static long int offset_lower_bound(struct RuckSackBundlePrivate *b, long int offset) {
+    long int lo = 0;
+    long int hi = b->by_offset_count;
+    while (lo < hi) {
+        long int mid = lo + (hi - lo) / 2;
+        if (extent_at(b, b->by_offset[mid])->offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static long int offset_position(struct RuckSackBundlePrivate *b, long int ref) {
+    long int pos = offset_lower_bound(b, extent_at(b, ref)->offset);
+    // empty extents can share an offset
+    while (b->by_offset[pos] != ref)
+        pos += 1;
+    return pos;
+}
+
+static long int first_extent(struct RuckSackBundlePrivate *b) {
+    return b->by_offset_count ? b->by_offset[0] : 0;
+}
+
+static long int last_extent(struct RuckSackBundlePrivate *b) {
+    return b->by_offset_count ? b->by_offset[b->by_offset_count - 1] : 0;
+}
+
+static int hole_class(long int size) {
+    int size_class = 0;
+    while (size >>= 1)
+        size_class += 1;
+    return size_class;
+}
+
+static void hole_link(struct RuckSackBundlePrivate *b, long int hole_index) {
+    struct RuckSackHole *hole = &b->holes[hole_index];
+    long int *head = &b->hole_lists[hole_class(hole->size)];
+    hole->prev = 0;
+    hole->next = *head;
+    if (*head)
+        b->holes[*head - 1].prev = hole_index + 1;
+    *head = hole_index + 1;
+}
+
+static void hole_unlink(struct RuckSackBundlePrivate *b, long int hole_index) {
+    struct RuckSackHole *hole = &b->holes[hole_index];
+    if (hole->prev)
+        b->holes[hole->prev - 1].next = hole->next;
+    else
+        b->hole_lists[hole_class(hole->size)] = hole->next;
+    if (hole->next)
+        b->holes[hole->next - 1].prev = hole->prev;
+}
+
+// records the free extent after the extent owner
+static void hole_add(struct RuckSackBundlePrivate *b, long int owner,
+        long int offset, long int size)
+{
+    long int hole_index = b->unused_holes - 1;
+    struct RuckSackHole *hole = &b->holes[hole_index];
+    b->unused_holes = hole->next;
+    hole->offset = offset;
+    hole->size = size;
+    hole->owner = owner;
+    hole_link(b, hole_index);
+    extent_at(b, owner)->hole = hole_index + 1;
+}
+
+static void hole_remove(struct RuckSackBundlePrivate *b, long int owner) {
+    struct RuckSackFileEntry *extent = extent_at(b, owner);
+    if (!extent->hole)
+        return;
+    long int hole_index = extent->hole - 1;
+    hole_unlink(b, hole_index);
+    b->holes[hole_index].next = b->unused_holes;
+    b->unused_holes = hole_index + 1;
+    extent->hole = 0;
+}
+
+// takes size bytes from the start of the hole after owner
+static void hole_shrink(struct RuckSackBundlePrivate *b, long int owner, long int size) {
+    long int hole_index = extent_at(b, owner)->hole - 1;
+    struct RuckSackHole *hole = &b->holes[hole_index];
+    if (hole->size == size) {
+        hole_remove(b, owner);
+        return;
+    }
+    hole_unlink(b, hole_index);
+    hole->size -= size;
+    hole->offset += size;
+    hole_link(b, hole_index);
+}
+
+// makes room for mem_count extents in by_offset and holes, adding the new
+// holes to the list of unused ones
+static int extents_reserve(struct RuckSackBundlePrivate *b, long int mem_count) {
+    if (mem_count <= b->extent_mem_count)
+        return RuckSackErrorNone;
+    long int *new_by_offset = realloc(b->by_offset, mem_count * sizeof(long int));
+    if (!new_by_offset)
+        return RuckSackErrorNoMem;
+    b->by_offset = new_by_offset;
+    struct RuckSackHole *new_holes = realloc(b->holes, mem_count * sizeof(struct RuckSackHole));
+    if (!new_holes)
+        return RuckSackErrorNoMem;
+    b->holes = new_holes;
+    for (long int i = b->extent_mem_count; i < mem_count; i += 1) {
+        b->holes[i].next = b->unused_holes;
+        b->unused_holes = i + 1;
+    }
+    b->extent_mem_count = mem_count;
+    return RuckSackErrorNone;
+}
+
+// adds an extent to by_offset. it must lie in free space, which it takes out
+// of the hole it is in.
+static void extent_insert(struct RuckSackBundlePrivate *b, long int ref) {
+    struct RuckSackFileEntry *extent = extent_at(b, ref);
+    extent->hole = 0;
+    // goes after the empty extents at the same offset, unless it is empty
+    // itself and put right before the next extent
+    long int pos = offset_lower_bound(b, extent->offset + (extent->allocated_size > 0));
+    memmove(&b->by_offset[pos + 1], &b->by_offset[pos],
+            (b->by_offset_count - pos) * sizeof(long int));
+    b->by_offset[pos] = ref;
+    b->by_offset_count += 1;
+
+    // the space before the first extent and after the last one is not a hole
+    if (pos > 0) {
+        long int prev = b->by_offset[pos - 1];
+        hole_remove(b, prev);
+        long int prev_end = extent_end(b, prev);
+        if (extent->offset > prev_end)
+            hole_add(b, prev, prev_end, extent->offset - prev_end);
+    }
+    if (pos + 1 < b->by_offset_count) {
+        long int end = extent_end(b, ref);
+        long int next_offset = extent_at(b, b->by_offset[pos + 1])->offset;
+        if (next_offset > end)
+            hole_add(b, ref, end, next_offset - end);
+    }
+}
+
+// removes an extent from by_offset, merging its space with the holes around it
+static void extent_remove(struct RuckSackBundlePrivate *b, long int ref) {
+    long int pos = offset_position(b, ref);
+    hole_remove(b, ref);
+    b->by_offset_count -= 1;
+    memmove(&b->by_offset[pos], &b->by_offset[pos + 1],
+            (b->by_offset_count - pos) * sizeof(long int));
+
+    if (pos > 0) {
+        long int prev = b->by_offset[pos - 1];
+        hole_remove(b, prev);
+        long int prev_end = extent_end(b, prev);
+        if (pos < b->by_offset_count) {
+            long int next_offset = extent_at(b, b->by_offset[pos])->offset;
+            if (next_offset > prev_end)
+                hole_add(b, prev, prev_end, next_offset - prev_end);
+        }
+    }
+}
+
+// makes room for count reserved extents
+static int reserved_reserve(struct RuckSackBundlePrivate *b, long int count) {
+    if (count <= b->reserved_mem_count)
+        return RuckSackErrorNone;
+    long int new_mem_count = alloc_count(count);
+    int err = extents_reserve(b, b->header_entry_mem_count + new_mem_count);
+    if (err)
+        return err;
+    struct RuckSackFileEntry *new_reserved = realloc(b->reserved,
+            new_mem_count * sizeof(struct RuckSackFileEntry));
+    if (!new_reserved)
+        return RuckSackErrorNoMem;
+    b->reserved = new_reserved;
+    b->reserved_mem_count = new_mem_count;
+    return RuckSackErrorNone;
+}
+
+// adds a reserved extent, which is not in by_offset yet. cannot fail when
+// there is room for it already.
+static int reserved_add(struct RuckSackBundlePrivate *b, long int offset, long int size,
+        long int *out_ref)
+{
+    int err = reserved_reserve(b, b->reserved_count + 1);
+    if (err)
+        return err;
+    struct RuckSackFileEntry *extent = &b->reserved[b->reserved_count];
+    memset(extent, 0, sizeof(struct RuckSackFileEntry));
+    extent->offset = offset;
+    extent->allocated_size = size;
+    b->reserved_count += 1;
+    *out_ref = -b->reserved_count;
+    return RuckSackErrorNone;
+}
+
+// gives the space of a reserved extent back. the last reserved extent takes
+// its place in the array.
+static void reserved_remove(struct RuckSackBundlePrivate *b, long int ref) {
+    extent_remove(b, ref);
+    long int last_ref = -b->reserved_count;
+    if (ref != last_ref) {
+        long int pos = offset_position(b, last_ref);
+        struct RuckSackFileEntry *extent = extent_at(b, ref);
+        *extent = *extent_at(b, last_ref);
+        b->by_offset[pos] = ref;
+        if (extent->hole)
+            b->holes[extent->hole - 1].owner = ref;
+        if (b->header_extent == last_ref)
+            b->header_extent = ref;
+    }
+    b->reserved_count -= 1;
+}
+
+static long int directory_slot_count_for(long int entry_count) {
+    long int slot_count = 1;
+    while (slot_count < 2 * entry_count)
+        slot_count *= 2;
+    return slot_count;
+}
+
+// the key directory has an offset table and a sorted table, each with one
+// uint32be per entry, followed by the hash table
+static long int directory_size(long int entry_count) {
+    return 8 * entry_count + DIRECTORY_SLOT_LEN * directory_slot_count_for(entry_count);
+}
+
+static long int header_entry_len(const struct RuckSackFileEntry *entry) {
+    // an optional field comes with all the fields before it, even unset ones
+    long int len = HEADER_ENTRY_LEN + entry->key_size;
+    if (entry->has_mtime_ns)
+        return len + CODEC_FIELDS_LEN + HASH_FIELD_LEN + CHECKSUM_FIELD_LEN +
+            FLAGS_FIELD_LEN + MTIME_NS_FIELD_LEN;
+    if (entry->tombstone || entry->codec_skipped)
+        return len + CODEC_FIELDS_LEN + HASH_FIELD_LEN + CHECKSUM_FIELD_LEN + FLAGS_FIELD_LEN;
+    if (entry->has_checksum)
+        return len + CODEC_FIELDS_LEN + HASH_FIELD_LEN + CHECKSUM_FIELD_LEN;
+    if (entry->has_content_hash)
+        return len + CODEC_FIELDS_LEN + HASH_FIELD_LEN;
+    return len + (entry->codec ? CODEC_FIELDS_LEN : 0);
+}
+
+// the number of bytes needed for the header entries plus the key directory
+static long int header_region_size(struct RuckSackBundlePrivate *b) {
+    return b->headers_byte_count + directory_size(b->header_entry_count);
+}
+
 static void write_uint64be(unsigned char *buf, uint64_t x) {
     buf[7] = x & 0xff;
 
@@ -184,301 +772,1082 @@ static float read_float32be(const unsigned char *buf) {
     return read_uint32be(buf) / FIXED_POINT_N;
 }
 
-static int read_header(struct RuckSackBundlePrivate *b) {
-    // read all the header entries
-    if (bundle_seek(b, 0))
-        return RuckSackErrorFileAccess;
-
-    unsigned char buf[MAX(HEADER_ENTRY_LEN, MAIN_HEADER_LEN)];
-    long amt_read = bundle_read(b, buf, MAIN_HEADER_LEN);
-
-    if (amt_read == 0)
-        return RuckSackErrorEmptyFile;
+// makes sure at least wanted_len bytes of the header entries region are
+// available in region. the size of the region is not stored in the bundle,
+// so we start with a guess and read more when the guess was too small.
+static int fill_header_region(struct RuckSackBundlePrivate *b,
+        unsigned char **region, long *region_len, long *region_size, long wanted_len)
+{
+    if (wanted_len <= *region_len)
+        return RuckSackErrorNone;
 
-    if (amt_read != MAIN_HEADER_LEN)
+    // memory bundles hand out the whole rest of the buffer up front
+    if (b->mem_buffer || *region_len < *region_size)
         return RuckSackErrorInvalidFormat;
 
-    if (memcmp(BUNDLE_UUID, buf, UUID_SIZE) != 0)
-        return RuckSackErrorInvalidFormat;
+    long new_size = MAX(2 * *region_size, wanted_len);
+    unsigned char *new_region = realloc(*region, new_size);
+    if (!new_region)
+        return RuckSackErrorNoMem;
+    *region = new_region;
+    *region_size = new_size;
+    *region_len += bundle_read_at(b, b->first_header_offset + *region_len,
+            new_region + *region_len, new_size - *region_len);
 
-    int bundle_version = read_uint32be(&buf[16]);
-    if (bundle_version != BUNDLE_VERSION)
-        return RuckSackErrorWrongVersion;
+    return (wanted_len <= *region_len) ? RuckSackErrorNone : RuckSackErrorInvalidFormat;
+}
 
-    b->first_header_offset = read_uint32be(&buf[20]);
-    b->header_entry_count = read_uint32be(&buf[24]);
-    b->header_entry_mem_count = alloc_count(b->header_entry_count);
-    b->entries = calloc(b->header_entry_mem_count, sizeof(struct RuckSackFileEntry));
+// the flags field of a raw header entry, 0 when it has none
+static uint32_t header_flags(const unsigned char *header) {
+    long int entry_len = read_uint32be(&header[0]);
+    long int flags_pos = HEADER_ENTRY_LEN + read_uint32be(&header[32]) +
+        CODEC_FIELDS_LEN + HASH_FIELD_LEN + CHECKSUM_FIELD_LEN;
+    if (entry_len < flags_pos + FLAGS_FIELD_LEN)
+        return 0;
+    return read_uint32be(&header[flags_pos]);
+}
 
-    if (!b->entries)
-        return RuckSackErrorNoMem;
+static void decode_header_entry(struct RuckSackFileEntry *entry,
+        const unsigned char *header)
+{
+    entry->offset = read_uint64be(&header[4]);
+    entry->size = read_uint64be(&header[12]);
+    entry->allocated_size = read_uint64be(&header[20]);
+    entry->mtime = read_uint32be(&header[28]);
+    entry->key_size = read_uint32be(&header[32]);
+
+    // entries without a codec, content hash, checksum, flags or nanosecond
+    // mtime end with the key
+    long int entry_len = read_uint32be(&header[0]);
+    long int codec_pos = HEADER_ENTRY_LEN + entry->key_size;
+    if (entry_len >= codec_pos + CODEC_FIELDS_LEN) {
+        entry->codec = read_uint32be(&header[codec_pos]);
+        entry->decoded_size = read_uint64be(&header[codec_pos + 4]);
+        entry->chunk_size = read_uint32be(&header[codec_pos + 12]);
+    }
+    if (entry_len >= codec_pos + CODEC_FIELDS_LEN + HASH_FIELD_LEN) {
+        entry->has_content_hash = 1;
+        entry->content_hash = read_uint64be(&header[codec_pos + CODEC_FIELDS_LEN]);
+    }
+    long int checksum_pos = codec_pos + CODEC_FIELDS_LEN + HASH_FIELD_LEN;
+    if (entry_len >= checksum_pos + CHECKSUM_FIELD_LEN) {
+        entry->has_checksum = 1;
+        entry->checksum = read_uint32be(&header[checksum_pos]);
+    }
+    entry->tombstone = (header_flags(header) & ENTRY_FLAG_TOMBSTONE) != 0;
+    entry->codec_skipped = (header_flags(header) & ENTRY_FLAG_CODEC_SKIPPED) != 0;
+    long int mtime_ns_pos = checksum_pos + CHECKSUM_FIELD_LEN + FLAGS_FIELD_LEN;
+    if (entry_len >= mtime_ns_pos + MTIME_NS_FIELD_LEN) {
+        entry->has_mtime_ns = 1;
+        entry->mtime_ns = (int64_t)read_uint64be(&header[mtime_ns_pos]);
+    }
+    // the contents of another entry, which has the allocated bytes
+    entry->shared = entry->size > 0 && entry->allocated_size == 0;
+}
 
-    // calculate how many bytes are used by all the headers
-    b->headers_byte_count = 0; 
+static int index_header_region(struct RuckSackBundlePrivate *b,
+        const unsigned char *region, long region_len)
+{
+    b->lazy_header_offsets = malloc(b->header_entry_count * sizeof(long int));
+    if (!b->lazy_header_offsets)
+        return RuckSackErrorNoMem;
+    int err = index_alloc(b, b->header_entry_count);
+    if (err)
+        return err;
 
-    long int header_offset = b->first_header_offset;
-    for (int i = 0; i < b->header_entry_count; i += 1) {
-        if (bundle_seek(b, header_offset))
-            return RuckSackErrorFileAccess;
-        amt_read = bundle_read(b, buf, HEADER_ENTRY_LEN);
-        if (amt_read != HEADER_ENTRY_LEN)
+    long pos = 0;
+    for (long int i = 0; i < b->header_entry_count; i += 1) {
+        if (pos + HEADER_ENTRY_LEN > region_len)
             return RuckSackErrorInvalidFormat;
-        long int entry_size = read_uint32be(&buf[0]);
-        header_offset += entry_size;
-        struct RuckSackFileEntry *entry = &b->entries[i];
-        entry->offset = read_uint64be(&buf[4]);
-        entry->size = read_uint64be(&buf[12]);
-        entry->allocated_size = read_uint64be(&buf[20]);
-        entry->mtime = read_uint32be(&buf[28]);
-        entry->key_size = read_uint32be(&buf[32]);
-        entry->key = malloc(entry->key_size + 1);
-        if (!entry->key)
-            return RuckSackErrorNoMem;
-        amt_read = bundle_read(b, entry->key, entry->key_size);
-        if (amt_read != entry->key_size)
+        long int entry_size = read_uint32be(&region[pos]);
+        long int key_size = read_uint32be(&region[pos + 32]);
+        if (entry_size < HEADER_ENTRY_LEN + key_size || pos + entry_size > region_len)
             return RuckSackErrorInvalidFormat;
-        entry->key[entry->key_size] = 0;
-        entry->b = b;
-
-        b->headers_byte_count += HEADER_ENTRY_LEN + entry->key_size;
 
-        if (!b->last_entry || entry->offset > b->last_entry->offset)
-            b->last_entry = entry;
-
-        if (!b->first_entry || entry->offset < b->first_entry->offset) {
-            b->first_entry = entry;
-            b->first_file_offset = entry->offset;
-        }
+        // the key is compared in place until the entry is materialized
+        struct RuckSackFileEntry *entry = &b->entries[i];
+        entry->key = (char *)&region[pos + HEADER_ENTRY_LEN];
+        entry->key_size = key_size;
+        entry->borrowed_key = 1;
+        entry->key_hash = hash_key(entry->key, entry->key_size);
+        b->lazy_header_offsets[i] = b->first_header_offset + pos;
+        index_insert_no_grow(b, i);
+
+        b->headers_byte_count += entry_size;
+        pos += entry_size;
     }
 
     return RuckSackErrorNone;
 }
 
-static struct RuckSackFileEntry *get_prev_entry(struct RuckSackBundlePrivate *b,
+static long int lazy_header_offset(struct RuckSackBundlePrivate *b, long int entry_index) {
+    if (b->lazy_header_offsets)
+        return b->lazy_header_offsets[entry_index];
+    return b->first_header_offset + read_uint32be(&b->dir_offsets[4 * entry_index]);
+}
+
+// returns the raw header of an entry of a lazy bundle, or NULL if it does not
+// fit in the buffer
+static const unsigned char *lazy_header(struct RuckSackBundlePrivate *b, long int entry_index) {
+    long int header_offset = lazy_header_offset(b, entry_index);
+    if (header_offset + HEADER_ENTRY_LEN > b->mem_buffer_size)
+        return NULL;
+    const unsigned char *header = (const unsigned char *)b->mem_buffer + header_offset;
+    long int entry_size = read_uint32be(&header[0]);
+    long int key_size = read_uint32be(&header[32]);
+    if (entry_size < HEADER_ENTRY_LEN + key_size || header_offset + entry_size > b->mem_buffer_size)
+        return NULL;
+    return header;
+}
+
+// whether a lazy entry has been decoded. the b field is set last.
+static bool entry_materialized(struct RuckSackFileEntry *entry) {
+    return __atomic_load_n(&entry->b, __ATOMIC_ACQUIRE) != NULL;
+}
+
+static int materialize_entry_locked(struct RuckSackBundlePrivate *b,
         struct RuckSackFileEntry *entry)
 {
-    struct RuckSackFileEntry *prev = NULL;
-    for (int i = 0; i < b->header_entry_count; i += 1) {
-        struct RuckSackFileEntry *e = &b->entries[i];
+    if (entry->b)
+        return RuckSackErrorNone;
 
-        if (e->offset < entry->offset && (!prev || e->offset > prev->offset))
-            prev = e;
-    }
-    return prev;
+    const unsigned char *header = lazy_header(b, entry - b->entries);
+    if (!header)
+        return RuckSackErrorInvalidFormat;
+
+    long int key_size = read_uint32be(&header[32]);
+    char *key = malloc(key_size + 1);
+    if (!key)
+        return RuckSackErrorNoMem;
+    memcpy(key, &header[HEADER_ENTRY_LEN], key_size);
+    key[key_size] = 0;
+
+    decode_header_entry(entry, header);
+    entry->key = key;
+    entry->key_hash = hash_key(key, entry->key_size);
+    entry->borrowed_key = 0;
+    __atomic_store_n(&entry->b, b, __ATOMIC_RELEASE);
+    return RuckSackErrorNone;
 }
 
-static struct RuckSackFileEntry *get_next_entry(struct RuckSackBundlePrivate *b,
+static int materialize_entry(struct RuckSackBundlePrivate *b,
         struct RuckSackFileEntry *entry)
 {
-    struct RuckSackFileEntry *next = NULL;
-    for (int i = 0; i < b->header_entry_count; i += 1) {
-        struct RuckSackFileEntry *e = &b->entries[i];
+    if (entry_materialized(entry))
+        return RuckSackErrorNone;
+    pthread_mutex_lock(&b->lazy_mutex);
+    int err = materialize_entry_locked(b, entry);
+    pthread_mutex_unlock(&b->lazy_mutex);
+    return err;
+}
 
-        if (e->offset > entry->offset && (!next || e->offset < next->offset))
-            next = e;
+// looks a key up in the hash table of the key directory. no header entries
+// are decoded, so the returned entry may not be materialized yet.
+static struct RuckSackFileEntry *directory_find(struct RuckSackBundlePrivate *b,
+        const char *key, int key_size)
+{
+    uint32_t hash = hash_key(key, key_size);
+    long int mask = b->dir_slot_count - 1;
+    long int slot = hash & mask;
+    for (long int i = 0; i < b->dir_slot_count; i += 1) {
+        const unsigned char *ptr = &b->dir_slots[DIRECTORY_SLOT_LEN * slot];
+        long int entry_number = read_uint32be(&ptr[4]);
+        if (!entry_number)
+            return NULL;
+        if (read_uint32be(&ptr[0]) == hash && entry_number <= b->header_entry_count) {
+            const unsigned char *header = lazy_header(b, entry_number - 1);
+            if (header && memneql(key, key_size, (const char *)&header[HEADER_ENTRY_LEN],
+                        read_uint32be(&header[32])) == 0)
+            {
+                return &b->entries[entry_number - 1];
+            }
+        }
+        slot = (slot + 1) & mask;
     }
-    return next;
+    return NULL;
 }
 
-static int copy_data(struct RuckSackBundlePrivate *b, long int source,
-        long int dest, long int size)
+// sets up the key directory of a version 2 bundle so that lazy bundles can
+// skip walking the header entries altogether
+static int use_directory(struct RuckSackBundlePrivate *b, long int dir_offset,
+        long int slot_count)
 {
-    if (source == dest)
-        return RuckSackErrorNone;
+    if (slot_count < 1 || (slot_count & (slot_count - 1)) != 0)
+        return RuckSackErrorInvalidFormat;
+    if (dir_offset < b->first_header_offset || dir_offset > b->mem_buffer_size)
+        return RuckSackErrorInvalidFormat;
+    long int dir_size = 8 * b->header_entry_count + DIRECTORY_SLOT_LEN * slot_count;
+    if (dir_size > b->mem_buffer_size - dir_offset)
+        return RuckSackErrorInvalidFormat;
 
-    const long int max_buf_size = 1048576;
-    long int buf_size = MIN(max_buf_size, size);
-    char *buffer = malloc(buf_size);
+    const unsigned char *dir = (const unsigned char *)b->mem_buffer + dir_offset;
+    b->dir_offsets = dir;
+    b->dir_slots = dir + 8 * b->header_entry_count;
+    b->dir_slot_count = slot_count;
+    // the directory immediately follows the header entries
+    b->headers_byte_count = dir_offset - b->first_header_offset;
+    return RuckSackErrorNone;
+}
 
-    if (!buffer)
-        return RuckSackErrorNoMem;
+// forgets all holes, then records one for every gap between neighbouring
+// extents
+static void holes_from_gaps(struct RuckSackBundlePrivate *b) {
+    memset(b->hole_lists, 0, sizeof(b->hole_lists));
+    b->unused_holes = 0;
+    for (long int i = b->extent_mem_count - 1; i >= 0; i -= 1) {
+        b->holes[i].next = b->unused_holes;
+        b->unused_holes = i + 1;
+    }
+    for (long int i = 0; i < b->header_entry_count; i += 1)
+        b->entries[i].hole = 0;
+    for (long int i = 0; i < b->reserved_count; i += 1)
+        b->reserved[i].hole = 0;
+
+    for (long int i = 0; i + 1 < b->by_offset_count; i += 1) {
+        long int end = extent_end(b, b->by_offset[i]);
+        long int next_offset = extent_at(b, b->by_offset[i + 1])->offset;
+        if (next_offset > end)
+            hole_add(b, b->by_offset[i], end, next_offset - end);
+    }
+}
 
-    while (size > 0) {
-        long int amt_to_read = MIN(buf_size, size);
-        if (fseek(b->f, source, SEEK_SET)) {
-            free(buffer);
-            return RuckSackErrorFileAccess;
-        }
-        if (fread(buffer, 1, amt_to_read, b->f) != amt_to_read) {
-            free(buffer);
-            return RuckSackErrorFileAccess;
-        }
-        if (fseek(b->f, dest, SEEK_SET)) {
-            free(buffer);
-            return RuckSackErrorFileAccess;
+// sets up by_offset and the holes of a bundle which was just opened for
+// writing. the header region it was opened at is the only reserved extent.
+static int extents_build(struct RuckSackBundlePrivate *b) {
+    int err = reserved_add(b, b->first_header_offset, b->header_region_len, &b->header_extent);
+    if (err)
+        return err;
+
+    long int count = b->header_entry_count;
+    struct RuckSackFileEntry **sorted = malloc(count * sizeof(struct RuckSackFileEntry *));
+    if (count > 0 && !sorted)
+        return RuckSackErrorNoMem;
+    for (long int i = 0; i < count; i += 1)
+        sorted[i] = &b->entries[i];
+    qsort(sorted, count, sizeof(struct RuckSackFileEntry *), compare_entry_offsets);
+
+    // entries which share an extent sort before the one it belongs to, as
+    // their allocated size is 0
+    long int extent_count = 0;
+    long int shared_count = 0;
+    long int shared_offset = 0;
+    for (long int i = 0; i < count; i += 1) {
+        struct RuckSackFileEntry *entry = sorted[i];
+        if (shared_count && entry->offset != shared_offset)
+            break;
+        if (entry->shared) {
+            shared_count += 1;
+            shared_offset = entry->offset;
+            continue;
         }
-        if (fwrite(buffer, 1, amt_to_read, b->f) != amt_to_read) {
-            free(buffer);
-            return RuckSackErrorFileAccess;
+        if (shared_count && entry->allocated_size > 0) {
+            entry->shares = shared_count;
+            shared_count = 0;
         }
-        size -= amt_to_read;
-        source += amt_to_read;
-        dest += amt_to_read;
+        b->by_offset[extent_count++] = entry_ref(b, entry);
     }
-
-    free(buffer);
+    free(sorted);
+    if (shared_count)
+        return RuckSackErrorInvalidFormat;
+    b->by_offset_count = extent_count;
+
+    struct RuckSackFileEntry *header = extent_at(b, b->header_extent);
+    long int pos = offset_lower_bound(b, header->offset + 1);
+    memmove(&b->by_offset[pos + 1], &b->by_offset[pos],
+            (extent_count - pos) * sizeof(long int));
+    b->by_offset[pos] = b->header_extent;
+    b->by_offset_count += 1;
+
+    // space that is not needed for an entry to grow is given back. older
+    // versions added the space of a deleted entry to the one before it.
+    for (long int i = 0; i + 1 < b->by_offset_count; i += 1) {
+        if (b->by_offset[i] < 0)
+            continue;
+        struct RuckSackFileEntry *entry = extent_at(b, b->by_offset[i]);
+        entry->allocated_size = MIN(entry->allocated_size, alloc_size(entry->size));
+    }
+    holes_from_gaps(b);
     return RuckSackErrorNone;
 }
 
-static void allocate_file(struct RuckSackBundlePrivate *b, long int size,
-        struct RuckSackFileEntry *entry, char precise)
-{
-    entry->allocated_size = size;
-
-    long int wanted_headers_alloc_bytes = alloc_size_precise(precise, b->headers_byte_count);
-    long int wanted_headers_alloc_end = precise ? b->first_file_offset :
-        (b->first_header_offset + wanted_headers_alloc_bytes);
-
-    // can we put it between the header and the first entry?
-    if (b->first_entry) {
-        long int extra = b->first_entry->offset - wanted_headers_alloc_end;
-        if (extra >= entry->allocated_size) {
-            // we can fit it here
-            entry->offset = b->first_entry->offset - entry->allocated_size;
-            b->first_entry = entry;
-            b->first_file_offset = entry->offset;
-            return;
+// returns the superblock in the main header with the highest generation whose
+// checksum matches, or NULL if neither is valid
+static const unsigned char *newest_superblock(const unsigned char *main_header) {
+    const unsigned char *newest = NULL;
+    uint64_t newest_generation = 0;
+    for (int slot = 0; slot < 2; slot += 1) {
+        const unsigned char *superblock = &main_header[SUPERBLOCK_OFFSET + SUPERBLOCK_LEN * slot];
+        uint64_t generation = read_uint64be(&superblock[0]);
+        uint32_t crc = read_uint32be(&superblock[SUPERBLOCK_LEN - 4]);
+        if (generation > newest_generation &&
+            rucksack_crc32c(0, superblock, SUPERBLOCK_LEN - 4) == crc)
+        {
+            newest = superblock;
+            newest_generation = generation;
         }
     }
+    return newest;
+}
 
-    // figure out offset and allocated_size
-    // find a file that has too much allocated room and stick it there
-    for (int i = 0; i < b->header_entry_count; i += 1) {
-        struct RuckSackFileEntry *e = &b->entries[i];
-
-        // don't overwrite a stream!
-        if (e->is_open || e == entry) continue;
-
-        // don't put it somewhere that is likely to 
-        if (e->offset < wanted_headers_alloc_end) continue;
-
-        long int needed_alloc_size = alloc_size_precise(precise, e->size);
-        long int extra = e->allocated_size - needed_alloc_size;
-
-        // not enough room.
-        if (extra < entry->allocated_size) continue;
-
-        long int new_offset = e->offset + needed_alloc_size;
+static int read_header(struct RuckSackBundlePrivate *b) {
+    unsigned char buf[MAIN_HEADER_LEN];
+    long amt_read = bundle_read_at(b, 0, buf, MAIN_HEADER_LEN);
 
-        // don't put it too close to the headers
-        if (new_offset < wanted_headers_alloc_end) continue;
+    if (amt_read == 0)
+        return RuckSackErrorEmptyFile;
 
-        // we can fit it here!
-        entry->offset = new_offset;
-        entry->allocated_size = extra;
-        e->allocated_size = needed_alloc_size;
+    if (amt_read < MAIN_HEADER_LEN_V1)
+        return RuckSackErrorInvalidFormat;
 
-        if (e == b->last_entry)
-            b->last_entry = entry;
+    if (memcmp(BUNDLE_UUID, buf, UUID_SIZE) != 0)
+        return RuckSackErrorInvalidFormat;
 
-        return;
-    }
+    int bundle_version = read_uint32be(&buf[16]);
+    if (bundle_version != BUNDLE_VERSION && bundle_version != 1)
+        return RuckSackErrorWrongVersion;
 
-    // ok stick it at the end
-    if (b->last_entry) {
-        if (!b->last_entry->is_open)
-            b->last_entry->allocated_size = alloc_size_precise(precise, b->last_entry->size);
-        entry->offset = MAX(b->last_entry->offset + b->last_entry->allocated_size,
-                wanted_headers_alloc_end);
-        b->last_entry = entry;
+    long int dir_offset = 0;
+    long int dir_slot_count = 0;
+    if (bundle_version == BUNDLE_VERSION) {
+        if (amt_read != MAIN_HEADER_LEN)
+            return RuckSackErrorInvalidFormat;
+        // a crash while committing leaves the previous generation intact
+        const unsigned char *superblock = newest_superblock(buf);
+        if (!superblock)
+            return RuckSackErrorInvalidFormat;
+        b->generation = read_uint64be(&superblock[0]);
+        b->first_header_offset = read_uint64be(&superblock[8]);
+        b->header_entry_count = read_uint32be(&superblock[16]);
+        dir_offset = read_uint64be(&superblock[20]);
+        dir_slot_count = read_uint32be(&superblock[28]);
+        b->header_region_len = read_uint32be(&superblock[32]);
+        b->alignment = read_uint32be(&superblock[36]);
+        if (!valid_alignment(b->alignment))
+            return RuckSackErrorInvalidFormat;
     } else {
-        // this is the first entry in the bundle
-        long this_entry_header_len = HEADER_ENTRY_LEN + entry->key_size;
-        long min_offset = b->first_header_offset +
-            (precise ? this_entry_header_len : alloc_size(this_entry_header_len * 10));
-        b->first_file_offset = (b->first_file_offset < min_offset) ?
-            min_offset : b->first_file_offset;
-        entry->offset = b->first_file_offset;
-        b->first_entry = entry;
-        b->last_entry = entry;
+        b->first_header_offset = read_uint32be(&buf[20]);
+        b->header_entry_count = read_uint32be(&buf[24]);
     }
-}
+    // read-only bundles never get more entries
+    b->header_entry_mem_count = b->read_only ?
+        b->header_entry_count : alloc_count(b->header_entry_count);
+    b->entries = calloc(b->header_entry_mem_count, sizeof(struct RuckSackFileEntry));
 
+    if (!b->entries)
+        return RuckSackErrorNoMem;
 
-static int resize_file_entry(struct RuckSackBundlePrivate *b,
-        struct RuckSackFileEntry *entry, long int size, char precise)
+    // get all the header entries into memory with a single read
+    unsigned char *region;
+    long region_len;
+    long region_size;
+    if (b->mem_buffer) {
+        if (b->first_header_offset > b->mem_buffer_size)
+            return RuckSackErrorInvalidFormat;
+        region = (unsigned char *)b->mem_buffer + b->first_header_offset;
+        region_len = b->mem_buffer_size - b->first_header_offset;
+        region_size = region_len;
+        if (b->lazy && bundle_version == BUNDLE_VERSION)
+            return use_directory(b, dir_offset, dir_slot_count);
+        if (b->lazy)
+            return index_header_region(b, region, region_len);
+    } else {
+        region_size = (bundle_version == BUNDLE_VERSION) ? b->header_region_len :
+            b->header_entry_count * (HEADER_ENTRY_LEN + 32);
+        region = malloc(region_size);
+        if (!region)
+            return RuckSackErrorNoMem;
+        region_len = bundle_read_at(b, b->first_header_offset, region, region_size);
+    }
+
+    // first pass: find out how much room all the keys need
+    int err = RuckSackErrorNone;
+    long key_bytes = 0;
+    long pos = 0;
+    for (long int i = 0; i < b->header_entry_count; i += 1) {
+        err = fill_header_region(b, &region, &region_len, &region_size, pos + HEADER_ENTRY_LEN);
+        if (err)
+            break;
+        long int entry_size = read_uint32be(&region[pos]);
+        long int key_size = read_uint32be(&region[pos + 32]);
+        if (entry_size < HEADER_ENTRY_LEN + key_size) {
+            err = RuckSackErrorInvalidFormat;
+            break;
+        }
+        err = fill_header_region(b, &region, &region_len, &region_size, pos + entry_size);
+        if (err)
+            break;
+        key_bytes += key_size + 1;
+        pos += entry_size;
+    }
+
+    // second pass: fill in the entries, with all keys in one allocation
+    if (!err && key_bytes > 0) {
+        b->key_arena = malloc(key_bytes);
+        if (!b->key_arena)
+            err = RuckSackErrorNoMem;
+    }
+
+    char *key_ptr = b->key_arena;
+    pos = 0;
+    for (long int i = 0; !err && i < b->header_entry_count; i += 1) {
+        const unsigned char *header = &region[pos];
+        struct RuckSackFileEntry *entry = &b->entries[i];
+        decode_header_entry(entry, header);
+        entry->key = key_ptr;
+        entry->borrowed_key = 1;
+        memcpy(entry->key, &header[HEADER_ENTRY_LEN], entry->key_size);
+        entry->key[entry->key_size] = 0;
+        key_ptr += entry->key_size + 1;
+        entry->key_hash = hash_key(entry->key, entry->key_size);
+        entry->b = b;
+
+        entry->committed = 1;
+
+        b->headers_byte_count += header_entry_len(entry);
+
+        pos += read_uint32be(&header[0]);
+    }
+
+    if (!b->mem_buffer)
+        free(region);
+
+    if (err)
+        return err;
+
+    // version 1 bundles have no key directory
+    if (bundle_version != BUNDLE_VERSION)
+        b->header_region_len = b->headers_byte_count;
+    b->first_file_offset = MAIN_HEADER_LEN;
+
+    if (!b->read_only) {
+        err = extents_build(b);
+        if (err)
+            return err;
+    }
+
+    return index_reserve(b, b->header_entry_count);
+}
+
+// copies through a buffer which is kept around for the next move. when the
+// ranges overlap the copy goes from the end so nothing is overwritten before
+// it is read.
+static int copy_data_buffered(struct RuckSackBundlePrivate *b, long int source,
+        long int dest, long int size)
 {
-    if (entry == b->last_entry) {
-        // well that was easy
-        entry->allocated_size = size;
+    const long int max_buf_size = 1048576;
+    long int buf_size = MIN(max_buf_size, size);
+    if (b->copy_buffer_size < buf_size) {
+        char *new_buffer = realloc(b->copy_buffer, buf_size);
+        if (!new_buffer)
+            return RuckSackErrorNoMem;
+        b->copy_buffer = new_buffer;
+        b->copy_buffer_size = buf_size;
+    }
+
+    bool backward = dest > source && dest < source + size;
+    while (size > 0) {
+        long int amt = MIN(buf_size, size);
+        long int from = backward ? source + size - amt : source;
+        long int to = backward ? dest + size - amt : dest;
+        if (bundle_read_at(b, from, b->copy_buffer, amt) != amt)
+            return RuckSackErrorFileAccess;
+        if (bundle_write_at(b, to, b->copy_buffer, amt))
+            return RuckSackErrorFileAccess;
+        size -= amt;
+        if (!backward) {
+            source += amt;
+            dest += amt;
+        }
+    }
+
+    return RuckSackErrorNone;
+}
+
+static int copy_data(struct RuckSackBundlePrivate *b, long int source,
+        long int dest, long int size)
+{
+    if (source == dest || size == 0)
+        return RuckSackErrorNone;
+
+#ifdef RUCKSACK_HAVE_COPY_FILE_RANGE
+    // let the kernel copy without the data passing through user space. it
+    // refuses overlapping ranges in the same file, and some file systems do
+    // not support it, in which case we finish with the buffered copy.
+    if (source + size <= dest || dest + size <= source) {
+        int fd = fileno(b->f);
+        off64_t off_in = source;
+        off64_t off_out = dest;
+        while (size > 0) {
+            ssize_t amt = copy_file_range(fd, &off_in, fd, &off_out, size, 0);
+            if (amt == -1 && errno == EINTR)
+                continue;
+            if (amt <= 0)
+                break;
+            size -= amt;
+        }
+        source = off_in;
+        dest = off_out;
+        if (size == 0)
+            return RuckSackErrorNone;
+    }
+#endif
+
+    return copy_data_buffered(b, source, dest, size);
+}
+
+static void init_new_bundle(struct RuckSackBundlePrivate *b, long headers_size) {
+    b->first_header_offset = MAIN_HEADER_LEN;
+    long allocated_header_bytes = (headers_size == -1) ?
+        alloc_size(HEADER_ENTRY_LEN * 10) : headers_size;
+    b->first_file_offset = b->first_header_offset + allocated_header_bytes;
+}
+
+// finds the smallest hole with room for size bytes at its end at a multiple
+// of alignment, not before min_offset. returns the index of the hole plus
+// one, or 0 if none.
+static long int hole_best_fit(struct RuckSackBundlePrivate *b, long int size,
+        long int min_offset, long int alignment)
+{
+    for (int size_class = hole_class(size); size_class < HOLE_CLASS_COUNT; size_class += 1) {
+        long int best = 0;
+        long int best_size = 0;
+        for (long int i = b->hole_lists[size_class]; i; i = b->holes[i - 1].next) {
+            struct RuckSackHole *hole = &b->holes[i - 1];
+            long int start = MAX(hole->offset, min_offset);
+            long int end = hole->offset + hole->size;
+            long int usable = end - start;
+            if (align_down(end - size, alignment) >= start && (!best || usable < best_size)) {
+                best = i;
+                best_size = usable;
+            }
+        }
+        if (best)
+            return best;
+    }
+    return 0;
+}
+
+// entries with a content hash are in the content index, shared or not, so
+// the entries sharing an extent are in the chain of the one which owns it
+static bool content_indexable(const struct RuckSackFileEntry *entry) {
+    return entry->has_content_hash && entry->size > 0 && !entry->is_open;
+}
+
+static void content_index_insert_no_grow(struct RuckSackBundlePrivate *b, long int entry_index) {
+    long int mask = b->content_slot_count - 1;
+    long int slot = b->entries[entry_index].content_hash & mask;
+    while (b->content_index[slot])
+        slot = (slot + 1) & mask;
+    b->content_index[slot] = entry_index + 1;
+    b->content_used_count += 1;
+}
+
+// builds the index from scratch with room for one more entry, leaving out
+// the entry at skip
+static int content_index_build(struct RuckSackBundlePrivate *b, long int skip) {
+    long int slot_count = index_slot_count_for(b->header_entry_count + 1);
+    long int *new_index = calloc(slot_count, sizeof(long int));
+    if (!new_index)
+        return RuckSackErrorNoMem;
+    free(b->content_index);
+    b->content_index = new_index;
+    b->content_slot_count = slot_count;
+    b->content_used_count = 0;
+    for (long int i = 0; i < b->header_entry_count; i += 1) {
+        if (i != skip && content_indexable(&b->entries[i]))
+            content_index_insert_no_grow(b, i);
+    }
+    return RuckSackErrorNone;
+}
+
+// makes room for one more entry, building the index when there is none or
+// it is full. skip is the entry about to be inserted.
+static int content_index_reserve(struct RuckSackBundlePrivate *b, long int skip) {
+    if (b->content_index && 2 * (b->content_used_count + 1) <= b->content_slot_count)
+        return RuckSackErrorNone;
+    return content_index_build(b, skip);
+}
+
+// returns the slot which refers to the entry, or -1 if it is not indexed
+static long int content_index_slot_of_entry(struct RuckSackBundlePrivate *b,
+        long int entry_index)
+{
+    if (!b->content_index || !content_indexable(&b->entries[entry_index]))
+        return -1;
+    long int mask = b->content_slot_count - 1;
+    long int slot = b->entries[entry_index].content_hash & mask;
+    for (; b->content_index[slot]; slot = (slot + 1) & mask) {
+        if (b->content_index[slot] == entry_index + 1)
+            return slot;
+    }
+    return -1;
+}
+
+// backward shift deletion, like index_remove_slot
+static void content_index_remove_slot(struct RuckSackBundlePrivate *b, long int slot) {
+    long int mask = b->content_slot_count - 1;
+    long int hole = slot;
+    for (long int i = (slot + 1) & mask; b->content_index[i]; i = (i + 1) & mask) {
+        long int home = b->entries[b->content_index[i] - 1].content_hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            b->content_index[hole] = b->content_index[i];
+            hole = i;
+        }
+    }
+    b->content_index[hole] = 0;
+    b->content_used_count -= 1;
+}
+
+// called before the contents of an entry change
+static void content_index_remove(struct RuckSackBundlePrivate *b, long int entry_index) {
+    long int slot = content_index_slot_of_entry(b, entry_index);
+    if (slot != -1)
+        content_index_remove_slot(b, slot);
+}
+
+static void content_index_drop(struct RuckSackBundlePrivate *b) {
+    free(b->content_index);
+    b->content_index = NULL;
+    b->content_slot_count = 0;
+    b->content_used_count = 0;
+}
+
+// returns the entry which the extent of a shared entry belongs to
+static struct RuckSackFileEntry *shared_owner(struct RuckSackBundlePrivate *b,
+        struct RuckSackFileEntry *entry)
+{
+    // empty extents can be at the same offset
+    long int pos = offset_lower_bound(b, entry->offset);
+    while (extent_at(b, b->by_offset[pos])->allocated_size == 0)
+        pos += 1;
+    return extent_at(b, b->by_offset[pos]);
+}
+
+// gives the extent of an entry to heir, one of the entries sharing it, which
+// takes the place of the entry in by_offset
+static void hand_over_extent(struct RuckSackBundlePrivate *b,
+        struct RuckSackFileEntry *entry, struct RuckSackFileEntry *heir)
+{
+    long int ref = entry_ref(b, heir);
+    b->by_offset[offset_position(b, entry_ref(b, entry))] = ref;
+    heir->allocated_size = entry->allocated_size;
+    heir->hole = entry->hole;
+    if (heir->hole)
+        b->holes[heir->hole - 1].owner = ref;
+    heir->shared = 0;
+    heir->shares = entry->shares - 1;
+    // the last header may refer to the extent through either of them
+    heir->committed |= entry->committed;
+    entry->hole = 0;
+    entry->shares = 0;
+    entry->committed = 0;
+}
+
+// gives the space of an entry back before it is deleted or moved, removing
+// it from by_offset. the extent stays reserved until the next commit if the
+// last written header refers to it, and stays in use while other entries
+// share it.
+static int release_extent(struct RuckSackBundlePrivate *b, struct RuckSackFileEntry *entry) {
+    if (entry->shared) {
+        struct RuckSackFileEntry *owner = shared_owner(b, entry);
+        owner->shares -= 1;
+        owner->committed |= entry->committed;
+        entry->shared = 0;
+        entry->committed = 0;
+        return RuckSackErrorNone;
+    }
+    if (entry->shares) {
+        // the entries sharing the extent have the same contents
+        if (!b->content_index) {
+            int err = content_index_build(b, -1);
+            if (err)
+                return err;
+        }
+        long int mask = b->content_slot_count - 1;
+        long int slot = entry->content_hash & mask;
+        for (; b->content_index[slot]; slot = (slot + 1) & mask) {
+            struct RuckSackFileEntry *heir = &b->entries[b->content_index[slot] - 1];
+            if (heir->shared && heir->offset == entry->offset) {
+                hand_over_extent(b, entry, heir);
+                return RuckSackErrorNone;
+            }
+        }
+    }
+
+    long int ref = entry_ref(b, entry);
+    if (!entry->committed) {
+        extent_remove(b, ref);
         return RuckSackErrorNone;
-    } else if (entry == b->first_entry) {
-        b->first_entry = get_next_entry(b, entry);
-        b->first_file_offset = b->first_entry->offset;
+    }
+
+    long int reserved_ref;
+    int err = reserved_add(b, entry->offset, entry->allocated_size, &reserved_ref);
+    if (err)
+        return err;
+    // the reserved extent takes the place of the entry, hole and all
+    struct RuckSackFileEntry *extent = extent_at(b, reserved_ref);
+    b->by_offset[offset_position(b, ref)] = reserved_ref;
+    extent->hole = entry->hole;
+    if (extent->hole)
+        b->holes[extent->hole - 1].owner = reserved_ref;
+    entry->hole = 0;
+    entry->committed = 0;
+    return RuckSackErrorNone;
+}
+
+static void allocate_file(struct RuckSackBundlePrivate *b, long int size,
+        struct RuckSackFileEntry *entry, char precise)
+{
+    entry->allocated_size = size;
+
+    long int wanted_headers_alloc_bytes = alloc_size_precise(precise, header_region_size(b));
+    long int wanted_headers_alloc_end = precise ? b->first_file_offset :
+        (MAIN_HEADER_LEN + wanted_headers_alloc_bytes);
+
+    long int alignment = b->alignment;
+    long int first = first_extent(b);
+    long int last = last_extent(b);
+    long int hole_index;
+    if (first && align_down(extent_at(b, first)->offset - size, alignment) >=
+            wanted_headers_alloc_end)
+    {
+        // put it between the header and the first extent
+        entry->offset = align_down(extent_at(b, first)->offset - size, alignment);
+    } else if ((hole_index = hole_best_fit(b, size, wanted_headers_alloc_end, alignment))) {
+        // put it at the end of the hole that fits best, so that the rest of
+        // the hole still follows the same extent
+        struct RuckSackHole *hole = &b->holes[hole_index - 1];
+        entry->offset = align_down(hole->offset + hole->size - size, alignment);
+    } else if (last) {
+        // ok stick it at the end
+        struct RuckSackFileEntry *last_entry = extent_at(b, last);
+        if (last > 0 && !last_entry->is_open)
+            last_entry->allocated_size = alloc_size_precise(precise, last_entry->size);
+        entry->offset = align_up(MAX(extent_end(b, last), wanted_headers_alloc_end), alignment);
     } else {
-        struct RuckSackFileEntry *prev = get_prev_entry(b, entry);
-        prev->allocated_size += entry->allocated_size;
+        // this is the first extent in the bundle
+        entry->offset = align_up(precise ? b->first_file_offset : wanted_headers_alloc_end,
+                alignment);
     }
 
+    extent_insert(b, entry_ref(b, entry));
+}
+
+// copy is false when the contents of the entry are about to be replaced
+static int move_file_entry(struct RuckSackBundlePrivate *b,
+        struct RuckSackFileEntry *entry, long int size, char precise, bool copy)
+{
     // pick a new place for the entry
     long int old_offset = entry->offset;
+    int err = release_extent(b, entry);
+    if (err)
+        return err;
     allocate_file(b, size, entry, precise);
 
     // copy the old data to the new location
-    return copy_data(b, old_offset, entry->offset, entry->size);
+    return copy ? copy_data(b, old_offset, entry->offset, entry->size) : RuckSackErrorNone;
 }
 
-static int write_header(struct RuckSackBundlePrivate *b) {
-    FILE *f = b->f;
-    if (fseek(f, 0, SEEK_SET))
-        return RuckSackErrorFileAccess;
+static int resize_file_entry(struct RuckSackBundlePrivate *b,
+        struct RuckSackFileEntry *entry, long int size, char precise)
+{
+    long int ref = entry_ref(b, entry);
+    if (ref == last_extent(b)) {
+        // well that was easy
+        entry->allocated_size = size;
+        return RuckSackErrorNone;
+    }
 
-    unsigned char buf[MAX(MAIN_HEADER_LEN, HEADER_ENTRY_LEN)];
-    memcpy(buf, BUNDLE_UUID, UUID_SIZE);
-    write_uint32be(&buf[16], BUNDLE_VERSION);
-    write_uint32be(&buf[20], b->first_header_offset);
-    write_uint32be(&buf[24], b->header_entry_count);
-    long int amt_written = fwrite(buf, 1, MAIN_HEADER_LEN, f);
-    if (amt_written != MAIN_HEADER_LEN)
+    // grow into the hole after the entry if it is big enough
+    long int wanted = size - entry->allocated_size;
+    if (entry->hole && b->holes[entry->hole - 1].size >= wanted) {
+        hole_shrink(b, ref, wanted);
+        entry->allocated_size = size;
+        return RuckSackErrorNone;
+    }
+
+    return move_file_entry(b, entry, size, precise, true);
+}
+
+static int compare_entry_keys(const void *a, const void *b) {
+    const struct RuckSackFileEntry *entry_a = *(struct RuckSackFileEntry * const *)a;
+    const struct RuckSackFileEntry *entry_b = *(struct RuckSackFileEntry * const *)b;
+    int cmp = memcmp(entry_a->key, entry_b->key, MIN(entry_a->key_size, entry_b->key_size));
+    if (cmp)
+        return cmp;
+    return entry_a->key_size - entry_b->key_size;
+}
+
+// fills in the key directory at dir. offsets holds the offset of each header
+// entry relative to the first one.
+static int write_directory(struct RuckSackBundlePrivate *b, unsigned char *dir,
+        const long int *offsets)
+{
+    long int count = b->header_entry_count;
+    unsigned char *sorted = dir + 4 * count;
+    unsigned char *slots = dir + 8 * count;
+
+    for (long int i = 0; i < count; i += 1)
+        write_uint32be(&dir[4 * i], offsets[i]);
+
+    struct RuckSackFileEntry **by_key = malloc(count * sizeof(struct RuckSackFileEntry *));
+    if (count > 0 && !by_key)
+        return RuckSackErrorNoMem;
+    for (long int i = 0; i < count; i += 1)
+        by_key[i] = &b->entries[i];
+    qsort(by_key, count, sizeof(struct RuckSackFileEntry *), compare_entry_keys);
+    for (long int i = 0; i < count; i += 1)
+        write_uint32be(&sorted[4 * i], by_key[i] - b->entries);
+    free(by_key);
+
+    long int slot_count = directory_slot_count_for(count);
+    long int mask = slot_count - 1;
+    memset(slots, 0, DIRECTORY_SLOT_LEN * slot_count);
+    for (long int i = 0; i < count; i += 1) {
+        struct RuckSackFileEntry *entry = &b->entries[i];
+        long int slot = entry->key_hash & mask;
+        while (read_uint32be(&slots[DIRECTORY_SLOT_LEN * slot + 4]))
+            slot = (slot + 1) & mask;
+        write_uint32be(&slots[DIRECTORY_SLOT_LEN * slot], entry->key_hash);
+        write_uint32be(&slots[DIRECTORY_SLOT_LEN * slot + 4], i + 1);
+    }
+
+    return RuckSackErrorNone;
+}
+
+// puts the header region of a new generation in free space, right after the
+// main header if there is room
+static void allocate_header(struct RuckSackBundlePrivate *b, long int ref) {
+    struct RuckSackFileEntry *header = extent_at(b, ref);
+    long int first = first_extent(b);
+    long int hole_index;
+    if (!first || extent_at(b, first)->offset - MAIN_HEADER_LEN >= header->allocated_size) {
+        header->offset = MAIN_HEADER_LEN;
+    } else if ((hole_index = hole_best_fit(b, header->allocated_size, MAIN_HEADER_LEN, 1))) {
+        header->offset = MAX(b->holes[hole_index - 1].offset, MAIN_HEADER_LEN);
+    } else {
+        header->offset = MAX(extent_end(b, last_extent(b)), MAIN_HEADER_LEN);
+    }
+    extent_insert(b, ref);
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+// the mtime of new entries
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * NS_PER_SECOND + ts.tv_nsec;
+}
+
+static int64_t stat_mtime_ns(const struct stat *st) {
+#ifdef RUCKSACK_HAVE_STAT_MTIM
+    return (int64_t)st->st_mtim.tv_sec * NS_PER_SECOND + st->st_mtim.tv_nsec;
+#else
+    return (int64_t)st->st_mtime * NS_PER_SECOND;
+#endif
+}
+
+static int sync_bundle(struct RuckSackBundlePrivate *b) {
+    if (b->durability == RuckSackDurabilityNone)
+        return RuckSackErrorNone;
+    double start = now_seconds();
+    int err = fsync(fileno(b->f));
+    b->sync_stats.sync_count += 1;
+    b->sync_stats.sync_seconds += now_seconds() - start;
+    return err ? RuckSackErrorFileAccess : RuckSackErrorNone;
+}
+
+// cuts off the file after the last extent, such as where the contents of a
+// file were written before it turned out to share the extent of another one.
+// the room a file has to grow into is not written until it grows.
+static int trim_bundle(struct RuckSackBundlePrivate *b) {
+    long int last = last_extent(b);
+    struct RuckSackFileEntry *extent = extent_at(b, last);
+    long int end = extent->offset + ((last > 0) ? extent->size : extent->allocated_size);
+    struct stat st;
+    if (fstat(fileno(b->f), &st))
         return RuckSackErrorFileAccess;
+    if (st.st_size <= end)
+        return RuckSackErrorNone;
+    return ftruncate(fileno(b->f), end) ? RuckSackErrorFileAccess : RuckSackErrorNone;
+}
 
-    long int allocated_header_bytes = b->first_file_offset - b->first_header_offset;
-    if (b->headers_byte_count > allocated_header_bytes) {
-        long int wanted_entry_bytes = alloc_size(b->headers_byte_count);
-        long int wanted_offset_end = b->first_header_offset + wanted_entry_bytes;
-        for (int i = 0; i < b->header_entry_count; i += 1) {
-            struct RuckSackFileEntry *entry = &b->entries[i];
-            if (entry->offset < wanted_offset_end) {
-                int err = resize_file_entry(b, entry, alloc_size(entry->size), 0);
-                if (err)
-                    return err;
-            }
+// makes the changes since the last commit durable. the contents of new and
+// rewritten entries are already in free space, and nothing the last header
+// refers to has been overwritten. the header region of the new generation
+// goes to free space too, then the superblock slot which is not in use is
+// pointed at it. the file is synced before and after the superblock is
+// written, so at any point one of the two slots refers to a complete
+// generation.
+static int write_generation(struct RuckSackBundlePrivate *b) {
+    // files right after a version 1 main header are in the way of this one
+    for (long int i = 0; i < b->header_entry_count; i += 1) {
+        struct RuckSackFileEntry *entry = &b->entries[i];
+        if (entry->offset < MAIN_HEADER_LEN) {
+            int err = move_file_entry(b, entry, alloc_size(entry->size), 0, true);
+            if (err)
+                return err;
         }
     }
 
-    if (fseek(f, b->first_header_offset, SEEK_SET))
-        return RuckSackErrorFileAccess;
+    // build the whole header region in memory and write it at once
+    long int region_size = header_region_size(b);
+    unsigned char *region = malloc(region_size);
+    long int *offsets = malloc((b->header_entry_count + 1) * sizeof(long int));
+    if (!region || !offsets) {
+        free(region);
+        free(offsets);
+        return RuckSackErrorNoMem;
+    }
 
+    long int pos = 0;
     for (int i = 0; i < b->header_entry_count; i += 1) {
         struct RuckSackFileEntry *entry = &b->entries[i];
-        write_uint32be(&buf[0], HEADER_ENTRY_LEN + entry->key_size);
+        unsigned char *buf = &region[pos];
+        long int entry_len = header_entry_len(entry);
+        write_uint32be(&buf[0], entry_len);
         write_uint64be(&buf[4], entry->offset);
         write_uint64be(&buf[12], entry->size);
         write_uint64be(&buf[20], entry->allocated_size);
         write_uint32be(&buf[28], entry->mtime);
         write_uint32be(&buf[32], entry->key_size);
-        amt_written = fwrite(buf, 1, HEADER_ENTRY_LEN, f);
-        if (amt_written != HEADER_ENTRY_LEN)
-            return RuckSackErrorFileAccess;
-        amt_written = fwrite(entry->key, 1, entry->key_size, f);
-        if (amt_written != entry->key_size)
-            return RuckSackErrorFileAccess;
+        memcpy(&buf[HEADER_ENTRY_LEN], entry->key, entry->key_size);
+        // header_entry_len leaves room for the optional fields up to the
+        // last one the entry needs
+        unsigned char *field = &buf[HEADER_ENTRY_LEN + entry->key_size];
+        unsigned char *fields_end = &buf[entry_len];
+        if (field < fields_end) {
+            write_uint32be(&field[0], entry->codec);
+            write_uint64be(&field[4], entry->decoded_size);
+            write_uint32be(&field[12], entry->chunk_size);
+            field += CODEC_FIELDS_LEN;
+        }
+        if (field < fields_end) {
+            write_uint64be(field, entry->content_hash);
+            field += HASH_FIELD_LEN;
+        }
+        if (field < fields_end) {
+            write_uint32be(field, entry->checksum);
+            field += CHECKSUM_FIELD_LEN;
+        }
+        if (field < fields_end) {
+            write_uint32be(field, (entry->tombstone ? ENTRY_FLAG_TOMBSTONE : 0) |
+                    (entry->codec_skipped ? ENTRY_FLAG_CODEC_SKIPPED : 0));
+            field += FLAGS_FIELD_LEN;
+        }
+        if (field < fields_end)
+            write_uint64be(field, (uint64_t)entry->mtime_ns);
+        offsets[i] = pos;
+        pos += entry_len;
     }
 
-    return RuckSackErrorNone;
+    int err = write_directory(b, &region[pos], offsets);
+    free(offsets);
+    if (err) {
+        free(region);
+        return err;
+    }
+
+    long int header_ref;
+    err = reserved_add(b, 0, region_size, &header_ref);
+    if (err) {
+        free(region);
+        return err;
+    }
+    allocate_header(b, header_ref);
+    long int header_offset = extent_at(b, header_ref)->offset;
+    err = bundle_write_at(b, header_offset, region, region_size);
+    free(region);
+    if (!err)
+        err = sync_bundle(b);
+    if (err)
+        return err;
+
+    uint64_t generation = b->generation + 1;
+    unsigned char buf[MAIN_HEADER_LEN];
+    memset(buf, 0, MAIN_HEADER_LEN);
+    memcpy(buf, BUNDLE_UUID, UUID_SIZE);
+    write_uint32be(&buf[16], BUNDLE_VERSION);
+    long int slot_offset = SUPERBLOCK_OFFSET + SUPERBLOCK_LEN * (generation % 2);
+    unsigned char *superblock = &buf[slot_offset];
+    write_uint64be(&superblock[0], generation);
+    write_uint64be(&superblock[8], header_offset);
+    write_uint32be(&superblock[16], b->header_entry_count);
+    write_uint64be(&superblock[20], header_offset + pos);
+    write_uint32be(&superblock[28], directory_slot_count_for(b->header_entry_count));
+    write_uint32be(&superblock[32], region_size);
+    write_uint32be(&superblock[36], b->alignment);
+    write_uint32be(&superblock[40], rucksack_crc32c(0, superblock, SUPERBLOCK_LEN - 4));
+
+    // the other slot is left alone unless there is no main header of this
+    // version in the file yet
+    if (b->generation)
+        err = bundle_write_at(b, slot_offset, superblock, SUPERBLOCK_LEN);
+    else
+        err = bundle_write_at(b, 0, buf, MAIN_HEADER_LEN);
+    if (!err)
+        err = sync_bundle(b);
+    if (err)
+        return err;
+
+    // nothing refers to the previous generation any more. the array is
+    // compacted from the end, so only the new header region can be swapped
+    // into a position which was visited already.
+    b->header_extent = header_ref;
+    for (long int i = b->reserved_count - 1; i >= 0; i -= 1) {
+        if (-(i + 1) != b->header_extent)
+            reserved_remove(b, -(i + 1));
+    }
+    for (long int i = 0; i < b->header_entry_count; i += 1)
+        b->entries[i].committed = 1;
+    b->generation = generation;
+    b->first_header_offset = header_offset;
+    b->header_region_len = region_size;
+    b->dirty = false;
+    // nothing past the last extent is in use after the commit
+    return trim_bundle(b);
 }
 
-static void init_new_bundle(struct RuckSackBundlePrivate *b, long headers_size) {
-    b->first_header_offset = MAIN_HEADER_LEN;
-    long allocated_header_bytes = (headers_size == -1) ?
-        alloc_size(HEADER_ENTRY_LEN * 10) : headers_size;
-    b->first_file_offset = b->first_header_offset + allocated_header_bytes;
+static int commit(struct RuckSackBundlePrivate *b) {
+    double start = now_seconds();
+    int err = write_generation(b);
+    b->sync_stats.commit_count += 1;
+    b->sync_stats.commit_seconds += now_seconds() - start;
+    return err;
+}
+
+static void free_entry_key(struct RuckSackFileEntry *entry) {
+    if (!entry->borrowed_key)
+        free(entry->key);
+}
+
+static void free_bundle(struct RuckSackBundlePrivate *b) {
+    if (b->entries) {
+        for (int i = 0; i < b->header_entry_count; i += 1)
+            free_entry_key(&b->entries[i]);
+        free(b->entries);
+    }
+    free(b->key_arena);
+    free(b->lazy_header_offsets);
+    free(b->index);
+    free(b->content_index);
+    free(b->reserved);
+    free(b->by_offset);
+    free(b->holes);
+    free(b->copy_buffer);
+    pthread_mutex_destroy(&b->lazy_mutex);
+    free(b);
 }
 
 // when memory is true, bundle_path is the pointer to the memory and
 // headers_size is the length of the memory buffer
 static int open_bundle(const char *bundle_path, struct RuckSackBundle **out_bundle,
-        bool read_only, long headers_size, bool memory)
+        bool read_only, long headers_size, bool memory, bool lazy)
 {
     struct RuckSackBundlePrivate *b = calloc(1, sizeof(struct RuckSackBundlePrivate));
     if (!b) {
@@ -486,15 +1855,19 @@ static int open_bundle(const char *bundle_path, struct RuckSackBundle **out_bund
         return RuckSackErrorNoMem;
     }
 
+    pthread_mutex_init(&b->lazy_mutex, NULL);
     init_new_bundle(b, headers_size);
     b->read_only = read_only;
+    b->durability = RuckSackDurabilityOnClose;
+    b->alignment = 1;
+    b->lazy = lazy;
 
     if (memory) {
         b->mem_buffer = bundle_path;
         b->mem_buffer_size = headers_size;
         int err = read_header(b);
         if (err) {
-            free(b);
+            free_bundle(b);
             *out_bundle = NULL;
             return err;
         }
@@ -508,9 +1881,12 @@ static int open_bundle(const char *bundle_path, struct RuckSackBundle **out_bund
     if (b->f) {
         int err = read_header(b);
         if (err == RuckSackErrorEmptyFile) {
+            fclose(b->f);
+            b->f = NULL;
             open_for_writing = 1;
         } else if (err) {
-            free(b);
+            fclose(b->f);
+            free_bundle(b);
             *out_bundle = NULL;
             return err;
         }
@@ -523,7 +1899,7 @@ static int open_bundle(const char *bundle_path, struct RuckSackBundle **out_bund
     }
     if (open_for_writing) {
         if (read_only) {
-            free(b);
+            free_bundle(b);
             *out_bundle = NULL;
             return RuckSackErrorEmptyFile;
         }
@@ -540,55 +1916,373 @@ static int open_bundle(const char *bundle_path, struct RuckSackBundle **out_bund
 }
 
 int rucksack_bundle_open_read(const char *bundle_path, struct RuckSackBundle **out_bundle) {
-    return open_bundle(bundle_path, out_bundle, true, -1, false);
+    return open_bundle(bundle_path, out_bundle, true, -1, false, false);
 }
 
 int rucksack_bundle_open(const char *bundle_path, struct RuckSackBundle **out_bundle) {
-    return open_bundle(bundle_path, out_bundle, false, -1, false);
+    return open_bundle(bundle_path, out_bundle, false, -1, false, false);
 }
 
 int rucksack_bundle_open_precise(const char *bundle_path, struct RuckSackBundle **out_bundle,
         long headers_size)
 {
-    return open_bundle(bundle_path, out_bundle, false, headers_size, false);
+    return open_bundle(bundle_path, out_bundle, false, headers_size, false, false);
+}
+
+void rucksack_bundle_options_init(struct RuckSackBundleOptions *options) {
+    memset(options, 0, sizeof(struct RuckSackBundleOptions));
+    options->headers_size = -1;
+    options->durability = RuckSackDurabilityOnClose;
+}
+
+int rucksack_bundle_open_options(const char *bundle_path, struct RuckSackBundle **out_bundle,
+        const struct RuckSackBundleOptions *options)
+{
+    if (options->alignment && !valid_alignment(options->alignment)) {
+        *out_bundle = NULL;
+        return RuckSackErrorInvalidAlignment;
+    }
+    int err = open_bundle(bundle_path, out_bundle, false, options->headers_size, false, false);
+    if (err)
+        return err;
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)*out_bundle;
+    b->durability = options->durability;
+    if (options->alignment && options->alignment != b->alignment) {
+        b->alignment = options->alignment;
+        b->dirty = true;
+    }
+    return RuckSackErrorNone;
 }
 
 int rucksack_bundle_open_read_mem(const unsigned char *buffer, long size,
         struct RuckSackBundle **out_bundle)
 {
-    return open_bundle((const char *)buffer, out_bundle, true, size, true);
+    return open_bundle((const char *)buffer, out_bundle, true, size, true, false);
 }
 
-int rucksack_bundle_close(struct RuckSackBundle *bundle) {
-    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)bundle;
+int rucksack_bundle_open_read_mem_lazy(const unsigned char *buffer, long size,
+        struct RuckSackBundle **out_bundle)
+{
+    return open_bundle((const char *)buffer, out_bundle, true, size, true, true);
+}
 
-    int write_err = RuckSackErrorNone;
-    if (!b->read_only)
-        write_err = write_header(b);
+// maps the whole file, or reads it into memory when mmap is unavailable
+static int map_file(const char *path, const char **out_buffer, long *out_size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return RuckSackErrorFileAccess;
 
-    if (b->entries) {
-        for (int i = 0; i < b->header_entry_count; i += 1) {
-            struct RuckSackFileEntry *entry = &b->entries[i];
-            if (entry->key)
-                free(entry->key);
-        }
-        free(b->entries);
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return RuckSackErrorFileAccess;
     }
 
-    int close_err = bundle_close(b);
-    free(b);
-
-    if (write_err)
-        return write_err;
+    if (st.st_size == 0) {
+        close(fd);
+        return RuckSackErrorEmptyFile;
+    }
 
-    if (close_err)
+#ifdef RUCKSACK_HAVE_MMAP
+    void *buffer = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (buffer == MAP_FAILED)
         return RuckSackErrorFileAccess;
+#else
+    char *buffer = malloc(st.st_size);
+    if (!buffer) {
+        close(fd);
+        return RuckSackErrorNoMem;
+    }
+    long amt_read = 0;
+    while (amt_read < st.st_size) {
+        ssize_t amt = read(fd, buffer + amt_read, st.st_size - amt_read);
+        if (amt <= 0) {
+            free(buffer);
+            close(fd);
+            return RuckSackErrorFileAccess;
+        }
+        amt_read += amt;
+    }
+    close(fd);
+#endif
 
+    *out_buffer = buffer;
+    *out_size = st.st_size;
     return RuckSackErrorNone;
 }
 
-int rucksack_bundle_add_file(struct RuckSackBundle *bundle, const char *key,
-        int key_size, const char *file_name)
+static int open_bundle_mmap(const char *bundle_path, struct RuckSackBundle **out_bundle,
+        bool lazy)
+{
+    const char *buffer;
+    long size;
+    int err = map_file(bundle_path, &buffer, &size);
+    if (err) {
+        *out_bundle = NULL;
+        return err;
+    }
+
+    err = open_bundle(buffer, out_bundle, true, size, true, lazy);
+    if (err) {
+        unmap_file(buffer, size);
+        return err;
+    }
+
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)*out_bundle;
+    b->mem_buffer_mapped = true;
+    return RuckSackErrorNone;
+}
+
+int rucksack_bundle_open_mmap(const char *bundle_path, struct RuckSackBundle **out_bundle) {
+    return open_bundle_mmap(bundle_path, out_bundle, false);
+}
+
+int rucksack_bundle_open_mmap_lazy(const char *bundle_path, struct RuckSackBundle **out_bundle) {
+    return open_bundle_mmap(bundle_path, out_bundle, true);
+}
+
+int rucksack_bundle_commit(struct RuckSackBundle *bundle) {
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)bundle;
+    if (b->read_only)
+        return RuckSackErrorReadOnly;
+    if (b->open_stream_count)
+        return RuckSackErrorStreamOpen;
+    if (!b->dirty && b->generation)
+        return RuckSackErrorNone;
+    return commit(b);
+}
+
+int rucksack_bundle_close(struct RuckSackBundle *bundle) {
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)bundle;
+
+    int write_err = RuckSackErrorNone;
+    if (!b->read_only)
+        write_err = rucksack_bundle_commit(bundle);
+
+    int close_err = bundle_close(b);
+    free_bundle(b);
+
+    if (write_err)
+        return write_err;
+
+    if (close_err)
+        return RuckSackErrorFileAccess;
+
+    return RuckSackErrorNone;
+}
+
+static int allocate_file_entry(struct RuckSackBundlePrivate *b, const char *key, int key_size,
+        long int size, struct RuckSackFileEntry **out_entry, char precise)
+{
+    char *key_dupe = dupe_string(key, &key_size);
+    if (!key_dupe) {
+        *out_entry = NULL;
+        return RuckSackErrorNoMem;
+    }
+
+    int err = index_reserve(b, b->header_entry_count + 1);
+    if (err) {
+        free(key_dupe);
+        *out_entry = NULL;
+        return err;
+    }
+
+    // create a new entry
+    if (b->header_entry_count >= b->header_entry_mem_count) {
+        long int new_mem_count = alloc_count(b->header_entry_mem_count);
+        err = extents_reserve(b, new_mem_count + b->reserved_mem_count);
+        if (err) {
+            free(key_dupe);
+            *out_entry = NULL;
+            return err;
+        }
+        struct RuckSackFileEntry *new_ptr = realloc(b->entries,
+                new_mem_count * sizeof(struct RuckSackFileEntry));
+        if (!new_ptr) {
+            free(key_dupe);
+            *out_entry = NULL;
+            return RuckSackErrorNoMem;
+        }
+        b->header_entry_mem_count = new_mem_count;
+        long int clear_amt = b->header_entry_mem_count - b->header_entry_count;
+        long int clear_size = clear_amt * sizeof(struct RuckSackFileEntry);
+        memset(new_ptr + b->header_entry_count, 0, clear_size);
+        b->entries = new_ptr;
+    }
+    struct RuckSackFileEntry *entry = &b->entries[b->header_entry_count];
+    b->header_entry_count += 1;
+    entry->key = key_dupe;
+    entry->key_size = key_size;
+    entry->key_hash = hash_key(key_dupe, key_size);
+    entry->b = b;
+    index_insert_no_grow(b, entry - b->entries);
+    b->headers_byte_count += header_entry_len(entry);
+
+    allocate_file(b, size, entry, precise);
+
+    *out_entry = entry;
+    return RuckSackErrorNone;
+}
+
+static struct RuckSackFileEntry *find_file_entry(struct RuckSackBundlePrivate *b,
+        const char *key, int key_size)
+{
+    if (b->dir_slots)
+        return directory_find(b, key, key_size);
+    long int slot = index_find_slot(b, key, key_size);
+    return (slot == -1) ? NULL : &b->entries[b->index[slot] - 1];
+}
+
+static int get_file_entry(struct RuckSackBundlePrivate *b, const char *key,
+        int key_size, long int size, struct RuckSackFileEntry **out_entry, char precise)
+{
+    // return info for existing entry
+    struct RuckSackFileEntry *e = find_file_entry(b, key, key_size);
+    if (e) {
+        // the contents the last header refers to are never overwritten, and
+        // neither are contents other entries share; the new ones go somewhere
+        // else
+        if (e->committed || e->shared || e->shares || e->allocated_size < size) {
+            int err = move_file_entry(b, e, size, precise, false);
+            if (err) {
+                *out_entry = NULL;
+                return err;
+            }
+        }
+        *out_entry = e;
+        return RuckSackErrorNone;
+    }
+
+    // none found, allocate new entry
+    return allocate_file_entry(b, key, key_size, size, out_entry, precise);
+}
+
+// changes how the contents of an entry are stored, which changes the size of
+// its header entry
+static void set_entry_codec(struct RuckSackBundlePrivate *b,
+        struct RuckSackFileEntry *entry, int codec, long int decoded_size,
+        long int chunk_size)
+{
+    b->headers_byte_count -= header_entry_len(entry);
+    entry->codec = codec;
+    entry->decoded_size = codec ? decoded_size : 0;
+    entry->chunk_size = codec ? chunk_size : 0;
+    b->headers_byte_count += header_entry_len(entry);
+}
+
+// the content hash and the checksum are set together when a stream closes
+static void set_entry_sums(struct RuckSackBundlePrivate *b,
+        struct RuckSackFileEntry *entry, int has_sums, uint64_t content_hash,
+        uint32_t checksum)
+{
+    b->headers_byte_count -= header_entry_len(entry);
+    entry->has_content_hash = has_sums;
+    entry->content_hash = has_sums ? content_hash : 0;
+    entry->has_checksum = has_sums;
+    entry->checksum = has_sums ? checksum : 0;
+    b->headers_byte_count += header_entry_len(entry);
+}
+
+// entries written by this version have the mtime in nanoseconds too
+static void set_entry_mtime(struct RuckSackBundlePrivate *b,
+        struct RuckSackFileEntry *entry, long mtime, int has_mtime_ns,
+        int64_t mtime_ns)
+{
+    b->headers_byte_count -= header_entry_len(entry);
+    entry->mtime = mtime;
+    entry->has_mtime_ns = has_mtime_ns;
+    entry->mtime_ns = has_mtime_ns ? mtime_ns : 0;
+    b->headers_byte_count += header_entry_len(entry);
+}
+
+static void set_entry_tombstone(struct RuckSackBundlePrivate *b,
+        struct RuckSackFileEntry *entry, int tombstone)
+{
+    b->headers_byte_count -= header_entry_len(entry);
+    entry->tombstone = tombstone;
+    b->headers_byte_count += header_entry_len(entry);
+}
+
+static void set_entry_codec_skipped(struct RuckSackBundlePrivate *b,
+        struct RuckSackFileEntry *entry, int codec_skipped)
+{
+    b->headers_byte_count -= header_entry_len(entry);
+    entry->codec_skipped = codec_skipped;
+    b->headers_byte_count += header_entry_len(entry);
+}
+
+static int add_stream(struct RuckSackBundle *bundle, const char *key,
+        int key_size, long size_guess, struct RuckSackOutStream **out_stream,
+        char precise, int64_t mtime_ns)
+{
+    struct RuckSackOutStream *stream = calloc(1, sizeof(struct RuckSackOutStream));
+
+    if (!stream) {
+        *out_stream = NULL;
+        return RuckSackErrorNoMem;
+    }
+    key_size = (key_size == -1) ? strlen(key) : key_size;
+
+    stream->b = (struct RuckSackBundlePrivate *) bundle;
+    long stream_size = alloc_size_precise(precise, size_guess);
+    int err = get_file_entry(stream->b, key, key_size, stream_size, &stream->e, precise);
+    if (err) {
+        free(stream);
+        *out_stream = NULL;
+        return err;
+    }
+    content_index_remove(stream->b, stream->e - stream->b->entries);
+    stream->e->is_open = 1;
+    stream->e->size = 0;
+    set_entry_codec(stream->b, stream->e, RuckSackCodecNone, 0, 0);
+    set_entry_codec_skipped(stream->b, stream->e, 0);
+    set_entry_sums(stream->b, stream->e, 0, 0, 0);
+    set_entry_tombstone(stream->b, stream->e, 0);
+    rucksack_hash_init(&stream->hash);
+    stream->checksum = 0;
+    set_entry_mtime(stream->b, stream->e, mtime_ns / NS_PER_SECOND, 1, mtime_ns);
+    stream->e->touched = 1;
+    stream->b->dirty = true;
+    stream->b->open_stream_count += 1;
+
+    *out_stream = stream;
+    return RuckSackErrorNone;
+}
+
+int rucksack_bundle_add_stream_precise(struct RuckSackBundle *bundle,
+        const char *key, int key_size, long size, struct RuckSackOutStream **out_stream,
+        long mtime)
+{
+    return add_stream(bundle, key, key_size, size, out_stream, 1, mtime * NS_PER_SECOND);
+}
+
+int rucksack_bundle_add_stream(struct RuckSackBundle *bundle,
+        const char *key, int key_size, long size_guess, struct RuckSackOutStream **out_stream)
+{
+    return add_stream(bundle, key, key_size, size_guess, out_stream, 0, now_ns());
+}
+
+int rucksack_bundle_add_tombstone(struct RuckSackBundle *bundle,
+        const char *key, int key_size)
+{
+    struct RuckSackOutStream *stream;
+    int err = add_stream(bundle, key, key_size, 0, &stream, 1, now_ns());
+    if (err)
+        return err;
+    // flagged before closing, which commits in RuckSackDurabilityPerStream
+    set_entry_tombstone(stream->b, stream->e, 1);
+    return rucksack_stream_close(stream);
+}
+
+int rucksack_bundle_add_file(struct RuckSackBundle *bundle, const char *key,
+        int key_size, const char *file_name)
+{
+    return rucksack_bundle_add_file_codec(bundle, key, key_size, file_name, RuckSackCodecNone);
+}
+
+int rucksack_bundle_add_file_codec(struct RuckSackBundle *bundle, const char *key,
+        int key_size, const char *file_name, enum RuckSackCodec codec)
 {
     FILE *f = fopen(file_name, "rb");
 
@@ -605,10 +2299,19 @@ int rucksack_bundle_add_file(struct RuckSackBundle *bundle, const char *key,
 
     off_t size = st.st_size;
 
+    // the entry gets the mtime of the file, so that rucksack_file_check_source
+    // can tell whether the file changed since
     struct RuckSackOutStream *stream;
-    err = rucksack_bundle_add_stream(bundle, key, key_size, size, &stream);
+    err = add_stream(bundle, key, key_size, size, &stream, 0, stat_mtime_ns(&st));
+    if (err) {
+        fclose(f);
+        return err;
+    }
+
+    err = rucksack_stream_set_codec(stream, codec);
     if (err) {
         fclose(f);
+        rucksack_stream_close(stream);
         return err;
     }
 
@@ -633,184 +2336,1406 @@ int rucksack_bundle_add_file(struct RuckSackBundle *bundle, const char *key,
     }
 
     free(buffer);
-    rucksack_stream_close(stream);
+    err = rucksack_stream_close(stream);
 
     if (fclose(f))
         return RuckSackErrorFileAccess;
 
-    return RuckSackErrorNone;
+    return err;
 }
 
-static int allocate_file_entry(struct RuckSackBundlePrivate *b, const char *key, int key_size,
-        long int size, struct RuckSackFileEntry **out_entry, char precise)
+// writes out the buffered bytes, which are the last buffer_len bytes of the
+// entry
+static int stream_flush(struct RuckSackOutStream *stream) {
+    if (!stream->buffer_len)
+        return RuckSackErrorNone;
+    struct RuckSackFileEntry *e = stream->e;
+    long int offset = e->offset + e->size - stream->buffer_len;
+    int err = bundle_write_at(stream->b, offset, stream->buffer, stream->buffer_len);
+    stream->buffer_len = 0;
+    return err;
+}
+
+// appends bytes to the stored contents of the entry, through the write
+// buffer when they are small
+static int stream_write_stored(struct RuckSackOutStream *stream, const void *ptr,
+        long int count)
 {
-    char *key_dupe = dupe_string(key, &key_size);
-    if (!key_dupe) {
-        *out_entry = NULL;
-        return RuckSackErrorNoMem;
+    long int pos = stream->e->size;
+    long int end = pos + count;
+    if (end > stream->e->allocated_size) {
+        // It didn't fit. Move this stream to a new one with extra padding
+        int err = stream_flush(stream);
+        if (err)
+            return err;
+        long int new_size = alloc_size(end);
+        err = resize_file_entry(stream->b, stream->e, new_size, 0);
+        if (err)
+            return err;
     }
 
-    // create a new entry
-    if (b->header_entry_count >= b->header_entry_mem_count) {
-        b->header_entry_mem_count = alloc_count(b->header_entry_mem_count);
-        struct RuckSackFileEntry *new_ptr = realloc(b->entries,
-                b->header_entry_mem_count * sizeof(struct RuckSackFileEntry));
-        if (!new_ptr) {
-            *out_entry = NULL;
-            return RuckSackErrorNoMem;
+    if (stream->buffer_len + count > STREAM_BUFFER_SIZE) {
+        int err = stream_flush(stream);
+        if (err)
+            return err;
+    }
+
+    if (count >= STREAM_BUFFER_SIZE) {
+        int err = bundle_write_at(stream->b, stream->e->offset + pos, ptr, count);
+        if (err)
+            return err;
+    } else {
+        if (!stream->buffer) {
+            stream->buffer = malloc(STREAM_BUFFER_SIZE);
+            if (!stream->buffer)
+                return RuckSackErrorNoMem;
         }
-        long int clear_amt = b->header_entry_mem_count - b->header_entry_count;
-        long int clear_size = clear_amt * sizeof(struct RuckSackFileEntry);
-        memset(new_ptr + b->header_entry_count, 0, clear_size);
-        b->entries = new_ptr;
+        memcpy(stream->buffer + stream->buffer_len, ptr, count);
+        stream->buffer_len += count;
     }
-    struct RuckSackFileEntry *entry = &b->entries[b->header_entry_count];
-    b->header_entry_count += 1;
-    entry->key = key_dupe;
-    entry->key_size = key_size;
-    entry->b = b;
-    b->headers_byte_count += HEADER_ENTRY_LEN + entry->key_size;
 
-    allocate_file(b, size, entry, precise);
+    stream->e->size = end;
+    stream->checksum = rucksack_crc32c(stream->checksum, ptr, count);
 
-    *out_entry = entry;
     return RuckSackErrorNone;
 }
 
-static struct RuckSackFileEntry *find_file_entry(struct RuckSackBundlePrivate *b,
-        const char *key, int key_size)
+// compresses the collected chunk and appends it to the stored contents. a
+// chunk which does not get smaller is stored as it is.
+static int stream_write_chunk(struct RuckSackOutStream *stream) {
+    if (stream->chunk_count >= stream->chunk_ends_size) {
+        long int new_size = alloc_count(stream->chunk_ends_size);
+        long int *new_ends = realloc(stream->chunk_ends, new_size * sizeof(long int));
+        if (!new_ends)
+            return RuckSackErrorNoMem;
+        stream->chunk_ends = new_ends;
+        stream->chunk_ends_size = new_size;
+    }
+
+    const unsigned char *data = stream->encoded_chunk;
+    long int size = rucksack_lz_compress(stream->chunk, stream->chunk_len,
+            stream->encoded_chunk, stream->chunk_len - 1);
+    if (!size) {
+        data = stream->chunk;
+        size = stream->chunk_len;
+    }
+    int err = stream_write_stored(stream, data, size);
+    if (err)
+        return err;
+    stream->chunk_ends[stream->chunk_count] = stream->e->size;
+    stream->chunk_count += 1;
+    stream->chunk_len = 0;
+    return RuckSackErrorNone;
+}
+
+// writes the last chunk and the chunk table of a stream with a codec
+static int stream_finish_chunks(struct RuckSackOutStream *stream) {
+    struct RuckSackFileEntry *e = stream->e;
+    long int decoded_size = stream->chunk_count * CHUNK_SIZE + stream->chunk_len;
+    if (stream->chunk_len) {
+        int err = stream_write_chunk(stream);
+        if (err)
+            return err;
+    }
+
+    // a single chunk which did not get smaller needs no table
+    if (stream->chunk_count <= 1 && e->size == decoded_size) {
+        set_entry_codec_skipped(stream->b, e, 1);
+        return stream_flush(stream);
+    }
+
+    for (long int i = 0; i < stream->chunk_count; i += 1) {
+        unsigned char end[CHUNK_END_LEN];
+        write_uint64be(end, stream->chunk_ends[i]);
+        int err = stream_write_stored(stream, end, CHUNK_END_LEN);
+        if (err)
+            return err;
+    }
+    int err = stream_flush(stream);
+    if (err)
+        return err;
+
+    set_entry_codec(stream->b, e, stream->codec, decoded_size, CHUNK_SIZE);
+    return RuckSackErrorNone;
+}
+
+// compares the stored contents of two entries byte for byte. a matching
+// content hash is not enough to share them.
+static int same_contents(struct RuckSackBundlePrivate *b, struct RuckSackFileEntry *e,
+        struct RuckSackFileEntry *other, bool *same)
 {
-    for (int i = 0; i < b->header_entry_count; i += 1) {
-        struct RuckSackFileEntry *e = &b->entries[i];
-        if (memneql(key, key_size, e->key, e->key_size) == 0)
-            return e;
+    *same = false;
+    if (other == e || other->is_open || !other->has_content_hash ||
+            other->content_hash != e->content_hash || other->size != e->size ||
+            other->codec != e->codec || other->decoded_size != e->decoded_size ||
+            other->chunk_size != e->chunk_size)
+    {
+        return RuckSackErrorNone;
     }
-    return NULL;
+
+    unsigned char *buffer = malloc(2 * STREAM_BUFFER_SIZE);
+    if (!buffer)
+        return RuckSackErrorNoMem;
+    unsigned char *other_buffer = buffer + STREAM_BUFFER_SIZE;
+    int err = RuckSackErrorNone;
+    *same = true;
+    for (long int pos = 0; *same && pos < e->size; pos += STREAM_BUFFER_SIZE) {
+        long int amt = MIN(STREAM_BUFFER_SIZE, e->size - pos);
+        if (bundle_read_at(b, e->offset + pos, buffer, amt) != amt ||
+            bundle_read_at(b, other->offset + pos, other_buffer, amt) != amt)
+        {
+            err = RuckSackErrorFileAccess;
+            *same = false;
+            break;
+        }
+        *same = !memcmp(buffer, other_buffer, amt);
+    }
+    free(buffer);
+    return err;
+}
+
+// an entry which was just written gives its space back and shares the
+// extent of an entry with the same contents, if there is one
+static int share_contents(struct RuckSackBundlePrivate *b, struct RuckSackFileEntry *e) {
+    if (!content_indexable(e))
+        return RuckSackErrorNone;
+    long int entry_index = e - b->entries;
+    int err = content_index_reserve(b, entry_index);
+    if (err)
+        return err;
+
+    long int mask = b->content_slot_count - 1;
+    long int slot = e->content_hash & mask;
+    for (; b->content_index[slot]; slot = (slot + 1) & mask) {
+        struct RuckSackFileEntry *other = &b->entries[b->content_index[slot] - 1];
+        bool same;
+        err = same_contents(b, e, other, &same);
+        if (err)
+            return err;
+        if (!same)
+            continue;
+
+        struct RuckSackFileEntry *owner = other->shared ? shared_owner(b, other) : other;
+        err = release_extent(b, e);
+        if (err)
+            return err;
+        e->offset = owner->offset;
+        e->allocated_size = 0;
+        e->shared = 1;
+        owner->shares += 1;
+        break;
+    }
+
+    content_index_insert_no_grow(b, entry_index);
+    return RuckSackErrorNone;
+}
+
+// frees a stream whose entry is complete, committing when the durability mode
+// asks for it
+static int free_stream(struct RuckSackOutStream *stream, int err) {
+    struct RuckSackBundlePrivate *b = stream->b;
+    free(stream->buffer);
+    free(stream->chunk);
+    free(stream->encoded_chunk);
+    free(stream->chunk_ends);
+    free(stream);
+
+    // the header must not refer to bytes which are still in the buffer of
+    // another stream, so wait for the last one
+    b->open_stream_count -= 1;
+    if (!err && b->durability == RuckSackDurabilityPerStream && !b->open_stream_count)
+        err = commit(b);
+    return err;
+}
+
+int rucksack_stream_close(struct RuckSackOutStream *stream) {
+    struct RuckSackBundlePrivate *b = stream->b;
+    struct RuckSackFileEntry *e = stream->e;
+    int err = stream->codec ? stream_finish_chunks(stream) : stream_flush(stream);
+    e->is_open = 0;
+    if (!err) {
+        set_entry_sums(b, e, 1, rucksack_hash_final(&stream->hash), stream->checksum);
+        err = share_contents(b, e);
+    }
+    return free_stream(stream, err);
+}
+
+// stored bytes are copied from another bundle this many at a time
+static const long COPY_PIECE_SIZE = 1048576;
+
+int rucksack_bundle_copy_file(struct RuckSackBundle *bundle, struct RuckSackFileEntry *src) {
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)bundle;
+    if (b->read_only)
+        return RuckSackErrorReadOnly;
+    struct RuckSackOutStream *stream;
+    int err = add_stream(bundle, src->key, src->key_size, src->size, &stream, 1, 0);
+    if (err)
+        return err;
+    struct RuckSackFileEntry *e = stream->e;
+    set_entry_mtime(b, e, src->mtime, src->has_mtime_ns, src->mtime_ns);
+
+    long int piece_size = MIN(src->size, COPY_PIECE_SIZE);
+    unsigned char *piece = malloc(MAX(piece_size, 1));
+    if (!piece)
+        err = RuckSackErrorNoMem;
+    for (long int pos = 0; !err && pos < src->size; pos += piece_size) {
+        long int amt = MIN(piece_size, src->size - pos);
+        if (bundle_read_at(src->b, src->offset + pos, piece, amt) != amt) {
+            err = RuckSackErrorFileAccess;
+            break;
+        }
+        if (!src->codec)
+            rucksack_hash_update(&stream->hash, piece, amt);
+        err = stream_write_stored(stream, piece, amt);
+    }
+    free(piece);
+    if (!err)
+        err = stream_flush(stream);
+    if (!err && src->has_checksum && src->checksum != stream->checksum)
+        err = RuckSackErrorChecksum;
+
+    e->is_open = 0;
+    if (!err) {
+        set_entry_codec(b, e, src->codec, src->decoded_size, src->chunk_size);
+        set_entry_codec_skipped(b, e, src->codec_skipped);
+        set_entry_tombstone(b, e, src->tombstone);
+        // the content hash is of the decoded contents, which only files
+        // without a codec have at hand
+        if (src->has_content_hash)
+            set_entry_sums(b, e, 1, src->content_hash, stream->checksum);
+        else if (!src->codec)
+            set_entry_sums(b, e, 1, rucksack_hash_final(&stream->hash), stream->checksum);
+        err = share_contents(b, e);
+    }
+    return free_stream(stream, err);
+}
+
+int rucksack_stream_set_codec(struct RuckSackOutStream *stream, enum RuckSackCodec codec) {
+    if (codec != RuckSackCodecNone && codec != RuckSackCodecLz)
+        return RuckSackErrorInvalidCodec;
+    if (stream->e->size || stream->buffer_len || stream->chunk_len)
+        return RuckSackErrorInvalidCodec;
+    if (codec && !stream->chunk) {
+        stream->chunk = malloc(CHUNK_SIZE);
+        stream->encoded_chunk = malloc(CHUNK_SIZE);
+        if (!stream->chunk || !stream->encoded_chunk)
+            return RuckSackErrorNoMem;
+    }
+    stream->codec = codec;
+    return RuckSackErrorNone;
+}
+
+int rucksack_stream_write(struct RuckSackOutStream *stream, const void *ptr,
+        long int count)
+{
+    rucksack_hash_update(&stream->hash, ptr, count);
+    if (!stream->codec)
+        return stream_write_stored(stream, ptr, count);
+
+    // streams with a codec collect a chunk at a time
+    const unsigned char *bytes = ptr;
+    while (count > 0) {
+        long int amt = MIN(count, CHUNK_SIZE - stream->chunk_len);
+        memcpy(stream->chunk + stream->chunk_len, bytes, amt);
+        stream->chunk_len += amt;
+        bytes += amt;
+        count -= amt;
+        if (stream->chunk_len == CHUNK_SIZE) {
+            int err = stream_write_chunk(stream);
+            if (err)
+                return err;
+        }
+    }
+    return RuckSackErrorNone;
+}
+
+struct RuckSackFileEntry *rucksack_bundle_find_file(struct RuckSackBundle *bundle,
+        const char *key, int key_size)
+{
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *) bundle;
+    key_size = (key_size == -1) ? strlen(key) : key_size;
+    struct RuckSackFileEntry *e = find_file_entry(b, key, key_size);
+    if (e && b->lazy && materialize_entry(b, e))
+        return NULL;
+    return e;
+}
+
+long int rucksack_file_size(struct RuckSackFileEntry *entry) {
+    return entry->codec ? entry->decoded_size : entry->size;
+}
+
+enum RuckSackCodec rucksack_file_codec(struct RuckSackFileEntry *entry) {
+    return entry->codec;
+}
+
+enum RuckSackCodec rucksack_file_written_codec(struct RuckSackFileEntry *entry) {
+    return entry->codec_skipped ? RuckSackCodecLz : entry->codec;
+}
+
+long rucksack_file_stored_size(struct RuckSackFileEntry *entry) {
+    return entry->size;
+}
+
+const char *rucksack_file_name(struct RuckSackFileEntry *entry) {
+    return entry->key;
+}
+
+int rucksack_file_name_size(struct RuckSackFileEntry *entry) {
+    return entry->key_size;
+}
+
+int rucksack_file_read_stored(struct RuckSackFileEntry *e, unsigned char *buffer) {
+    struct RuckSackBundlePrivate *b = e->b;
+    long amt_read = bundle_read_at(b, e->offset, buffer, e->size);
+    if (amt_read != e->size)
+        return RuckSackErrorFileAccess;
+    if (b->verify && e->has_checksum && rucksack_crc32c(0, buffer, e->size) != e->checksum)
+        return RuckSackErrorChecksum;
+    return RuckSackErrorNone;
+}
+
+// stored bytes which are not in memory are checked this many at a time
+static const long VERIFY_PIECE_SIZE = 1048576;
+
+int rucksack_file_verify(struct RuckSackFileEntry *e) {
+    if (!e->has_checksum)
+        return RuckSackErrorNoChecksum;
+
+    // an empty file may be at an offset past the end of the bundle
+    struct RuckSackBundlePrivate *b = e->b;
+    if (b->mem_buffer && e->size) {
+        const unsigned char *ptr;
+        int err = bundle_data(b, e->offset, e->size, &ptr);
+        if (err)
+            return err;
+        return (rucksack_crc32c(0, ptr, e->size) == e->checksum) ?
+            RuckSackErrorNone : RuckSackErrorChecksum;
+    }
+
+    long int piece_size = MIN(e->size, VERIFY_PIECE_SIZE);
+    unsigned char *piece = malloc(MAX(piece_size, 1));
+    if (!piece)
+        return RuckSackErrorNoMem;
+    uint32_t crc = 0;
+    int err = RuckSackErrorNone;
+    for (long int pos = 0; pos < e->size; pos += piece_size) {
+        long int amt = MIN(piece_size, e->size - pos);
+        if (bundle_read_at(b, e->offset + pos, piece, amt) != amt) {
+            err = RuckSackErrorFileAccess;
+            break;
+        }
+        crc = rucksack_crc32c(crc, piece, amt);
+    }
+    free(piece);
+    if (!err && crc != e->checksum)
+        err = RuckSackErrorChecksum;
+    return err;
+}
+
+// source files are hashed this many bytes at a time
+static const long CHECK_PIECE_SIZE = 65536;
+
+static int hash_source(const char *file_name, uint64_t *hash) {
+    FILE *f = fopen(file_name, "rb");
+    if (!f)
+        return RuckSackErrorFileAccess;
+    unsigned char *piece = malloc(CHECK_PIECE_SIZE);
+    if (!piece) {
+        fclose(f);
+        return RuckSackErrorNoMem;
+    }
+    struct RuckSackHash h;
+    rucksack_hash_init(&h);
+    long int amt_read;
+    while ((amt_read = fread(piece, 1, CHECK_PIECE_SIZE, f)))
+        rucksack_hash_update(&h, piece, amt_read);
+    int err = ferror(f) ? RuckSackErrorFileAccess : RuckSackErrorNone;
+    free(piece);
+    fclose(f);
+    *hash = rucksack_hash_final(&h);
+    return err;
+}
+
+int rucksack_file_check_source(struct RuckSackFileEntry *e, const char *file_name,
+        int *up_to_date)
+{
+    *up_to_date = 0;
+    struct stat st;
+    if (stat(file_name, &st))
+        return RuckSackErrorFileAccess;
+    if (e->tombstone || e->is_open || st.st_size != rucksack_file_size(e))
+        return RuckSackErrorNone;
+
+    // a file system which keeps whole seconds can change a file twice within
+    // the same mtime, so such an mtime is not trusted on its own
+    int64_t mtime_ns = stat_mtime_ns(&st);
+    if (e->has_mtime_ns && e->mtime_ns == mtime_ns && mtime_ns % NS_PER_SECOND) {
+        *up_to_date = 1;
+        return RuckSackErrorNone;
+    }
+    if (!e->has_content_hash)
+        return RuckSackErrorNone;
+
+    uint64_t hash;
+    int err = hash_source(file_name, &hash);
+    if (err || hash != e->content_hash)
+        return err;
+    *up_to_date = 1;
+
+    // the contents are the same, so the next check can go by the new mtime
+    struct RuckSackBundlePrivate *b = e->b;
+    if (!b->read_only && (!e->has_mtime_ns || e->mtime_ns != mtime_ns)) {
+        set_entry_mtime(b, e, mtime_ns / NS_PER_SECOND, 1, mtime_ns);
+        b->dirty = true;
+    }
+    return RuckSackErrorNone;
+}
+
+// files with a codec are decoded from the stored bytes a chunk at a time, so
+// they are checked in a pass of their own before
+static int verify_before_decode(struct RuckSackFileEntry *e) {
+    if (!e->b->verify)
+        return RuckSackErrorNone;
+    int err = rucksack_file_verify(e);
+    return (err == RuckSackErrorNoChecksum) ? RuckSackErrorNone : err;
+}
+
+// the stored contents of an entry with a codec are its chunks, each encoded
+// on its own or stored as it is when that is not smaller, followed by a
+// uint64be table with the end of each chunk relative to the entry
+struct ChunkTable {
+    long int count;
+    const unsigned char *ends;
+    // set when the table was read into memory
+    unsigned char *owned;
+    // set when the caller read all of the stored contents beforehand
+    const unsigned char *stored;
+};
+
+static int chunk_table_init(struct RuckSackFileEntry *e, struct ChunkTable *table) {
+    table->owned = NULL;
+    table->stored = NULL;
+    if (e->codec != RuckSackCodecLz)
+        return RuckSackErrorInvalidCodec;
+    if (e->chunk_size <= 0 || e->decoded_size < 0 ||
+        e->decoded_size / e->chunk_size >= e->size / CHUNK_END_LEN)
+    {
+        return RuckSackErrorInvalidFormat;
+    }
+    table->count = (e->decoded_size + e->chunk_size - 1) / e->chunk_size;
+    return RuckSackErrorNone;
+}
+
+static int chunk_table_load(struct RuckSackFileEntry *e, struct ChunkTable *table) {
+    int err = chunk_table_init(e, table);
+    if (err)
+        return err;
+
+    long int table_size = table->count * CHUNK_END_LEN;
+    long int table_offset = e->offset + e->size - table_size;
+    err = bundle_data(e->b, table_offset, table_size, &table->ends);
+    if (err != RuckSackErrorNotInMemory)
+        return err;
+    table->owned = malloc(table_size);
+    if (!table->owned)
+        return RuckSackErrorNoMem;
+    table->ends = table->owned;
+    if (bundle_read_at(e->b, table_offset, table->owned, table_size) != table_size)
+        return RuckSackErrorFileAccess;
+    return RuckSackErrorNone;
+}
+
+// where chunk index starts in the stored contents. chunk count is where the
+// last chunk ends.
+static long int chunk_stored_start(const struct ChunkTable *table, long int index) {
+    return index ? read_uint64be(&table->ends[CHUNK_END_LEN * (index - 1)]) : 0;
+}
+
+static long int chunk_decoded_len(struct RuckSackFileEntry *e, long int index) {
+    return MIN(e->chunk_size, e->decoded_size - index * e->chunk_size);
+}
+
+// decodes chunk index into out. chunks of bundles which are not in memory are
+// read into scratch, which holds chunk_size bytes.
+static int decode_chunk(struct RuckSackFileEntry *e, const struct ChunkTable *table,
+        long int index, unsigned char *out, unsigned char *scratch)
+{
+    long int start = chunk_stored_start(table, index);
+    long int end = chunk_stored_start(table, index + 1);
+    long int stored_len = end - start;
+    long int len = chunk_decoded_len(e, index);
+    if (stored_len < 0 || stored_len > len || end > e->size - table->count * CHUNK_END_LEN)
+        return RuckSackErrorInvalidFormat;
+
+    // chunks which are stored as they are go straight to out
+    const unsigned char *stored;
+    int err = RuckSackErrorNone;
+    if (table->stored)
+        stored = table->stored + start;
+    else
+        err = bundle_data(e->b, e->offset + start, stored_len, &stored);
+    if (err == RuckSackErrorNotInMemory) {
+        unsigned char *dest = (stored_len == len) ? out : scratch;
+        if (bundle_read_at(e->b, e->offset + start, dest, stored_len) != stored_len)
+            return RuckSackErrorFileAccess;
+        stored = dest;
+    } else if (err) {
+        return err;
+    }
+
+    if (stored_len == len) {
+        if (stored != out)
+            memcpy(out, stored, len);
+        return RuckSackErrorNone;
+    }
+    if (rucksack_lz_decompress(stored, stored_len, out, len))
+        return RuckSackErrorInvalidFormat;
+    return RuckSackErrorNone;
+}
+
+// decodes size bytes starting at offset of the decoded contents. only the
+// chunks the range touches are read and decoded.
+static int decode_range(struct RuckSackFileEntry *e, const struct ChunkTable *table,
+        long int offset, long int size, unsigned char *buffer)
+{
+    if (size <= 0)
+        return RuckSackErrorNone;
+
+    // room for a stored chunk and for a chunk which is only partly wanted
+    unsigned char *scratch = malloc(2 * e->chunk_size);
+    if (!scratch)
+        return RuckSackErrorNoMem;
+    unsigned char *partial = scratch + e->chunk_size;
+
+    int err = RuckSackErrorNone;
+    long int end = offset + size;
+    for (long int i = offset / e->chunk_size; !err && i * e->chunk_size < end; i += 1) {
+        long int chunk_start = i * e->chunk_size;
+        long int chunk_end = chunk_start + chunk_decoded_len(e, i);
+        if (chunk_start >= offset && chunk_end <= end) {
+            err = decode_chunk(e, table, i, buffer + (chunk_start - offset), scratch);
+            continue;
+        }
+        err = decode_chunk(e, table, i, partial, scratch);
+        long int lo = MAX(offset, chunk_start);
+        long int hi = MIN(end, chunk_end);
+        if (!err)
+            memcpy(buffer + (lo - offset), partial + (lo - chunk_start), hi - lo);
+    }
+
+    free(scratch);
+    return err;
+}
+
+int rucksack_file_read(struct RuckSackFileEntry *e, unsigned char *buffer)
+{
+    if (!e->codec)
+        return rucksack_file_read_stored(e, buffer);
+
+    struct ChunkTable table;
+    int err = verify_before_decode(e);
+    if (err)
+        return err;
+    err = chunk_table_load(e, &table);
+    if (!err)
+        err = decode_range(e, &table, 0, e->decoded_size, buffer);
+    free(table.owned);
+    return err;
+}
+
+int rucksack_file_read_range(struct RuckSackFileEntry *e, long offset, long size,
+        unsigned char *buffer)
+{
+    long file_size = rucksack_file_size(e);
+    if (offset < 0 || size < 0 || offset > file_size || size > file_size - offset)
+        return RuckSackErrorInvalidRange;
+
+    if (!e->codec) {
+        if (bundle_read_at(e->b, e->offset + offset, buffer, size) != size)
+            return RuckSackErrorFileAccess;
+        return RuckSackErrorNone;
+    }
+
+    struct ChunkTable table;
+    int err = chunk_table_load(e, &table);
+    if (!err)
+        err = decode_range(e, &table, offset, size, buffer);
+    free(table.owned);
+    return err;
+}
+
+struct ChunkWorker {
+    struct RuckSackFileEntry *e;
+    const struct ChunkTable *table;
+    long int offset;
+    long int size;
+    unsigned char *buffer;
+    pthread_t thread;
+    int started;
+    int err;
+};
+
+static void *chunk_worker_run(void *arg) {
+    struct ChunkWorker *worker = arg;
+    worker->err = decode_range(worker->e, worker->table, worker->offset,
+            worker->size, worker->buffer + worker->offset);
+    return NULL;
+}
+
+int rucksack_file_read_parallel(struct RuckSackFileEntry *e, unsigned char *buffer,
+        int thread_count)
+{
+    if (!e->codec || thread_count <= 1)
+        return rucksack_file_read(e, buffer);
+
+    struct ChunkTable table;
+    int err = verify_before_decode(e);
+    if (err)
+        return err;
+    err = chunk_table_load(e, &table);
+    if (err) {
+        free(table.owned);
+        return err;
+    }
+
+    // every thread decodes a run of whole chunks
+    long int worker_count = MIN(thread_count, table.count);
+    struct ChunkWorker *workers = calloc(MAX(worker_count, 1), sizeof(struct ChunkWorker));
+    if (!workers) {
+        free(table.owned);
+        return RuckSackErrorNoMem;
+    }
+    for (long int i = 0; i < worker_count; i += 1) {
+        struct ChunkWorker *worker = &workers[i];
+        long int first = table.count * i / worker_count;
+        long int last = table.count * (i + 1) / worker_count;
+        worker->e = e;
+        worker->table = &table;
+        worker->offset = first * e->chunk_size;
+        worker->size = MIN(last * e->chunk_size, e->decoded_size) - worker->offset;
+        worker->buffer = buffer;
+        // the calling thread takes the first run
+        if (i > 0)
+            worker->started = !pthread_create(&worker->thread, NULL, chunk_worker_run, worker);
+    }
+
+    // runs whose thread could not be started are decoded here too
+    for (long int i = 0; i < worker_count; i += 1) {
+        if (!workers[i].started)
+            chunk_worker_run(&workers[i]);
+    }
+    for (long int i = 0; i < worker_count; i += 1) {
+        if (workers[i].started)
+            pthread_join(workers[i].thread, NULL);
+        if (!err)
+            err = workers[i].err;
+    }
+
+    free(workers);
+    free(table.owned);
+    return err;
+}
+
+// in streams read this many bytes ahead
+static const long READ_AHEAD_SIZE = 262144;
+
+struct RuckSackInStream {
+    struct RuckSackFileEntry *e;
+    struct ChunkTable table;
+    // position of the next byte to read in the decoded contents
+    long pos;
+    // decoded contents read ahead, starting at buffer_offset. uncompressed
+    // files of in-memory bundles are copied without a buffer.
+    unsigned char *buffer;
+    long buffer_size;
+    long buffer_offset;
+    long buffer_len;
+};
+
+// the hints only make reads faster, so it does not matter if they fail
+static void advise_sequential(struct RuckSackFileEntry *e) {
+    struct RuckSackBundlePrivate *b = e->b;
+#ifdef RUCKSACK_HAVE_MMAP
+    if (b->mem_buffer_mapped) {
+        // the range must start at a page
+        uintptr_t start = (uintptr_t)(b->mem_buffer + e->offset);
+        uintptr_t page_start = start - start % sysconf(_SC_PAGESIZE);
+        posix_madvise((void *)page_start, e->size + (start - page_start),
+                POSIX_MADV_SEQUENTIAL);
+    }
+#endif
+#ifdef RUCKSACK_HAVE_POSIX_FADVISE
+    if (!b->mem_buffer)
+        posix_fadvise(fileno(b->f), e->offset, e->size, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+// starts reading the stored bytes of the fill after the one ending at pos
+static void instream_prefetch(struct RuckSackInStream *s, long pos) {
+#ifdef RUCKSACK_HAVE_POSIX_FADVISE
+    struct RuckSackFileEntry *e = s->e;
+    if (e->b->mem_buffer)
+        return;
+    long start = pos;
+    long end = MIN(pos + s->buffer_size, rucksack_file_size(e));
+    if (e->codec) {
+        start = chunk_stored_start(&s->table, pos / e->chunk_size);
+        end = chunk_stored_start(&s->table, (end + e->chunk_size - 1) / e->chunk_size);
+    }
+    if (end > start)
+        posix_fadvise(fileno(e->b->f), e->offset + start, end - start, POSIX_FADV_WILLNEED);
+#else
+    (void)s;
+    (void)pos;
+#endif
+}
+
+// reads ahead from pos, from the start of its chunk for compressed files
+static int instream_fill(struct RuckSackInStream *s) {
+    struct RuckSackFileEntry *e = s->e;
+    long start = e->codec ? s->pos - s->pos % e->chunk_size : s->pos;
+    long size = MIN(s->buffer_size, rucksack_file_size(e) - start);
+    s->buffer_len = 0;
+    int err = rucksack_file_read_range(e, start, size, s->buffer);
+    if (err)
+        return err;
+    s->buffer_offset = start;
+    s->buffer_len = size;
+    instream_prefetch(s, start + size);
+    return RuckSackErrorNone;
+}
+
+int rucksack_file_open_stream(struct RuckSackFileEntry *e, struct RuckSackInStream **out_stream) {
+    *out_stream = NULL;
+    struct RuckSackInStream *s = calloc(1, sizeof(struct RuckSackInStream));
+    if (!s)
+        return RuckSackErrorNoMem;
+    s->e = e;
+
+    if (e->codec) {
+        int err = chunk_table_load(e, &s->table);
+        if (err) {
+            rucksack_instream_close(s);
+            return err;
+        }
+        // whole chunks are decoded at a time
+        s->buffer_size = MAX(1, READ_AHEAD_SIZE / e->chunk_size) * e->chunk_size;
+    } else if (!e->b->mem_buffer) {
+        s->buffer_size = READ_AHEAD_SIZE;
+    }
+    if (s->buffer_size) {
+        s->buffer = malloc(s->buffer_size);
+        if (!s->buffer) {
+            rucksack_instream_close(s);
+            return RuckSackErrorNoMem;
+        }
+    }
+
+    advise_sequential(e);
+    *out_stream = s;
+    return RuckSackErrorNone;
+}
+
+int rucksack_instream_read(struct RuckSackInStream *s, void *ptr, long size, long *amt_read) {
+    *amt_read = 0;
+    if (size < 0)
+        return RuckSackErrorInvalidRange;
+
+    unsigned char *out = ptr;
+    long want = MIN(size, rucksack_file_size(s->e) - s->pos);
+    while (*amt_read < want) {
+        long left = want - *amt_read;
+        long buffer_end = s->buffer_offset + s->buffer_len;
+        long amt;
+        if (s->pos >= s->buffer_offset && s->pos < buffer_end) {
+            amt = MIN(left, buffer_end - s->pos);
+            memcpy(out + *amt_read, s->buffer + (s->pos - s->buffer_offset), amt);
+        } else if (!s->buffer || left >= s->buffer_size) {
+            // large reads go straight to ptr
+            amt = left;
+            int err = rucksack_file_read_range(s->e, s->pos, amt, out + *amt_read);
+            if (err)
+                return err;
+        } else {
+            int err = instream_fill(s);
+            if (err)
+                return err;
+            continue;
+        }
+        s->pos += amt;
+        *amt_read += amt;
+    }
+    return RuckSackErrorNone;
+}
+
+void rucksack_instream_close(struct RuckSackInStream *s) {
+    if (!s)
+        return;
+    free(s->buffer);
+    free(s->table.owned);
+    free(s);
+}
+
+static const int BATCH_THREAD_COUNT = 4;
+
+static int compare_request_offsets(const void *a, const void *b) {
+    const struct RuckSackReadRequest *request_a = *(struct RuckSackReadRequest * const *)a;
+    const struct RuckSackReadRequest *request_b = *(struct RuckSackReadRequest * const *)b;
+    long offset_a = request_a->entry->offset;
+    long offset_b = request_b->entry->offset;
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+struct BatchPool {
+    struct RuckSackReadRequest **order;
+    long count;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // the next request in order to read
+    long next;
+    // requests which completed but have not been reported yet
+    struct RuckSackReadRequest **completed;
+    long completed_count;
+};
+
+static void *batch_pool_run(void *arg) {
+    struct BatchPool *pool = arg;
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->next < pool->count) {
+        struct RuckSackReadRequest *request = pool->order[pool->next];
+        pool->next += 1;
+        pthread_mutex_unlock(&pool->mutex);
+
+        request->err = rucksack_file_read(request->entry, request->buffer);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->completed[pool->completed_count] = request;
+        pool->completed_count += 1;
+        pthread_cond_signal(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+// workers take the requests in order and read them with pread, the calling
+// thread reports them as they complete
+static int batch_read_pool(struct RuckSackReadRequest **order, long count,
+        void (*callback)(struct RuckSackReadRequest *request))
+{
+    struct BatchPool pool;
+    pool.order = order;
+    pool.count = count;
+    pool.next = 0;
+    pool.completed_count = 0;
+    pool.completed = malloc(count * sizeof(struct RuckSackReadRequest *));
+    if (!pool.completed)
+        return RuckSackErrorNoMem;
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    pthread_t threads[BATCH_THREAD_COUNT];
+    int thread_count = 0;
+    while (thread_count < MIN(BATCH_THREAD_COUNT, count)) {
+        if (pthread_create(&threads[thread_count], NULL, batch_pool_run, &pool))
+            break;
+        thread_count += 1;
+    }
+    // without any workers the calling thread reads everything itself
+    if (!thread_count)
+        batch_pool_run(&pool);
+
+    long reported = 0;
+    pthread_mutex_lock(&pool.mutex);
+    while (reported < count) {
+        while (reported == pool.completed_count)
+            pthread_cond_wait(&pool.cond, &pool.mutex);
+        struct RuckSackReadRequest *request = pool.completed[reported];
+        reported += 1;
+        pthread_mutex_unlock(&pool.mutex);
+        if (callback)
+            callback(request);
+        pthread_mutex_lock(&pool.mutex);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+
+    for (int i = 0; i < thread_count; i += 1)
+        pthread_join(threads[i], NULL);
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.mutex);
+    free(pool.completed);
+    return RuckSackErrorNone;
+}
+
+// see test_hooks.h
+static int fail_uring_submit;
+static int fail_uring_wait;
+static int uring_submit_count;
+
+void rucksack_test_fail_uring(int fail_submit, int fail_wait) {
+    fail_uring_submit = fail_submit;
+    fail_uring_wait = fail_wait;
+    uring_submit_count = 0;
+}
+
+#ifdef RUCKSACK_HAVE_IO_URING
+// batch reads keep this many files in flight
+static const long BATCH_DEPTH = 32;
+
+// uses the stored contents in memory at stored instead of reading the bundle
+static int chunk_table_in(struct RuckSackFileEntry *e, const unsigned char *stored,
+        struct ChunkTable *table)
+{
+    int err = chunk_table_init(e, table);
+    if (err)
+        return err;
+    table->stored = stored;
+    table->ends = stored + e->size - table->count * CHUNK_END_LEN;
+    return RuckSackErrorNone;
+}
+
+struct Uring {
+    int fd;
+    struct io_uring_params params;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    // submission entries queued but not yet taken by the kernel
+    unsigned pending;
+};
+
+static void uring_close(struct Uring *ring) {
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+static int uring_open(struct Uring *ring, unsigned depth) {
+    memset(ring, 0, sizeof(struct Uring));
+    ring->fd = syscall(__NR_io_uring_setup, depth, &ring->params);
+    if (ring->fd < 0)
+        return -1;
+
+    struct io_uring_params *p = &ring->params;
+    ring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    void *sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            ring->fd, IORING_OFF_SQ_RING);
+    void *cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            ring->fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            ring->fd, IORING_OFF_SQES);
+    ring->sq_ring = (sq_ring == MAP_FAILED) ? NULL : sq_ring;
+    ring->cq_ring = (cq_ring == MAP_FAILED) ? NULL : cq_ring;
+    ring->sqes = (sqes == MAP_FAILED) ? NULL : sqes;
+    if (!ring->sq_ring || !ring->cq_ring || !ring->sqes) {
+        uring_close(ring);
+        return -1;
+    }
+    return 0;
+}
+
+static unsigned *uring_sq_field(struct Uring *ring, unsigned offset) {
+    return (unsigned *)((char *)ring->sq_ring + offset);
+}
+
+static unsigned *uring_cq_field(struct Uring *ring, unsigned offset) {
+    return (unsigned *)((char *)ring->cq_ring + offset);
+}
+
+// queues a submission entry and returns it cleared. the caller keeps no
+// more than sq_entries entries queued, so there is always room.
+static struct io_uring_sqe *uring_queue(struct Uring *ring, uint8_t opcode, uint64_t user_data) {
+    unsigned *tail = uring_sq_field(ring, ring->params.sq_off.tail);
+    unsigned mask = *uring_sq_field(ring, ring->params.sq_off.ring_mask);
+    unsigned *array = uring_sq_field(ring, ring->params.sq_off.array);
+    unsigned index = *tail & mask;
+
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = user_data;
+    array[index] = index;
+    __atomic_store_n(tail, *tail + 1, __ATOMIC_RELEASE);
+    ring->pending += 1;
+    return sqe;
+}
+
+// queues a read of fd at offset into iov
+static void uring_queue_read(struct Uring *ring, int fd, struct iovec *iov, long offset,
+        uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = uring_queue(ring, IORING_OP_READV, user_data);
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = 1;
+}
+
+// queues a cancel of the request with target_data. the cancel completes
+// with a user_data of 0.
+static void uring_queue_cancel(struct Uring *ring, uint64_t target_data) {
+    struct io_uring_sqe *sqe = uring_queue(ring, IORING_OP_ASYNC_CANCEL, 0);
+    sqe->fd = -1;
+    sqe->addr = target_data;
+}
+
+// submits what is queued and waits for at least one completion
+static int uring_submit_and_wait(struct Uring *ring) {
+    unsigned min_complete = 1;
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    bool fail = false;
+    if (fail_uring_submit) {
+        uring_submit_count += 1;
+        if (uring_submit_count == fail_uring_submit) {
+            // submit without waiting, so reads are left in flight
+            min_complete = 0;
+            flags = 0;
+            fail = true;
+        }
+    }
+    for (;;) {
+        long amt = syscall(__NR_io_uring_enter, ring->fd, ring->pending, min_complete,
+                flags, NULL, 0);
+        if (amt >= 0) {
+            ring->pending -= amt;
+            if (fail) {
+                errno = EIO;
+                return -1;
+            }
+            return 0;
+        }
+        if (errno != EINTR && errno != EAGAIN)
+            return -1;
+    }
+}
+
+// submits what is queued without waiting
+static int uring_submit(struct Uring *ring) {
+    for (;;) {
+        long amt = syscall(__NR_io_uring_enter, ring->fd, ring->pending, 0, 0, NULL, 0);
+        if (amt >= 0) {
+            ring->pending -= amt;
+            return 0;
+        }
+        if (errno != EINTR && errno != EAGAIN)
+            return -1;
+    }
+}
+
+// waits for at least one completion without submitting anything
+static int uring_wait(struct Uring *ring) {
+    if (fail_uring_wait && uring_submit_count >= fail_uring_submit) {
+        errno = EIO;
+        return -1;
+    }
+    for (;;) {
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) >= 0)
+            return 0;
+        if (errno != EINTR && errno != EAGAIN)
+            return -1;
+    }
+}
+
+// a read in flight. compressed files are read into stored and decoded when
+// the read completes.
+struct UringRead {
+    struct RuckSackReadRequest *request;
+    unsigned char *stored;
+    long done;
+    struct iovec iov;
+};
+
+static void uring_read_next(struct Uring *ring, struct UringRead *read, int fd) {
+    struct RuckSackFileEntry *e = read->request->entry;
+    unsigned char *dest = read->stored ? read->stored : read->request->buffer;
+    read->iov.iov_base = dest + read->done;
+    read->iov.iov_len = e->size - read->done;
+    uring_queue_read(ring, fd, &read->iov, e->offset + read->done, (uintptr_t)read);
 }
 
-static int get_file_entry(struct RuckSackBundlePrivate *b, const char *key,
-        int key_size, long int size, struct RuckSackFileEntry **out_entry, char precise)
+// when the kernel refuses a submission, the reads it did take are waited
+// for, since they still point at the buffers, and every read it did not
+// finish is read again with batch_read_pool. when waiting fails too, the
+// reads are cancelled and the completion queue is polled until all of them
+// are back.
+static int batch_read_uring(struct Uring *ring, int fd,
+        struct RuckSackReadRequest **order, long count,
+        void (*callback)(struct RuckSackReadRequest *request))
 {
-    // return info for existing entry
-    struct RuckSackFileEntry *e = find_file_entry(b, key, key_size);
-    if (e) {
-        if (e->allocated_size < size) {
-            int err = resize_file_entry(b, e, size, precise);
-            if (err) {
-                *out_entry = NULL;
-                return err;
+    long depth = ring->params.sq_entries;
+    struct UringRead *reads = calloc(depth, sizeof(struct UringRead));
+    struct UringRead **free_reads = malloc(depth * sizeof(struct UringRead *));
+    struct RuckSackReadRequest **retry = malloc(count * sizeof(struct RuckSackReadRequest *));
+    if (!reads || !free_reads || !retry) {
+        free(reads);
+        free(free_reads);
+        free(retry);
+        return RuckSackErrorNoMem;
+    }
+    long free_count = depth;
+    for (long i = 0; i < depth; i += 1)
+        free_reads[i] = &reads[depth - 1 - i];
+
+    unsigned *sq_head = uring_sq_field(ring, ring->params.sq_off.head);
+    unsigned *sq_tail = uring_sq_field(ring, ring->params.sq_off.tail);
+    unsigned sq_mask = *uring_sq_field(ring, ring->params.sq_off.ring_mask);
+    unsigned *cq_head = uring_cq_field(ring, ring->params.cq_off.head);
+    unsigned *cq_tail = uring_cq_field(ring, ring->params.cq_off.tail);
+    unsigned cq_mask = *uring_cq_field(ring, ring->params.cq_off.ring_mask);
+    struct io_uring_cqe *cqes = (struct io_uring_cqe *)((char *)ring->cq_ring +
+            ring->params.cq_off.cqes);
+
+    long next = 0;
+    long retry_count = 0;
+    bool failed = false;
+    bool polling = false;
+    for (;;) {
+        // fill the free slots in disk order
+        while (!failed && next < count && free_count > 0) {
+            struct RuckSackReadRequest *request = order[next];
+            struct RuckSackFileEntry *e = request->entry;
+            next += 1;
+            if (e->size == 0) {
+                request->err = rucksack_file_read(e, request->buffer);
+                if (callback)
+                    callback(request);
+                continue;
             }
+            struct UringRead *read = free_reads[--free_count];
+            read->request = request;
+            read->done = 0;
+            read->stored = NULL;
+            if (e->codec) {
+                read->stored = malloc(e->size);
+                if (!read->stored) {
+                    request->err = RuckSackErrorNoMem;
+                    read->request = NULL;
+                    free_reads[free_count++] = read;
+                    if (callback)
+                        callback(request);
+                    continue;
+                }
+            }
+            uring_read_next(ring, read, fd);
         }
-        *out_entry = e;
-        return RuckSackErrorNone;
+        // nothing in flight
+        if (free_count == depth)
+            break;
+
+        if (failed && !polling && uring_wait(ring)) {
+            // the kernel may still write into the buffers, so cancel the
+            // reads and watch the completion queue until all of them are
+            // back. any system call lets the kernel post completions.
+            polling = true;
+            for (long i = 0; i < depth; i += 1) {
+                if (reads[i].request)
+                    uring_queue_cancel(ring, (uintptr_t)&reads[i]);
+            }
+            uring_submit(ring);
+        }
+        if (polling) {
+            struct timespec delay = {0, 1000000};
+            nanosleep(&delay, NULL);
+        } else if (uring_submit_and_wait(ring)) {
+            // take back the reads the kernel did not take and wait for the
+            // rest
+            failed = true;
+            unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            for (unsigned i = head; i != *sq_tail; i += 1) {
+                struct UringRead *read = (struct UringRead *)(uintptr_t)ring->sqes[i & sq_mask].user_data;
+                retry[retry_count++] = read->request;
+                free(read->stored);
+                read->stored = NULL;
+                read->request = NULL;
+                free_reads[free_count++] = read;
+            }
+            __atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+            ring->pending = 0;
+            continue;
+        }
+
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head += 1) {
+            struct io_uring_cqe *cqe = &cqes[head & cq_mask];
+            // a cancel
+            if (!cqe->user_data)
+                continue;
+            struct UringRead *read = (struct UringRead *)(uintptr_t)cqe->user_data;
+            struct RuckSackReadRequest *request = read->request;
+            struct RuckSackFileEntry *e = request->entry;
+            bool reported = true;
+            bool short_read = cqe->res > 0 && read->done + cqe->res < e->size;
+            if (short_read && !failed) {
+                // short read, read the rest
+                read->done += cqe->res;
+                uring_read_next(ring, read, fd);
+                continue;
+            }
+            if (failed && (short_read || cqe->res <= 0)) {
+                retry[retry_count++] = request;
+                reported = false;
+            } else {
+                request->err = RuckSackErrorNone;
+                if (cqe->res <= 0) {
+                    request->err = RuckSackErrorFileAccess;
+                } else if (read->stored) {
+                    struct ChunkTable table;
+                    request->err = chunk_table_in(e, read->stored, &table);
+                    if (!request->err)
+                        request->err = decode_range(e, &table, 0, e->decoded_size, request->buffer);
+                }
+            }
+            free(read->stored);
+            read->stored = NULL;
+            read->request = NULL;
+            free_reads[free_count++] = read;
+            if (reported && callback)
+                callback(request);
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
     }
 
-    // none found, allocate new entry
-    return allocate_file_entry(b, key, key_size, size, out_entry, precise);
+    free(reads);
+    free(free_reads);
+
+    int err = RuckSackErrorNone;
+    for (long i = next; i < count; i += 1)
+        retry[retry_count++] = order[i];
+    if (retry_count)
+        err = batch_read_pool(retry, retry_count, callback);
+    free(retry);
+    return err;
 }
+#endif
 
-static int add_stream(struct RuckSackBundle *bundle, const char *key,
-        int key_size, long size_guess, struct RuckSackOutStream **out_stream,
-        char precise, long mtime)
+int rucksack_bundle_read_batch(struct RuckSackBundle *bundle,
+        struct RuckSackReadRequest *requests, long count,
+        void (*callback)(struct RuckSackReadRequest *request))
 {
-    struct RuckSackOutStream *stream = calloc(1, sizeof(struct RuckSackOutStream));
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)bundle;
+    if (count <= 0)
+        return RuckSackErrorNone;
 
-    if (!stream) {
-        *out_stream = NULL;
+    struct RuckSackReadRequest **order = malloc(count * sizeof(struct RuckSackReadRequest *));
+    if (!order)
         return RuckSackErrorNoMem;
+    for (long i = 0; i < count; i += 1) {
+        order[i] = &requests[i];
+        requests[i].err = RuckSackErrorNone;
     }
-    key_size = (key_size == -1) ? strlen(key) : key_size;
-
-    stream->b = (struct RuckSackBundlePrivate *) bundle;
-    long stream_size = alloc_size_precise(precise, size_guess);
-    int err = get_file_entry(stream->b, key, key_size, stream_size, &stream->e, precise);
-    if (err) {
-        free(stream);
-        *out_stream = NULL;
-        return err;
+    qsort(order, count, sizeof(struct RuckSackReadRequest *), compare_request_offsets);
+
+    int err = RuckSackErrorNone;
+    if (b->mem_buffer) {
+        // nothing to wait for
+        for (long i = 0; i < count; i += 1) {
+            order[i]->err = rucksack_file_read(order[i]->entry, order[i]->buffer);
+            if (callback)
+                callback(order[i]);
+        }
+    } else {
+#ifdef RUCKSACK_HAVE_IO_URING
+        // the ring reads stored bytes without rucksack_file_read, which
+        // checks them
+        struct Uring ring;
+        if (!b->verify && !uring_open(&ring, MIN(count, BATCH_DEPTH))) {
+            err = batch_read_uring(&ring, fileno(b->f), order, count, callback);
+            uring_close(&ring);
+        } else {
+            err = batch_read_pool(order, count, callback);
+        }
+#else
+        err = batch_read_pool(order, count, callback);
+#endif
     }
-    stream->e->is_open = 1;
-    stream->e->size = 0;
-    stream->e->mtime = mtime;
-    stream->e->touched = 1;
 
-    *out_stream = stream;
-    return RuckSackErrorNone;
+    for (long i = 0; !err && i < count; i += 1)
+        err = requests[i].err;
+    free(order);
+    return err;
 }
 
-int rucksack_bundle_add_stream_precise(struct RuckSackBundle *bundle,
-        const char *key, int key_size, long size, struct RuckSackOutStream **out_stream,
-        long mtime)
-{
-    return add_stream(bundle, key, key_size, size, out_stream, 1, mtime);
+void rucksack_bundle_set_verify(struct RuckSackBundle *bundle, int verify) {
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)bundle;
+    b->verify = verify;
 }
 
-int rucksack_bundle_add_stream(struct RuckSackBundle *bundle,
-        const char *key, int key_size, long size_guess, struct RuckSackOutStream **out_stream)
-{
-    return add_stream(bundle, key, key_size, size_guess, out_stream, 0, time(0));
-}
+struct VerifyPool {
+    struct RuckSackBundlePrivate *b;
+    int *errs;
+    pthread_mutex_t mutex;
+    // the next entry to check
+    long next;
+};
 
-void rucksack_stream_close(struct RuckSackOutStream *stream) {
-    stream->e->is_open = 0;
-    free(stream);
+static void *verify_pool_run(void *arg) {
+    struct VerifyPool *pool = arg;
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->next < pool->b->header_entry_count) {
+        long i = pool->next;
+        pool->next += 1;
+        pthread_mutex_unlock(&pool->mutex);
+
+        pool->errs[i] = rucksack_file_verify(&pool->b->entries[i]);
+
+        pthread_mutex_lock(&pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
 }
 
-int rucksack_stream_write(struct RuckSackOutStream *stream, const void *ptr,
-        long int count)
-{
-    long int pos = stream->e->size;
-    long int end = pos + count;
-    if (end > stream->e->allocated_size) {
-        // It didn't fit. Move this stream to a new one with extra padding
-        long int new_size = alloc_size(end);
-        int err = resize_file_entry(stream->b, stream->e, new_size, 0);
+int rucksack_bundle_verify(struct RuckSackBundle *bundle, int *errs, int thread_count) {
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)bundle;
+    // the workers take the entries as they are, so decode them all first
+    for (long i = 0; b->lazy && i < b->header_entry_count; i += 1) {
+        int err = materialize_entry(b, &b->entries[i]);
         if (err)
             return err;
     }
 
-    FILE *f = stream->b->f;
-
-    if (fseek(f, stream->e->offset + pos, SEEK_SET))
-        return RuckSackErrorFileAccess;
-
-    if (fwrite(ptr, 1, count, stream->b->f) != count)
-        return RuckSackErrorFileAccess;
-
-    stream->e->size = pos + count;
+    struct VerifyPool pool;
+    pool.b = b;
+    pool.errs = errs;
+    pool.next = 0;
+    pthread_mutex_init(&pool.mutex, NULL);
+
+    // the calling thread is one of the workers
+    long worker_count = MIN(MAX(thread_count, 1), b->header_entry_count);
+    pthread_t *threads = malloc(MAX(worker_count - 1, 1) * sizeof(pthread_t));
+    if (!threads) {
+        pthread_mutex_destroy(&pool.mutex);
+        return RuckSackErrorNoMem;
+    }
+    long started = 0;
+    while (started < worker_count - 1) {
+        if (pthread_create(&threads[started], NULL, verify_pool_run, &pool))
+            break;
+        started += 1;
+    }
+    verify_pool_run(&pool);
 
+    for (long i = 0; i < started; i += 1)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&pool.mutex);
     return RuckSackErrorNone;
 }
 
-struct RuckSackFileEntry *rucksack_bundle_find_file(struct RuckSackBundle *bundle,
-        const char *key, int key_size)
-{
-    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *) bundle;
-    key_size = (key_size == -1) ? strlen(key) : key_size;
-    return find_file_entry(b, key, key_size);
-}
-
-long int rucksack_file_size(struct RuckSackFileEntry *entry) {
-    return entry->size;
-}
-
-const char *rucksack_file_name(struct RuckSackFileEntry *entry) {
-    return entry->key;
-}
-
-int rucksack_file_name_size(struct RuckSackFileEntry *entry) {
-    return entry->key_size;
-}
-
-int rucksack_file_read(struct RuckSackFileEntry *e, unsigned char *buffer)
-{
-    struct RuckSackBundlePrivate *b = e->b;
-    if (bundle_seek(b, e->offset))
-        return RuckSackErrorFileAccess;
-    long amt_read = bundle_read(b, buffer, e->size);
-    if (amt_read != e->size)
-        return RuckSackErrorFileAccess;
-    return RuckSackErrorNone;
+int rucksack_file_data(struct RuckSackFileEntry *e, const unsigned char **ptr) {
+    if (e->codec) {
+        *ptr = NULL;
+        return RuckSackErrorCompressed;
+    }
+    return bundle_data(e->b, e->offset, e->size, ptr);
 }
 
 void rucksack_version(int *major, int *minor, int *patch) {
@@ -824,13 +3749,19 @@ long int rucksack_bundle_file_count(struct RuckSackBundle *bundle) {
     return b->header_entry_count;
 }
 
-void rucksack_bundle_get_files(struct RuckSackBundle *bundle,
+int rucksack_bundle_get_files(struct RuckSackBundle *bundle,
         struct RuckSackFileEntry **entries)
 {
     struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *) bundle;
     for (int i = 0; i < b->header_entry_count; i += 1) {
+        if (b->lazy) {
+            int err = materialize_entry(b, &b->entries[i]);
+            if (err)
+                return err;
+        }
         entries[i] = &b->entries[i];
     }
+    return RuckSackErrorNone;
 }
 
 const char *rucksack_err_str(int err) {
@@ -842,6 +3773,10 @@ int rucksack_file_open_texture(struct RuckSackFileEntry *entry,
 {
     *out_texture = NULL;
 
+    // the texture functions read straight out of the stored contents
+    if (entry->codec)
+        return RuckSackErrorCompressed;
+
     struct RuckSackTexturePrivate *t = calloc(1, sizeof(struct RuckSackTexturePrivate));
     struct RuckSackTexture *texture = &t->externals;
     if (!t)
@@ -849,13 +3784,8 @@ int rucksack_file_open_texture(struct RuckSackFileEntry *entry,
     t->entry = entry;
 
     struct RuckSackBundlePrivate *b = entry->b;
-    if (bundle_seek(b, entry->offset)) {
-        rucksack_texture_close(texture);
-        return RuckSackErrorFileAccess;
-    }
-
     unsigned char buf[MAX(TEXTURE_HEADER_LEN, IMAGE_HEADER_LEN)];
-    long amt_read = bundle_read(b, buf, TEXTURE_HEADER_LEN);
+    long amt_read = bundle_read_at(b, entry->offset, buf, TEXTURE_HEADER_LEN);
     if (amt_read != TEXTURE_HEADER_LEN) {
         rucksack_texture_close(texture);
         return RuckSackErrorFileAccess;
@@ -886,19 +3816,13 @@ int rucksack_file_open_texture(struct RuckSackFileEntry *entry,
         struct RuckSackImagePrivate *img = &t->images[i];
         struct RuckSackImage *image = &img->externals;
 
-        if (bundle_seek(b, next_offset)) {
-            rucksack_texture_close(texture);
-            return RuckSackErrorFileAccess;
-        }
-
-        long amt_read = bundle_read(b, buf, IMAGE_HEADER_LEN);
+        long amt_read = bundle_read_at(b, next_offset, buf, IMAGE_HEADER_LEN);
         if (amt_read != IMAGE_HEADER_LEN) {
             rucksack_texture_close(texture);
             return RuckSackErrorFileAccess;
         }
 
         long this_size = read_uint32be(&buf[0]);
-        next_offset += this_size;
 
         image->anchor = read_uint32be(&buf[4]);
         image->anchor_x = read_float32be(&buf[8]);
@@ -915,12 +3839,14 @@ int rucksack_file_open_texture(struct RuckSackFileEntry *entry,
             rucksack_texture_close(texture);
             return RuckSackErrorNoMem;
         }
-        amt_read = bundle_read(b, image->key, image->key_size);
+        amt_read = bundle_read_at(b, next_offset + IMAGE_HEADER_LEN,
+                image->key, image->key_size);
         if (amt_read != image->key_size) {
             rucksack_texture_close(texture);
             return RuckSackErrorFileAccess;
         }
         image->key[image->key_size] = 0;
+        next_offset += this_size;
     }
 
     texture->key = entry->key;
@@ -938,14 +3864,20 @@ long rucksack_texture_size(struct RuckSackTexture *texture) {
 int rucksack_texture_read(struct RuckSackTexture *texture, unsigned char *buffer) {
     struct RuckSackTexturePrivate *t = (struct RuckSackTexturePrivate *) texture;
     struct RuckSackFileEntry *entry = t->entry;
-    if (bundle_seek(entry->b, entry->offset + t->pixel_data_offset))
-        return RuckSackErrorFileAccess;
-    long int amt_read = bundle_read(entry->b, buffer, t->pixel_data_size);
+    long int amt_read = bundle_read_at(entry->b, entry->offset + t->pixel_data_offset,
+            buffer, t->pixel_data_size);
     if (amt_read != t->pixel_data_size)
         return RuckSackErrorFileAccess;
     return RuckSackErrorNone;
 }
 
+int rucksack_texture_data(struct RuckSackTexture *texture, const unsigned char **ptr) {
+    struct RuckSackTexturePrivate *t = (struct RuckSackTexturePrivate *) texture;
+    struct RuckSackFileEntry *entry = t->entry;
+    return bundle_data(entry->b, entry->offset + t->pixel_data_offset,
+            t->pixel_data_size, ptr);
+}
+
 long rucksack_texture_image_count(struct RuckSackTexture *texture) {
     struct RuckSackTexturePrivate *t = (struct RuckSackTexturePrivate *) texture;
     return t->images_count;
@@ -966,21 +3898,176 @@ long rucksack_file_mtime(struct RuckSackFileEntry *entry) {
     return entry->mtime;
 }
 
+long long rucksack_file_mtime_ns(struct RuckSackFileEntry *entry) {
+    if (entry->has_mtime_ns)
+        return entry->mtime_ns;
+    return (long long)entry->mtime * NS_PER_SECOND;
+}
+
+int rucksack_file_is_tombstone(struct RuckSackFileEntry *entry) {
+    return entry->tombstone;
+}
+
+struct RuckSackOverlaySlot {
+    uint32_t key_hash;
+    const char *key;
+    int key_size;
+    // NULL when the slot is empty
+    struct RuckSackBundlePrivate *b;
+    // NULL when the key is a tombstone
+    struct RuckSackFileEntry *entry;
+};
+
+struct RuckSackOverlay {
+    // open addressing hash table (linear probing) with the topmost entry of
+    // every key in any of the bundles, tombstones included
+    struct RuckSackOverlaySlot *slots;
+    long int slot_count; // always a power of 2
+    // the slots of the keys which are not deleted, topmost bundle first
+    long int *visible;
+    long int visible_count;
+};
+
+// the key of an entry and whether it is a tombstone, without decoding the
+// entry of a lazy bundle
+static int peek_entry(struct RuckSackBundlePrivate *b, long int entry_index,
+        const char **key, int *key_size, int *tombstone)
+{
+    struct RuckSackFileEntry *e = &b->entries[entry_index];
+    if (!b->lazy || entry_materialized(e)) {
+        *key = e->key;
+        *key_size = e->key_size;
+        *tombstone = e->tombstone;
+        return RuckSackErrorNone;
+    }
+    const unsigned char *header = lazy_header(b, entry_index);
+    if (!header)
+        return RuckSackErrorInvalidFormat;
+    *key = (const char *)&header[HEADER_ENTRY_LEN];
+    *key_size = read_uint32be(&header[32]);
+    *tombstone = (header_flags(header) & ENTRY_FLAG_TOMBSTONE) != 0;
+    return RuckSackErrorNone;
+}
+
+// returns the slot with the key, or the empty slot where it would go
+static long int overlay_find_slot(struct RuckSackOverlay *overlay,
+        const char *key, int key_size, uint32_t hash)
+{
+    long int mask = overlay->slot_count - 1;
+    long int slot = hash & mask;
+    for (; overlay->slots[slot].b; slot = (slot + 1) & mask) {
+        struct RuckSackOverlaySlot *s = &overlay->slots[slot];
+        if (s->key_hash == hash && memneql(key, key_size, s->key, s->key_size) == 0)
+            break;
+    }
+    return slot;
+}
+
+int rucksack_overlay_create(struct RuckSackBundle **bundles, int bundle_count,
+        struct RuckSackOverlay **out_overlay)
+{
+    *out_overlay = NULL;
+    long int entry_count = 0;
+    for (int i = 0; i < bundle_count; i += 1)
+        entry_count += ((struct RuckSackBundlePrivate *)bundles[i])->header_entry_count;
+
+    struct RuckSackOverlay *overlay = calloc(1, sizeof(struct RuckSackOverlay));
+    if (!overlay)
+        return RuckSackErrorNoMem;
+    overlay->slot_count = index_slot_count_for(entry_count);
+    overlay->slots = calloc(overlay->slot_count, sizeof(struct RuckSackOverlaySlot));
+    overlay->visible = malloc(MAX(entry_count, 1) * sizeof(long int));
+    if (!overlay->slots || !overlay->visible) {
+        rucksack_overlay_destroy(overlay);
+        return RuckSackErrorNoMem;
+    }
+
+    // the topmost bundle goes in first and keys already in the table are
+    // covered by it
+    for (int i = bundle_count - 1; i >= 0; i -= 1) {
+        struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)bundles[i];
+        for (long int entry_index = 0; entry_index < b->header_entry_count; entry_index += 1) {
+            const char *key;
+            int key_size;
+            int tombstone;
+            int err = peek_entry(b, entry_index, &key, &key_size, &tombstone);
+            if (err) {
+                rucksack_overlay_destroy(overlay);
+                return err;
+            }
+            uint32_t hash = hash_key(key, key_size);
+            long int slot = overlay_find_slot(overlay, key, key_size, hash);
+            struct RuckSackOverlaySlot *s = &overlay->slots[slot];
+            if (s->b)
+                continue;
+            s->key_hash = hash;
+            s->key = key;
+            s->key_size = key_size;
+            s->b = b;
+            s->entry = tombstone ? NULL : &b->entries[entry_index];
+            if (!tombstone) {
+                overlay->visible[overlay->visible_count] = slot;
+                overlay->visible_count += 1;
+            }
+        }
+    }
+
+    *out_overlay = overlay;
+    return RuckSackErrorNone;
+}
+
+void rucksack_overlay_destroy(struct RuckSackOverlay *overlay) {
+    if (!overlay)
+        return;
+    free(overlay->slots);
+    free(overlay->visible);
+    free(overlay);
+}
+
+struct RuckSackFileEntry *rucksack_overlay_find_file(struct RuckSackOverlay *overlay,
+        const char *key, int key_size)
+{
+    key_size = (key_size == -1) ? strlen(key) : key_size;
+    long int slot = overlay_find_slot(overlay, key, key_size, hash_key(key, key_size));
+    struct RuckSackOverlaySlot *s = &overlay->slots[slot];
+    if (!s->entry)
+        return NULL;
+    if (s->b->lazy && materialize_entry(s->b, s->entry))
+        return NULL;
+    return s->entry;
+}
+
+long int rucksack_overlay_file_count(struct RuckSackOverlay *overlay) {
+    return overlay->visible_count;
+}
+
+int rucksack_overlay_get_files(struct RuckSackOverlay *overlay,
+        struct RuckSackFileEntry **entries)
+{
+    for (long int i = 0; i < overlay->visible_count; i += 1) {
+        struct RuckSackOverlaySlot *s = &overlay->slots[overlay->visible[i]];
+        if (s->b->lazy) {
+            int err = materialize_entry(s->b, s->entry);
+            if (err)
+                return err;
+        }
+        entries[i] = s->entry;
+    }
+    return RuckSackErrorNone;
+}
+
 int rucksack_bundle_version(void) {
     return BUNDLE_VERSION;
 }
 
 int rucksack_file_is_texture(struct RuckSackFileEntry *e, int *is_texture) {
     struct RuckSackBundlePrivate *b = e->b;
-    if (e->size < UUID_SIZE) {
+    if (e->codec || e->size < UUID_SIZE) {
         *is_texture = 0;
         return RuckSackErrorNone;
     }
-    if (bundle_seek(b, e->offset))
-        return RuckSackErrorFileAccess;
-
     unsigned char buf[UUID_SIZE];
-    long int amt_read = bundle_read(b, buf, UUID_SIZE);
+    long int amt_read = bundle_read_at(b, e->offset, buf, UUID_SIZE);
     if (amt_read != UUID_SIZE)
         return RuckSackErrorFileAccess;
 
@@ -991,34 +4078,51 @@ int rucksack_file_is_texture(struct RuckSackFileEntry *e, int *is_texture) {
 
 long rucksack_bundle_get_headers_byte_count(struct RuckSackBundle *bundle) {
     struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *) bundle;
-    return b->headers_byte_count;
+    return header_region_size(b);
 }
 
-static void delete_entry(struct RuckSackBundlePrivate *b, struct RuckSackFileEntry *e) {
-    long allocated_size = e->allocated_size;
-    b->headers_byte_count -= HEADER_ENTRY_LEN + e->key_size;
-    b->header_entry_count -= 1;
-    struct RuckSackFileEntry *prev = get_prev_entry(b, e);
-    struct RuckSackFileEntry *next = get_next_entry(b, e);
-    struct RuckSackFileEntry *next_last = get_prev_entry(b, b->last_entry);
-    if (e->key)
-        free(e->key);
-    *e = *b->last_entry;
-    b->last_entry = next_last;
-    if (prev) {
-        prev->allocated_size += allocated_size;
-    } else if (next) {
-        b->first_entry = next;
-        b->first_file_offset = b->first_entry->offset;
-    } else {
-        init_new_bundle(b, -1);
+long rucksack_bundle_alignment(struct RuckSackBundle *bundle) {
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *) bundle;
+    return b->alignment;
+}
+
+static int delete_entry(struct RuckSackBundlePrivate *b, struct RuckSackFileEntry *e) {
+    int err = release_extent(b, e);
+    if (err)
+        return err;
+    b->headers_byte_count -= header_entry_len(e);
+    index_remove_slot(b, index_slot_of_entry(b, e - b->entries));
+    content_index_remove(b, e - b->entries);
+    free_entry_key(e);
+
+    // fill the gap in the entries array with the last one. entries which
+    // share an extent are not in by_offset.
+    struct RuckSackFileEntry *moved = &b->entries[b->header_entry_count - 1];
+    if (moved != e) {
+        long int slot = index_slot_of_entry(b, moved - b->entries);
+        long int content_slot = content_index_slot_of_entry(b, moved - b->entries);
+        long int pos = moved->shared ? -1 : offset_position(b, entry_ref(b, moved));
+        *e = *moved;
+        b->index[slot] = (e - b->entries) + 1;
+        if (content_slot != -1)
+            b->content_index[content_slot] = (e - b->entries) + 1;
+        if (pos != -1)
+            b->by_offset[pos] = entry_ref(b, e);
+        if (e->hole)
+            b->holes[e->hole - 1].owner = entry_ref(b, e);
     }
+    memset(moved, 0, sizeof(struct RuckSackFileEntry));
+    b->header_entry_count -= 1;
+    b->dirty = true;
+    return RuckSackErrorNone;
 }
 
 int rucksack_bundle_delete_file(struct RuckSackBundle *bundle,
         const char *key, int key_size)
 {
     struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)bundle;
+    if (b->read_only)
+        return RuckSackErrorReadOnly;
     if (key_size == -1)
         key_size = strlen(key);
     struct RuckSackFileEntry *e = find_file_entry(b, key, key_size);
@@ -1027,25 +4131,240 @@ int rucksack_bundle_delete_file(struct RuckSackBundle *bundle,
     if (e->is_open)
         return RuckSackErrorStreamOpen;
 
-    delete_entry(b, e);
+    return delete_entry(b, e);
+}
+
+// whether a patch has to carry the new entry of a key. contents without a
+// content hash to compare count as changed.
+static bool entry_changed(struct RuckSackFileEntry *old_e, struct RuckSackFileEntry *new_e) {
+    if (!old_e->has_content_hash || !new_e->has_content_hash)
+        return true;
+    return old_e->content_hash != new_e->content_hash ||
+        rucksack_file_size(old_e) != rucksack_file_size(new_e) ||
+        rucksack_file_mtime_ns(old_e) != rucksack_file_mtime_ns(new_e) ||
+        old_e->tombstone != new_e->tombstone;
+}
+
+int rucksack_bundle_diff(struct RuckSackBundle *old_bundle, struct RuckSackBundle *new_bundle,
+        struct RuckSackBundle *patch)
+{
+    struct RuckSackBundlePrivate *old_b = (struct RuckSackBundlePrivate *)old_bundle;
+    struct RuckSackBundlePrivate *new_b = (struct RuckSackBundlePrivate *)new_bundle;
+    struct RuckSackBundlePrivate *patch_b = (struct RuckSackBundlePrivate *)patch;
+    if (patch_b->read_only)
+        return RuckSackErrorReadOnly;
+
+    for (long int i = 0; i < new_b->header_entry_count; i += 1) {
+        struct RuckSackFileEntry *e = &new_b->entries[i];
+        if (new_b->lazy) {
+            int err = materialize_entry(new_b, e);
+            if (err)
+                return err;
+        }
+        struct RuckSackFileEntry *old_e = rucksack_bundle_find_file(old_bundle, e->key, e->key_size);
+        if (old_e && !entry_changed(old_e, e))
+            continue;
+        int err = rucksack_bundle_copy_file(patch, e);
+        if (err)
+            return err;
+    }
+
+    for (long int i = 0; i < old_b->header_entry_count; i += 1) {
+        struct RuckSackFileEntry *e = &old_b->entries[i];
+        if (old_b->lazy) {
+            int err = materialize_entry(old_b, e);
+            if (err)
+                return err;
+        }
+        if (e->tombstone || rucksack_bundle_find_file(new_bundle, e->key, e->key_size))
+            continue;
+        int err = rucksack_bundle_add_tombstone(patch, e->key, e->key_size);
+        if (err)
+            return err;
+    }
     return RuckSackErrorNone;
 }
 
-void rucksack_bundle_delete_untouched(struct RuckSackBundle *bundle) {
+int rucksack_bundle_apply(struct RuckSackBundle *bundle, struct RuckSackBundle *patch) {
     struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)bundle;
-    for (;;) {
-        int deleted_something = 0;
-        for (int i = 0; i < b->header_entry_count; i += 1) {
-            struct RuckSackFileEntry *e = &b->entries[i];
-            if (!e->touched) {
-                delete_entry(b, e);
-                deleted_something = 1;
-                break;
+    struct RuckSackBundlePrivate *patch_b = (struct RuckSackBundlePrivate *)patch;
+    if (b->read_only)
+        return RuckSackErrorReadOnly;
+
+    for (long int i = 0; i < patch_b->header_entry_count; i += 1) {
+        struct RuckSackFileEntry *e = &patch_b->entries[i];
+        if (patch_b->lazy) {
+            int err = materialize_entry(patch_b, e);
+            if (err)
+                return err;
+        }
+        int err;
+        if (e->tombstone) {
+            err = rucksack_bundle_delete_file(bundle, e->key, e->key_size);
+            if (err == RuckSackErrorNotFound)
+                err = RuckSackErrorNone;
+        } else {
+            err = rucksack_bundle_copy_file(bundle, e);
+        }
+        if (err)
+            return err;
+    }
+    return RuckSackErrorNone;
+}
+
+int rucksack_bundle_delete_untouched(struct RuckSackBundle *bundle) {
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)bundle;
+    if (b->read_only)
+        return RuckSackErrorReadOnly;
+
+    // the extents of deleted entries which the last header refers to become
+    // reserved, so make room for them up front
+    long int count = b->header_entry_count;
+    long int reserved_count = b->reserved_count;
+    for (long int i = 0; i < count; i += 1) {
+        if (!b->entries[i].touched && b->entries[i].committed)
+            reserved_count += 1;
+    }
+    int err = reserved_reserve(b, reserved_count);
+    if (err)
+        return err;
+    long int *new_ref = malloc(count * sizeof(long int));
+    if (count > 0 && !new_ref)
+        return RuckSackErrorNoMem;
+
+    // entries sharing an extent with a deleted one let go of it first, then
+    // the extents of deleted entries which are still shared go to one of the
+    // entries which are kept
+    for (long int i = 0; i < count; i += 1) {
+        struct RuckSackFileEntry *e = &b->entries[i];
+        if (!e->touched && e->shared)
+            release_extent(b, e);
+    }
+    for (long int i = 0; i < count; i += 1) {
+        struct RuckSackFileEntry *e = &b->entries[i];
+        if (!e->shared)
+            continue;
+        struct RuckSackFileEntry *owner = shared_owner(b, e);
+        if (!owner->touched)
+            hand_over_extent(b, owner, e);
+    }
+    content_index_drop(b);
+
+    // compact the entries array in one pass, then rebuild everything which
+    // refers to entries by index
+    long int kept = 0;
+    for (long int i = 0; i < count; i += 1) {
+        struct RuckSackFileEntry *e = &b->entries[i];
+        if (!e->touched) {
+            b->headers_byte_count -= header_entry_len(e);
+            new_ref[i] = 0;
+            if (e->committed)
+                reserved_add(b, e->offset, e->allocated_size, &new_ref[i]);
+            free_entry_key(e);
+            continue;
+        }
+        new_ref[i] = kept + 1;
+        if (kept != i)
+            b->entries[kept] = *e;
+        kept += 1;
+    }
+    if (kept == count) {
+        free(new_ref);
+        return RuckSackErrorNone;
+    }
+    memset(&b->entries[kept], 0, (count - kept) * sizeof(struct RuckSackFileEntry));
+    b->header_entry_count = kept;
+
+    long int by_offset_count = 0;
+    for (long int pos = 0; pos < b->by_offset_count; pos += 1) {
+        long int ref = b->by_offset[pos];
+        if (ref > 0)
+            ref = new_ref[ref - 1];
+        if (ref)
+            b->by_offset[by_offset_count++] = ref;
+    }
+    b->by_offset_count = by_offset_count;
+    free(new_ref);
+
+    memset(b->index, 0, b->index_slot_count * sizeof(long int));
+    for (long int i = 0; i < kept; i += 1)
+        index_insert_no_grow(b, i);
+
+    // the space of the other deleted entries turns into holes, or becomes
+    // part of the free space before the first extent or after the last one
+    holes_from_gaps(b);
+    b->dirty = true;
+
+    return RuckSackErrorNone;
+}
+
+int rucksack_bundle_alloc_stats(struct RuckSackBundle *bundle,
+        struct RuckSackAllocStats *stats)
+{
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)bundle;
+    memset(stats, 0, sizeof(struct RuckSackAllocStats));
+
+    // the header region and, while a bundle is open for writing, the extents
+    // which are kept for the last generation are not free either
+    long int count = b->header_entry_count;
+    long int extent_count = count + (b->read_only ? 1 : b->reserved_count);
+    struct RuckSackFileEntry **sorted = malloc(extent_count * sizeof(struct RuckSackFileEntry *));
+    if (!sorted)
+        return RuckSackErrorNoMem;
+    for (long int i = 0; i < count; i += 1) {
+        if (b->lazy) {
+            int err = materialize_entry(b, &b->entries[i]);
+            if (err) {
+                free(sorted);
+                return err;
             }
         }
-        if (!deleted_something)
-            return;
+        sorted[i] = &b->entries[i];
+    }
+    struct RuckSackFileEntry header;
+    memset(&header, 0, sizeof(struct RuckSackFileEntry));
+    if (b->read_only) {
+        header.offset = b->first_header_offset;
+        header.allocated_size = b->header_region_len;
+        sorted[count] = &header;
+    } else {
+        for (long int i = 0; i < b->reserved_count; i += 1)
+            sorted[count + i] = &b->reserved[i];
+    }
+    qsort(sorted, extent_count, sizeof(struct RuckSackFileEntry *), compare_entry_offsets);
+
+    // the room before the first file is where the header goes, so it does
+    // not count as a hole
+    bool after_file = false;
+    for (long int i = 0; i < extent_count; i += 1) {
+        struct RuckSackFileEntry *entry = sorted[i];
+        // only files have a bundle. the contents of shared files are
+        // counted once.
+        if (entry->b && !entry->shared) {
+            stats->data_bytes += entry->size;
+            stats->allocated_bytes += entry->allocated_size;
+            after_file = true;
+        }
+        if (i + 1 == extent_count || !after_file)
+            continue;
+        long int hole_size = sorted[i + 1]->offset - (entry->offset + entry->allocated_size);
+        if (hole_size > 0) {
+            stats->free_bytes += hole_size;
+            stats->hole_count += 1;
+            stats->largest_hole = MAX(stats->largest_hole, hole_size);
+        }
     }
+    stats->file_count = count;
+
+    free(sorted);
+    return RuckSackErrorNone;
+}
+
+void rucksack_bundle_sync_stats(struct RuckSackBundle *bundle,
+        struct RuckSackSyncStats *stats)
+{
+    struct RuckSackBundlePrivate *b = (struct RuckSackBundlePrivate *)bundle;
+    *stats = b->sync_stats;
 }
 
 void rucksack_file_touch(struct RuckSackFileEntry *entry) {
@@ -28,6 +28,21 @@ enum RuckSackError {
     RuckSackErrorImageFormat,
     RuckSackErrorNotFound,
     RuckSackErrorStreamOpen,
+    RuckSackErrorNotInMemory,
+    RuckSackErrorReadOnly,
+    RuckSackErrorInvalidCodec,
+    RuckSackErrorCompressed,
+    RuckSackErrorInvalidRange,
+    RuckSackErrorInvalidAlignment,
+    RuckSackErrorChecksum,
+    RuckSackErrorNoChecksum,
+};
+
+/* how the contents of an entry are stored, see rucksack_stream_set_codec */
+enum RuckSackCodec {
+    RuckSackCodecNone,
+    /* fast LZ77 compression in the LZ4 block format */
+    RuckSackCodecLz,
 };
 
 /* the size of this struct is not part of the public ABI. */
@@ -38,6 +53,62 @@ struct RuckSackBundle {
 
 struct RuckSackFileEntry;
 
+/* see rucksack_bundle_alloc_stats */
+struct RuckSackAllocStats {
+    long file_count;
+    /* sum of the sizes of all files, counting shared contents once */
+    long data_bytes;
+    /* bytes reserved for files, including room for them to grow */
+    long allocated_bytes;
+    /* unused bytes between files, which new files can be put in */
+    long free_bytes;
+    long hole_count;
+    long largest_hole;
+};
+
+/* when the changes to a bundle opened for writing are synced to disk. a
+ * bundle whose process dies opens as of the last commit in every mode; the
+ * modes differ in what survives the machine going down. */
+enum RuckSackDurability {
+    /* never sync. fastest, for bundles which can be built again */
+    RuckSackDurabilityNone,
+    /* commit and sync when the bundle is closed. the default. */
+    RuckSackDurabilityOnClose,
+    /* also commit and sync when a stream is closed and no other stream is
+     * open. every commit writes all header entries and the key directory
+     * and syncs twice, so adding n files one stream at a time writes
+     * O(n^2) bytes of header. to add many files at once, keep a stream open
+     * while adding the others, or use RuckSackDurabilityOnClose and
+     * rucksack_bundle_commit. */
+    RuckSackDurabilityPerStream,
+};
+
+/* see rucksack_bundle_open_options. initialize with
+ * rucksack_bundle_options_init. */
+struct RuckSackBundleOptions {
+    /* room for the header of a new bundle, see rucksack_bundle_open_precise.
+     * defaults to -1, which lets rucksack pick. */
+    long headers_size;
+    /* defaults to RuckSackDurabilityOnClose */
+    enum RuckSackDurability durability;
+    /* files written from now on start at a multiple of this many bytes, a
+     * power of 2 up to 1 MB. it is recorded in the bundle and stays until
+     * changed. files already in the bundle move when they are written
+     * again. defaults to 0, which keeps the alignment of the bundle; new
+     * bundles have an alignment of 1. */
+    long alignment;
+};
+
+/* see rucksack_bundle_sync_stats */
+struct RuckSackSyncStats {
+    /* number of times a new generation of the header was written */
+    long commit_count;
+    /* time spent committing, including syncing */
+    double commit_seconds;
+    long sync_count;
+    double sync_seconds;
+};
+
 enum RuckSackAnchor {
     RuckSackAnchorCenter,
     RuckSackAnchorExplicit,
@@ -105,6 +176,19 @@ struct RuckSackTexture {
 };
 
 struct RuckSackOutStream;
+struct RuckSackInStream;
+struct RuckSackOverlay;
+
+/* one file to read with rucksack_bundle_read_batch */
+struct RuckSackReadRequest {
+    struct RuckSackFileEntry *entry;
+    /* rucksack_file_size bytes to read the decoded contents into */
+    unsigned char *buffer;
+    /* for the caller */
+    void *userdata;
+    /* set when the read completes */
+    int err;
+};
 
 void rucksack_version(int *major, int *minor, int *patch);
 int rucksack_bundle_version(void);
@@ -115,15 +199,42 @@ const char *rucksack_err_str(int err);
 int rucksack_bundle_open(const char *bundle_path, struct RuckSackBundle **bundle);
 int rucksack_bundle_open_precise(const char *bundle_path, struct RuckSackBundle **bundle,
         long headers_size);
-/* open read-only */
+void rucksack_bundle_options_init(struct RuckSackBundleOptions *options);
+int rucksack_bundle_open_options(const char *bundle_path, struct RuckSackBundle **bundle,
+        const struct RuckSackBundleOptions *options);
+/* open read-only.
+ * bundles opened read-only may be used from several threads at once:
+ * finding entries, reading files and opening and reading textures do not
+ * share a file position. rucksack_bundle_close must not race with them. */
 int rucksack_bundle_open_read(const char *bundle_path, struct RuckSackBundle **bundle);
 int rucksack_bundle_open_read_mem(const unsigned char *buffer, long size,
         struct RuckSackBundle **bundle);
+/* open read-only by mapping the whole file into memory. reads do not make
+ * any system calls and processes opening the same bundle share pages. */
+int rucksack_bundle_open_mmap(const char *bundle_path, struct RuckSackBundle **bundle);
+/* like rucksack_bundle_open_read_mem and rucksack_bundle_open_mmap, but
+ * nothing about an entry is decoded until it is found, which makes opening a
+ * bundle with many entries fast when only a few of them are needed. keys are
+ * looked up in the key directory stored in the bundle; version 1 bundles
+ * have none, so their keys are indexed when opening. like other read-only
+ * bundles, lazy bundles may be read from several threads at once. */
+int rucksack_bundle_open_read_mem_lazy(const unsigned char *buffer, long size,
+        struct RuckSackBundle **bundle);
+int rucksack_bundle_open_mmap_lazy(const char *bundle_path, struct RuckSackBundle **bundle);
 
+/* for bundles opened for writing, this commits like rucksack_bundle_commit.
+ * until then, the bundle opens as it was when it was last committed. */
 int rucksack_bundle_close(struct RuckSackBundle *bundle);
+/* make the changes to a bundle opened for writing durable as the
+ * durability mode allows. fails with RuckSackErrorStreamOpen while a stream
+ * is open. */
+int rucksack_bundle_commit(struct RuckSackBundle *bundle);
 
 int rucksack_bundle_add_file(struct RuckSackBundle *bundle, const char *key,
         int key_size, const char *file_name);
+/* like rucksack_bundle_add_file, with the contents encoded with codec */
+int rucksack_bundle_add_file_codec(struct RuckSackBundle *bundle, const char *key,
+        int key_size, const char *file_name, enum RuckSackCodec codec);
 int rucksack_bundle_add_stream(struct RuckSackBundle *bundle, const char *key,
         int key_size, long size_guess, struct RuckSackOutStream **stream);
 int rucksack_bundle_add_stream_precise(struct RuckSackBundle *bundle, const char *key,
@@ -131,26 +242,156 @@ int rucksack_bundle_add_stream_precise(struct RuckSackBundle *bundle, const char
 
 int rucksack_stream_write(struct RuckSackOutStream *stream, const void *ptr,
         long count);
-void rucksack_stream_close(struct RuckSackOutStream *stream);
+/* writes are buffered, so closing the stream can fail. when another file has
+ * the same contents and codec, the file shares them and its own space is
+ * given back. */
+int rucksack_stream_close(struct RuckSackOutStream *stream);
+/* encode what is written to the stream with codec. must be called before
+ * anything is written; returns RuckSackErrorInvalidCodec otherwise or when
+ * the codec is unknown. the contents are encoded in chunks of 64 KB, which
+ * are stored as they are when they do not get smaller. */
+int rucksack_stream_set_codec(struct RuckSackOutStream *stream, enum RuckSackCodec codec);
 
 int rucksack_bundle_delete_file(struct RuckSackBundle *bundle, const char *key,
         int key_size);
+/* adds an empty file which marks the key as deleted, replacing any file with
+ * that key. a bundle laid over others with rucksack_overlay_create hides the
+ * key in the bundles below it. */
+int rucksack_bundle_add_tombstone(struct RuckSackBundle *bundle, const char *key,
+        int key_size);
+/* adds a file of another bundle under the same key and mtime, copying the
+ * stored bytes as they are without decoding them. fails with
+ * RuckSackErrorChecksum when they do not match their checksum. */
+int rucksack_bundle_copy_file(struct RuckSackBundle *bundle, struct RuckSackFileEntry *entry);
+/* adds to patch what turns old_bundle into new_bundle: the files of
+ * new_bundle which old_bundle does not have or whose content hash, size or
+ * mtime differ, and a tombstone for every key of old_bundle which
+ * new_bundle does not have. files without a content hash are always added.
+ * patch is a bundle opened for writing, normally a new one. */
+int rucksack_bundle_diff(struct RuckSackBundle *old_bundle, struct RuckSackBundle *new_bundle,
+        struct RuckSackBundle *patch);
+/* writes the files of patch into bundle and deletes the keys of its
+ * tombstones, so that bundle has what rucksack_overlay_create would find in
+ * bundle and patch laid over it. the bundle file is not written again; the
+ * files go into free space like any other added file. */
+int rucksack_bundle_apply(struct RuckSackBundle *bundle, struct RuckSackBundle *patch);
 
 /* mark this texture so that rucksack_bundle_delete_untouched will not delete it */
 void rucksack_texture_touch(struct RuckSackTexture *texture);
 
 
 long rucksack_bundle_file_count(struct RuckSackBundle *bundle);
-void rucksack_bundle_get_files(struct RuckSackBundle *bundle,
+/* fills entries with rucksack_bundle_file_count files. lazily opened bundles
+ * decode the entries here, which fails when the header is corrupt or memory
+ * runs out; entries is then not usable. */
+int rucksack_bundle_get_files(struct RuckSackBundle *bundle,
         struct RuckSackFileEntry **entries);
 
 struct RuckSackFileEntry *rucksack_bundle_find_file(
         struct RuckSackBundle *bundle, const char *key, int key_size);
+/* the size of the decoded contents, which rucksack_file_read produces */
 long rucksack_file_size(struct RuckSackFileEntry *entry);
 const char *rucksack_file_name(struct RuckSackFileEntry *entry);
 int rucksack_file_name_size(struct RuckSackFileEntry *entry);
+/* files added with rucksack_bundle_add_file have the mtime of the source
+ * file, other files the time they were added */
 long rucksack_file_mtime(struct RuckSackFileEntry *entry);
+/* the mtime in nanoseconds. files written by versions before it was kept
+ * have the mtime in seconds times 1000000000. */
+long long rucksack_file_mtime_ns(struct RuckSackFileEntry *entry);
+/* sets up_to_date when the contents of file_name are those of the file. the
+ * file is only read when its size matches and its mtime does not, or the
+ * mtime has whole seconds only; then its hash is compared with the content
+ * hash, and on a match the new mtime is kept unless the bundle is
+ * read-only, so that the next check does not read it again. */
+int rucksack_file_check_source(struct RuckSackFileEntry *entry, const char *file_name,
+        int *up_to_date);
+/* whether the file was added with rucksack_bundle_add_tombstone */
+int rucksack_file_is_tombstone(struct RuckSackFileEntry *entry);
+/* decodes the contents if they are stored with a codec */
 int rucksack_file_read(struct RuckSackFileEntry *entry, unsigned char *buffer);
+/* like rucksack_file_read, decoding the chunks of a file stored with a codec
+ * on up to thread_count threads at once. worth it for large files only. */
+int rucksack_file_read_parallel(struct RuckSackFileEntry *entry, unsigned char *buffer,
+        int thread_count);
+/* reads size bytes of the decoded contents starting at offset. returns
+ * RuckSackErrorInvalidRange unless the range is within rucksack_file_size.
+ * for files stored with a codec only the chunks in the range are decoded. */
+int rucksack_file_read_range(struct RuckSackFileEntry *entry, long offset, long size,
+        unsigned char *buffer);
+/* point ptr directly at the file contents without copying. only works for
+ * bundles opened with rucksack_bundle_open_read_mem or rucksack_bundle_open_mmap;
+ * otherwise returns RuckSackErrorNotInMemory. the pointer is valid until the
+ * bundle is closed. returns RuckSackErrorCompressed when the contents are
+ * stored with a codec. */
+int rucksack_file_data(struct RuckSackFileEntry *entry, const unsigned char **ptr);
+/* the contents as they are stored in the bundle, before decoding */
+enum RuckSackCodec rucksack_file_codec(struct RuckSackFileEntry *entry);
+/* the codec the file was written with. differs from rucksack_file_codec when
+ * the contents did not get smaller with it and are stored as they are. */
+enum RuckSackCodec rucksack_file_written_codec(struct RuckSackFileEntry *entry);
+long rucksack_file_stored_size(struct RuckSackFileEntry *entry);
+int rucksack_file_read_stored(struct RuckSackFileEntry *entry, unsigned char *buffer);
+
+/* read the decoded contents from start to end a piece at a time, without
+ * holding the whole file in memory. the stream reads ahead and tells the
+ * system the file is read sequentially. call rucksack_instream_close when
+ * done. */
+int rucksack_file_open_stream(struct RuckSackFileEntry *entry, struct RuckSackInStream **stream);
+/* reads up to size bytes. amt_read is less than size only at the end of the
+ * file. */
+int rucksack_instream_read(struct RuckSackInStream *stream, void *ptr, long size,
+        long *amt_read);
+void rucksack_instream_close(struct RuckSackInStream *stream);
+
+/* reads the files of count requests with many reads in flight at once,
+ * using io_uring where available and a few threads otherwise. reads are
+ * issued in the order the files are stored in the bundle. callback may be
+ * NULL; otherwise it is called on the calling thread as each request
+ * completes. returns the first error of any request, in the order of
+ * requests. */
+int rucksack_bundle_read_batch(struct RuckSackBundle *bundle,
+        struct RuckSackReadRequest *requests, long count,
+        void (*callback)(struct RuckSackReadRequest *request));
+
+/* files written by this version have a CRC-32C checksum of their stored
+ * bytes. when verify is set, rucksack_file_read, rucksack_file_read_parallel,
+ * rucksack_file_read_stored and rucksack_bundle_read_batch check it and fail
+ * with RuckSackErrorChecksum when the bytes do not match. files without a
+ * checksum are read as before. off by default. */
+void rucksack_bundle_set_verify(struct RuckSackBundle *bundle, int verify);
+/* reads the stored bytes of a file and checks them against its checksum.
+ * returns RuckSackErrorChecksum when they do not match and
+ * RuckSackErrorNoChecksum when the file has no checksum. */
+int rucksack_file_verify(struct RuckSackFileEntry *entry);
+/* rucksack_file_verify for every file, on up to thread_count threads at once.
+ * errs has room for rucksack_bundle_file_count results, which are in the
+ * order of rucksack_bundle_get_files. returns an error only when the files
+ * could not be checked at all. */
+int rucksack_bundle_verify(struct RuckSackBundle *bundle, int *errs, int thread_count);
+
+/* lays bundles over each other, such as a base bundle and patches to it.
+ * a key is found in the last of the bundles which has it, unless it is a
+ * tombstone there. the keys of all bundles are put in one hash table, so
+ * finding a file takes one lookup however many bundles there are. the
+ * bundles must stay open and must not be written to while the overlay is in
+ * use; the entries it returns belong to them. finding files is not safe
+ * from several threads at once when any of the bundles is lazy. call
+ * rucksack_overlay_destroy when done; it does not close the bundles. */
+int rucksack_overlay_create(struct RuckSackBundle **bundles, int bundle_count,
+        struct RuckSackOverlay **overlay);
+void rucksack_overlay_destroy(struct RuckSackOverlay *overlay);
+/* returns NULL when no bundle has the key or the last one which has it has a
+ * tombstone */
+struct RuckSackFileEntry *rucksack_overlay_find_file(struct RuckSackOverlay *overlay,
+        const char *key, int key_size);
+/* the files which rucksack_overlay_find_file finds, without tombstones.
+ * files of later bundles come first. */
+long rucksack_overlay_file_count(struct RuckSackOverlay *overlay);
+/* returns an error like rucksack_bundle_get_files when an entry of a lazily
+ * opened bundle cannot be decoded */
+int rucksack_overlay_get_files(struct RuckSackOverlay *overlay,
+        struct RuckSackFileEntry **entries);
 
 /* mark this file so that rucksack_bundle_delete_untouched will not delete it */
 void rucksack_file_touch(struct RuckSackFileEntry *entry);
@@ -166,6 +407,8 @@ void rucksack_texture_close(struct RuckSackTexture *texture);
 long rucksack_texture_size(struct RuckSackTexture *texture);
 /* get the image data for this texture */
 int rucksack_texture_read(struct RuckSackTexture *texture, unsigned char *buffer);
+/* like rucksack_file_data but for the image data of this texture */
+int rucksack_texture_data(struct RuckSackTexture *texture, const unsigned char **ptr);
 
 /* image metadata */
 long rucksack_texture_image_count(struct RuckSackTexture *texture);
@@ -174,9 +417,21 @@ void rucksack_texture_get_images(struct RuckSackTexture *texture,
 
 /* usually not needed. used by the `strip` command */
 long rucksack_bundle_get_headers_byte_count(struct RuckSackBundle *bundle);
+/* the alignment of files, see RuckSackBundleOptions */
+long rucksack_bundle_alignment(struct RuckSackBundle *bundle);
 
 /* delete all file entries you have not written to while the bundle was open */
-void rucksack_bundle_delete_untouched(struct RuckSackBundle *bundle);
+int rucksack_bundle_delete_untouched(struct RuckSackBundle *bundle);
+
+/* find out how the space in the bundle is used. the ratio of free_bytes to
+ * allocated_bytes + free_bytes is a measure of fragmentation. */
+int rucksack_bundle_alloc_stats(struct RuckSackBundle *bundle,
+        struct RuckSackAllocStats *stats);
+
+/* find out how often and for how long the bundle was committed and synced
+ * since it was opened. for measuring the cost of a durability mode. */
+void rucksack_bundle_sync_stats(struct RuckSackBundle *bundle,
+        struct RuckSackSyncStats *stats);
 
 #ifdef __cplusplus
 }
@@ -13,6 +13,8 @@
 #include <stdint.h>
 #include <FreeImage.h>
 
+#include "hash.h"
+
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 
 static const int UUID_SIZE = 16;
@@ -57,13 +59,60 @@ struct RuckSackFileEntry {
     int key_size;
     long mtime;
     char *key;
+    uint32_t key_hash;
     int is_open; // flag for when an out stream is writing to this entry
     int touched; // flag, set when the entry is written to
+    int borrowed_key; // flag, set when key is not owned by this entry
+    long hole; // free extent right after this entry, index plus one; 0 if none
+    int committed; // flag, set when the last written header refers to the contents
+    // size is the number of stored bytes. when the contents are encoded with
+    // a codec, decoded_size is the size they decode to, in chunks of
+    // chunk_size bytes which are encoded separately.
+    int codec;
+    long decoded_size;
+    long chunk_size;
+    // hash of the decoded contents, when they were written by this version
+    int has_content_hash;
+    uint64_t content_hash;
+    // CRC-32C of the stored bytes, to find out whether they were damaged
+    int has_checksum;
+    uint32_t checksum;
+    // the key was deleted. for bundles laid over others, see RuckSackOverlay.
+    int tombstone;
+    // written with a codec, but stored as it is as it did not get smaller
+    int codec_skipped;
+    // mtime in nanoseconds, when it was written by this version. mtime is
+    // the same in seconds.
+    int has_mtime_ns;
+    int64_t mtime_ns;
+    // an entry with the same contents as another one shares its extent
+    // instead of having one of its own. the extent belongs to one of them,
+    // which is in by_offset and counts the others in shares; the others are
+    // flagged shared and have an allocated size of 0.
+    int shared;
+    long shares;
 };
 
 struct RuckSackOutStream {
     struct RuckSackBundlePrivate *b;
     struct RuckSackFileEntry *e;
+    // small writes are collected here and written together
+    unsigned char *buffer;
+    long buffer_len;
+    // streams with a codec collect a chunk here and encode it into
+    // encoded_chunk when it is full. chunk_ends has the end of each chunk
+    // written so far, relative to the start of the entry.
+    int codec;
+    unsigned char *chunk;
+    long chunk_len;
+    unsigned char *encoded_chunk;
+    long *chunk_ends;
+    long chunk_count;
+    long chunk_ends_size;
+    // of the decoded contents
+    struct RuckSackHash hash;
+    // of the stored bytes written so far
+    uint32_t checksum;
 };
 
 struct RuckSackImagePrivate {
@@ -552,10 +552,10 @@ int rucksack_bundle_add_texture(struct RuckSackBundle *bundle, struct RuckSackTe
     if (err)
         return err;
 
-    rucksack_stream_close(stream);
+    err = rucksack_stream_close(stream);
     FreeImage_CloseMemory(out_stream);
 
-    return RuckSackErrorNone;
+    return err;
 }
 
 struct RuckSackTexture *rucksack_texture_create(void) {
@@ -0,0 +1,19 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of rucksack, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#ifndef RUCKSACK_TEST_HOOKS_H_INCLUDED
+#define RUCKSACK_TEST_HOOKS_H_INCLUDED
+
+// failures the tests can force. not part of the API and not installed.
+
+// the io_uring submission of batch reads with this number, counting from 1
+// after the call, is handed to the kernel without waiting and then reported
+// as failed. when fail_wait is set, waiting for completions after it fails
+// too. 0 turns it off. nothing happens without io_uring.
+void rucksack_test_fail_uring(int fail_submit, int fail_wait);
+
+#endif /* RUCKSACK_TEST_HOOKS_H_INCLUDED */
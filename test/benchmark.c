@@ -0,0 +1,899 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of rucksack, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#undef NDEBUG
+
+#include "rucksack.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+static void ok(int err) {
+    if (!err) return;
+    fprintf(stderr, "Error: %s\n", rucksack_err_str(err));
+    assert(0);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void write_uint32be(unsigned char *buf, uint32_t x) {
+    buf[0] = (x >> 24) & 0xff;
+    buf[1] = (x >> 16) & 0xff;
+    buf[2] = (x >> 8) & 0xff;
+    buf[3] = x & 0xff;
+}
+
+static void write_uint64be(unsigned char *buf, uint64_t x) {
+    write_uint32be(buf, x >> 32);
+    write_uint32be(buf + 4, x & 0xffffffff);
+}
+
+static int make_key(char *buf, long i) {
+    return sprintf(buf, "assets/level%03ld/sprite%07ld.png", i % 100, i);
+}
+
+static const char *FILE_DATA = "0123456789abcdef";
+static const long FILE_DATA_SIZE = 16;
+
+// builds a version 1 bundle in memory following the format documented in
+// the README, where every one of entry_count files refers to the same
+// FILE_DATA. this avoids paying for the allocator when all we want to
+// measure is reading.
+static unsigned char *make_bundle_mem_v1(long entry_count, long *out_size) {
+    const long main_header_len = 28;
+    const long header_entry_len = 36;
+    char key[64];
+    long headers_size = 0;
+    for (long i = 0; i < entry_count; i += 1)
+        headers_size += header_entry_len + make_key(key, i);
+
+    // leave room for the key directory so that upgrading the bundle to the
+    // current version does not have to move the file data
+    long data_offset = 40 + headers_size + 40 * entry_count + 8;
+    long size = data_offset + FILE_DATA_SIZE;
+    unsigned char *buf = calloc(1, size);
+    assert(buf);
+
+    memcpy(buf, "\x60\x70\xc8\x99\x82\xa1\x41\x84\x89\x51\x08\xc9\x1c\xc9\xb6\x20", 16);
+    write_uint32be(&buf[16], 1);
+    write_uint32be(&buf[20], main_header_len);
+    write_uint32be(&buf[24], entry_count);
+
+    unsigned char *ptr = buf + main_header_len;
+    for (long i = 0; i < entry_count; i += 1) {
+        int key_size = make_key(key, i);
+        write_uint32be(&ptr[0], header_entry_len + key_size);
+        write_uint64be(&ptr[4], data_offset);
+        write_uint64be(&ptr[12], FILE_DATA_SIZE);
+        write_uint64be(&ptr[20], FILE_DATA_SIZE);
+        write_uint32be(&ptr[28], 0);
+        write_uint32be(&ptr[32], key_size);
+        memcpy(&ptr[36], key, key_size);
+        ptr += header_entry_len + key_size;
+    }
+    memcpy(&buf[data_offset], FILE_DATA, FILE_DATA_SIZE);
+
+    *out_size = size;
+    return buf;
+}
+
+// builds a bundle of the current version by letting rucksack upgrade a
+// version 1 bundle
+static unsigned char *make_bundle_mem(long entry_count, long *out_size) {
+    const char *bundle_name = "benchmark.bundle";
+    long v1_size;
+    unsigned char *v1 = make_bundle_mem_v1(entry_count, &v1_size);
+    FILE *f = fopen(bundle_name, "wb");
+    assert(f);
+    assert(fwrite(v1, 1, v1_size, f) == (size_t)v1_size);
+    assert(fclose(f) == 0);
+    free(v1);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    ok(rucksack_bundle_close(bundle));
+
+    f = fopen(bundle_name, "rb");
+    assert(f);
+    assert(fseek(f, 0, SEEK_END) == 0);
+    long size = ftell(f);
+    unsigned char *buf = malloc(size);
+    assert(buf);
+    assert(fseek(f, 0, SEEK_SET) == 0);
+    assert(fread(buf, 1, size, f) == (size_t)size);
+    assert(fclose(f) == 0);
+    remove(bundle_name);
+
+    *out_size = size;
+    return buf;
+}
+
+// what rucksack_bundle_find_file used to do
+static struct RuckSackFileEntry *linear_find(struct RuckSackFileEntry **entries,
+        long count, const char *key, int key_size)
+{
+    for (long i = 0; i < count; i += 1) {
+        struct RuckSackFileEntry *e = entries[i];
+        if (rucksack_file_name_size(e) == key_size &&
+            memcmp(rucksack_file_name(e), key, key_size) == 0)
+        {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void bench_find_file(void) {
+    static const long sizes[] = {1000, 10000, 100000};
+    const long lookup_count = 10000;
+    char key[64];
+
+    for (int s = 0; s < 3; s += 1) {
+        long entry_count = sizes[s];
+        long mem_size;
+        unsigned char *mem = make_bundle_mem(entry_count, &mem_size);
+
+        struct RuckSackBundle *bundle;
+        ok(rucksack_bundle_open_read_mem(mem, mem_size, &bundle));
+        struct RuckSackFileEntry **entries = malloc(entry_count * sizeof(struct RuckSackFileEntry *));
+        assert(entries);
+        ok(rucksack_bundle_get_files(bundle, entries));
+
+        double start = now();
+        for (long i = 0; i < lookup_count; i += 1) {
+            long n = (i * 7919) % entry_count;
+            int key_size = make_key(key, n);
+            struct RuckSackFileEntry *e = rucksack_bundle_find_file(bundle, key, key_size);
+            assert(e && rucksack_file_name_size(e) == key_size);
+        }
+        double hash_time = now() - start;
+
+        start = now();
+        for (long i = 0; i < lookup_count; i += 1) {
+            long n = (i * 7919) % entry_count;
+            int key_size = make_key(key, n);
+            struct RuckSackFileEntry *e = linear_find(entries, entry_count, key, key_size);
+            assert(e);
+        }
+        double scan_time = now() - start;
+
+        printf("  %6ld entries: hash %8.1f ns/lookup, linear scan %10.1f ns/lookup\n",
+                entry_count, hash_time * 1e9 / lookup_count, scan_time * 1e9 / lookup_count);
+
+        free(entries);
+        ok(rucksack_bundle_close(bundle));
+        free(mem);
+    }
+}
+
+static double time_open_to_first_read(unsigned char *mem, long mem_size, long entry_count,
+        int (*open_fn)(const unsigned char *, long, struct RuckSackBundle **))
+{
+    char key[64];
+    unsigned char buf[16];
+    int key_size = make_key(key, entry_count / 2);
+
+    double start = now();
+    struct RuckSackBundle *bundle;
+    ok(open_fn(mem, mem_size, &bundle));
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, key_size);
+    assert(entry);
+    ok(rucksack_file_read(entry, buf));
+    double elapsed = now() - start;
+
+    assert(memcmp(buf, FILE_DATA, FILE_DATA_SIZE) == 0);
+    ok(rucksack_bundle_close(bundle));
+    return elapsed;
+}
+
+static void bench_open_to_first_read(void) {
+    static const long sizes[] = {1000, 10000, 100000};
+    const int iterations = 10;
+
+    for (int s = 0; s < 3; s += 1) {
+        long entry_count = sizes[s];
+        long mem_size;
+        unsigned char *mem = make_bundle_mem(entry_count, &mem_size);
+        long v1_size;
+        unsigned char *v1 = make_bundle_mem_v1(entry_count, &v1_size);
+
+        double eager_time = 0;
+        double lazy_v1_time = 0;
+        double lazy_time = 0;
+        for (int i = 0; i < iterations; i += 1) {
+            eager_time += time_open_to_first_read(mem, mem_size, entry_count,
+                    rucksack_bundle_open_read_mem);
+            lazy_v1_time += time_open_to_first_read(v1, v1_size, entry_count,
+                    rucksack_bundle_open_read_mem_lazy);
+            lazy_time += time_open_to_first_read(mem, mem_size, entry_count,
+                    rucksack_bundle_open_read_mem_lazy);
+        }
+
+        printf("  %6ld entries: eager %9.1f us, lazy v1 %9.1f us, lazy %9.1f us\n",
+                entry_count, eager_time * 1e6 / iterations,
+                lazy_v1_time * 1e6 / iterations, lazy_time * 1e6 / iterations);
+
+        free(v1);
+        free(mem);
+    }
+}
+
+// the key goes first, as files with the same contents would be stored once
+static void write_file(struct RuckSackBundle *bundle, const char *key, int key_size,
+        const void *data, long size)
+{
+    struct RuckSackOutStream *stream;
+    ok(rucksack_bundle_add_stream(bundle, key, key_size, key_size + size, &stream));
+    ok(rucksack_stream_write(stream, key, key_size));
+    ok(rucksack_stream_write(stream, data, size));
+    ok(rucksack_stream_close(stream));
+}
+
+// what the bundle command does when some of the input files changed: write
+// the changed ones again, touch the rest and drop the ones which are gone
+static void bench_incremental_rebuild(void) {
+    const char *bundle_name = "benchmark.bundle";
+    const long entry_count = 20000;
+    const long changed_data_size = 256;
+    char key[64];
+    unsigned char *changed_data = calloc(1, changed_data_size);
+    assert(changed_data);
+    remove(bundle_name);
+
+    double start = now();
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (long i = 0; i < entry_count; i += 1) {
+        int key_size = make_key(key, i);
+        write_file(bundle, key, key_size, FILE_DATA, FILE_DATA_SIZE);
+    }
+    ok(rucksack_bundle_close(bundle));
+    double build_time = now() - start;
+
+    start = now();
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (long i = 0; i < entry_count; i += 1) {
+        int key_size = make_key(key, i);
+        if (i % 100 == 0) {
+            // changed, and bigger than before
+            write_file(bundle, key, key_size, changed_data, changed_data_size);
+        } else if (i % 100 != 50) {
+            struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, key_size);
+            assert(entry);
+            rucksack_file_touch(entry);
+        }
+    }
+    rucksack_bundle_delete_untouched(bundle);
+    ok(rucksack_bundle_close(bundle));
+    double rebuild_time = now() - start;
+
+    printf("  %6ld entries: build %8.1f ms, rebuild after changing 1%% %8.1f ms\n",
+            entry_count, build_time * 1e3, rebuild_time * 1e3);
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    assert(rucksack_bundle_file_count(bundle) == entry_count - entry_count / 100);
+    struct RuckSackAllocStats stats;
+    ok(rucksack_bundle_alloc_stats(bundle, &stats));
+    printf("  after rebuild: %ld holes, %ld free bytes, largest hole %ld bytes\n",
+            stats.hole_count, stats.free_bytes, stats.largest_hole);
+    ok(rucksack_bundle_close(bundle));
+    remove(bundle_name);
+    free(changed_data);
+}
+
+static void bench_delete_untouched(void) {
+    const char *bundle_name = "benchmark.bundle";
+    const long entry_count = 20000;
+    char key[64];
+    remove(bundle_name);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (long i = 0; i < entry_count; i += 1) {
+        int key_size = make_key(key, i);
+        write_file(bundle, key, key_size, FILE_DATA, FILE_DATA_SIZE);
+    }
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (long i = 0; i < entry_count; i += 2) {
+        int key_size = make_key(key, i);
+        struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, key_size);
+        assert(entry);
+        rucksack_file_touch(entry);
+    }
+    double start = now();
+    ok(rucksack_bundle_delete_untouched(bundle));
+    double elapsed = now() - start;
+    assert(rucksack_bundle_file_count(bundle) == entry_count / 2);
+    ok(rucksack_bundle_close(bundle));
+
+    printf("  %6ld entries: deleting half of them %8.1f ms\n", entry_count, elapsed * 1e3);
+    remove(bundle_name);
+}
+
+// many small writes per stream, like the image entries of a texture
+static void bench_small_streams(void) {
+    const char *bundle_name = "benchmark.bundle";
+    const long stream_count = 10000;
+    const int writes_per_stream = 32;
+    char key[64];
+    unsigned char record[37];
+    memset(record, 0xab, sizeof(record));
+    remove(bundle_name);
+
+    double start = now();
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (long i = 0; i < stream_count; i += 1) {
+        int key_size = make_key(key, i);
+        struct RuckSackOutStream *stream;
+        ok(rucksack_bundle_add_stream(bundle, key, key_size,
+                    writes_per_stream * (sizeof(record) + key_size), &stream));
+        for (int j = 0; j < writes_per_stream; j += 1) {
+            ok(rucksack_stream_write(stream, record, sizeof(record)));
+            ok(rucksack_stream_write(stream, key, key_size));
+        }
+        ok(rucksack_stream_close(stream));
+    }
+    ok(rucksack_bundle_close(bundle));
+    double elapsed = now() - start;
+
+    printf("  %6ld streams of %d small writes: %8.1f ms\n", stream_count,
+            2 * writes_per_stream, elapsed * 1e3);
+    remove(bundle_name);
+}
+
+// reading text files stored as they are and compressed. the bundle is in the
+// page cache, so this measures decompression and not the storage it saves.
+static void bench_compressed_read(void) {
+    static const char *codec_names[] = {"none", "lz"};
+    const char *bundle_name = "benchmark.bundle";
+    const long file_count = 200;
+    char key[64];
+
+    for (int codec = 0; codec < 2; codec += 1) {
+        remove(bundle_name);
+        double start = now();
+        struct RuckSackBundle *bundle;
+        ok(rucksack_bundle_open(bundle_name, &bundle));
+        for (long i = 0; i < file_count; i += 1) {
+            int key_size = make_key(key, i);
+            ok(rucksack_bundle_add_file_codec(bundle, key, key_size, "../test/monkey.obj", codec));
+        }
+        ok(rucksack_bundle_close(bundle));
+        double write_time = now() - start;
+
+        ok(rucksack_bundle_open_read(bundle_name, &bundle));
+        struct RuckSackFileEntry **entries = malloc(file_count * sizeof(struct RuckSackFileEntry *));
+        assert(entries);
+        ok(rucksack_bundle_get_files(bundle, entries));
+        long file_size = rucksack_file_size(entries[0]);
+        unsigned char *buffer = malloc(file_size);
+        assert(buffer);
+        long stored_bytes = 0;
+        start = now();
+        for (long i = 0; i < file_count; i += 1) {
+            ok(rucksack_file_read(entries[i], buffer));
+            stored_bytes += rucksack_file_stored_size(entries[i]);
+        }
+        double read_time = now() - start;
+
+        printf("  %-4s %4ld files: %8ld stored bytes, write %6.1f ms, read %6.1f MB/s\n",
+                codec_names[codec], file_count, stored_bytes, write_time * 1e3,
+                file_count * file_size / read_time / 1e6);
+
+        free(buffer);
+        free(entries);
+        ok(rucksack_bundle_close(bundle));
+    }
+    remove(bundle_name);
+}
+
+// building the same bundle with each durability mode
+static void bench_durability(void) {
+    static const char *mode_names[] = {"none", "on close", "per stream"};
+    static const enum RuckSackDurability modes[] = {
+        RuckSackDurabilityNone,
+        RuckSackDurabilityOnClose,
+        RuckSackDurabilityPerStream,
+    };
+    const char *bundle_name = "benchmark.bundle";
+    const long entry_count = 2000;
+    char key[64];
+
+    for (int m = 0; m < 3; m += 1) {
+        remove(bundle_name);
+        struct RuckSackBundleOptions options;
+        rucksack_bundle_options_init(&options);
+        options.durability = modes[m];
+
+        double start = now();
+        struct RuckSackBundle *bundle;
+        ok(rucksack_bundle_open_options(bundle_name, &bundle, &options));
+        for (long i = 0; i < entry_count; i += 1) {
+            int key_size = make_key(key, i);
+            write_file(bundle, key, key_size, FILE_DATA, FILE_DATA_SIZE);
+        }
+        ok(rucksack_bundle_commit(bundle));
+        struct RuckSackSyncStats stats;
+        rucksack_bundle_sync_stats(bundle, &stats);
+        ok(rucksack_bundle_close(bundle));
+        double elapsed = now() - start;
+
+        printf("  %-10s %6ld entries: %8.1f ms, %5ld commits %8.1f ms, %5ld syncs %8.1f ms\n",
+                mode_names[m], entry_count, elapsed * 1e3,
+                stats.commit_count, stats.commit_seconds * 1e3,
+                stats.sync_count, stats.sync_seconds * 1e3);
+    }
+    remove(bundle_name);
+}
+
+static long read_monkey(unsigned char *monkey, long size) {
+    FILE *f = fopen("../test/monkey.obj", "rb");
+    assert(f);
+    long monkey_size = fread(monkey, 1, size, f);
+    assert(monkey_size > 0);
+    fclose(f);
+    return monkey_size;
+}
+
+static void bench_parallel_read(void) {
+    const char *bundle_name = "benchmark.bundle";
+    const long copies = 1000;
+    remove(bundle_name);
+
+    unsigned char monkey[32768];
+    long monkey_size = read_monkey(monkey, sizeof(monkey));
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    struct RuckSackOutStream *stream;
+    ok(rucksack_bundle_add_stream(bundle, "big", -1, 10, &stream));
+    ok(rucksack_stream_set_codec(stream, RuckSackCodecLz));
+    for (long i = 0; i < copies; i += 1)
+        ok(rucksack_stream_write(stream, monkey, monkey_size));
+    ok(rucksack_stream_close(stream));
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "big", -1);
+    assert(entry);
+    long size = rucksack_file_size(entry);
+    unsigned char *buffer = malloc(size);
+    assert(buffer);
+    for (int threads = 1; threads <= 8; threads *= 2) {
+        double start = now();
+        for (int i = 0; i < 5; i += 1)
+            ok(rucksack_file_read_parallel(entry, buffer, threads));
+        double read_time = (now() - start) / 5;
+        printf("  %d threads: %ld bytes, read %7.1f MB/s\n", threads, size, size / read_time / 1e6);
+    }
+
+    free(buffer);
+    ok(rucksack_bundle_close(bundle));
+    remove(bundle_name);
+}
+
+static void bench_batch_read(void) {
+    const char *bundle_name = "benchmark.bundle";
+    const long file_count = 2000;
+    char key[64];
+    remove(bundle_name);
+
+    unsigned char monkey[32768];
+    long monkey_size = read_monkey(monkey, sizeof(monkey));
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (long i = 0; i < file_count; i += 1) {
+        int key_size = make_key(key, i);
+        write_file(bundle, key, key_size, monkey, monkey_size);
+    }
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    struct RuckSackFileEntry **entries = malloc(file_count * sizeof(struct RuckSackFileEntry *));
+    struct RuckSackReadRequest *requests = calloc(file_count, sizeof(struct RuckSackReadRequest));
+    assert(entries && requests);
+    ok(rucksack_bundle_get_files(bundle, entries));
+    long file_size = rucksack_file_size(entries[0]);
+    unsigned char *buffers = malloc(file_count * file_size);
+    assert(buffers);
+    for (long i = 0; i < file_count; i += 1) {
+        requests[i].entry = entries[i];
+        requests[i].buffer = buffers + i * file_size;
+    }
+
+    double start = now();
+    for (long i = 0; i < file_count; i += 1)
+        ok(rucksack_file_read(entries[i], requests[i].buffer));
+    double one_by_one_time = now() - start;
+
+    start = now();
+    ok(rucksack_bundle_read_batch(bundle, requests, file_count, NULL));
+    double batch_time = now() - start;
+
+    printf("  %ld files: one by one %6.1f ms, batch %6.1f ms\n", file_count,
+            one_by_one_time * 1e3, batch_time * 1e3);
+
+    free(buffers);
+    free(requests);
+    free(entries);
+    ok(rucksack_bundle_close(bundle));
+    remove(bundle_name);
+}
+
+// many files with the same contents, such as copies of an asset under several
+// keys, compared to as many different files
+static void bench_shared_contents(void) {
+    const char *bundle_name = "benchmark.bundle";
+    const long file_count = 2000;
+    char key[64];
+
+    unsigned char monkey[32768];
+    long monkey_size = read_monkey(monkey, sizeof(monkey));
+    for (int shared = 0; shared <= 1; shared += 1) {
+        remove(bundle_name);
+        double start = now();
+        struct RuckSackBundle *bundle;
+        ok(rucksack_bundle_open(bundle_name, &bundle));
+        for (long i = 0; i < file_count; i += 1) {
+            int key_size = make_key(key, i);
+            struct RuckSackOutStream *stream;
+            ok(rucksack_bundle_add_stream(bundle, key, key_size, monkey_size, &stream));
+            // different files differ in their first byte
+            unsigned char first = shared ? 0 : i;
+            ok(rucksack_stream_write(stream, &first, 1));
+            ok(rucksack_stream_write(stream, monkey, monkey_size));
+            ok(rucksack_stream_close(stream));
+        }
+        ok(rucksack_bundle_close(bundle));
+        double elapsed = now() - start;
+
+        FILE *f = fopen(bundle_name, "rb");
+        assert(f);
+        assert(fseek(f, 0, SEEK_END) == 0);
+        long size = ftell(f);
+        fclose(f);
+        printf("  %ld %s files: build %8.1f ms, %10ld bytes\n", file_count,
+                shared ? "same" : "different", elapsed * 1e3, size);
+    }
+    remove(bundle_name);
+}
+
+static void bench_verify(void) {
+    const char *bundle_name = "benchmark.bundle";
+    const long file_count = 400;
+    const long file_size = 262144;
+    char key[64];
+
+    unsigned char monkey[32768];
+    long monkey_size = read_monkey(monkey, sizeof(monkey));
+    remove(bundle_name);
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (long i = 0; i < file_count; i += 1) {
+        int key_size = make_key(key, i);
+        struct RuckSackOutStream *stream;
+        ok(rucksack_bundle_add_stream(bundle, key, key_size, file_size, &stream));
+        unsigned char first = i;
+        ok(rucksack_stream_write(stream, &first, 1));
+        for (long pos = 1; pos < file_size; pos += monkey_size) {
+            long amt = (file_size - pos < monkey_size) ? file_size - pos : monkey_size;
+            ok(rucksack_stream_write(stream, monkey, amt));
+        }
+        ok(rucksack_stream_close(stream));
+    }
+    ok(rucksack_bundle_close(bundle));
+
+    double mb = (double)file_count * file_size / 1048576.0;
+    unsigned char *buffer = malloc(file_size);
+    struct RuckSackFileEntry **entries = malloc(file_count * sizeof(struct RuckSackFileEntry *));
+    int *errs = malloc(file_count * sizeof(int));
+    assert(buffer && entries && errs);
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    ok(rucksack_bundle_get_files(bundle, entries));
+    for (int verify = 0; verify <= 1; verify += 1) {
+        rucksack_bundle_set_verify(bundle, verify);
+        double start = now();
+        for (long i = 0; i < file_count; i += 1)
+            ok(rucksack_file_read(entries[i], buffer));
+        double elapsed = now() - start;
+        printf("  read, %-10s %8.1f MB/s\n", verify ? "checked:" : "unchecked:",
+                mb / elapsed);
+    }
+    int thread_counts[] = {1, 4};
+    for (int t = 0; t < 2; t += 1) {
+        double start = now();
+        ok(rucksack_bundle_verify(bundle, errs, thread_counts[t]));
+        double elapsed = now() - start;
+        for (long i = 0; i < file_count; i += 1)
+            ok(errs[i]);
+        printf("  verify, %d threads: %8.1f MB/s\n", thread_counts[t], mb / elapsed);
+    }
+    ok(rucksack_bundle_close(bundle));
+
+    free(errs);
+    free(entries);
+    free(buffer);
+    remove(bundle_name);
+}
+
+// looks a key up in every bundle from the last one down
+static struct RuckSackFileEntry *probe_bundles(struct RuckSackBundle **bundles, int count,
+        const char *key, int key_size)
+{
+    for (int i = count - 1; i >= 0; i -= 1) {
+        struct RuckSackFileEntry *e = rucksack_bundle_find_file(bundles[i], key, key_size);
+        if (e)
+            return e;
+    }
+    return NULL;
+}
+
+static void bench_overlay(void) {
+    static const int patch_counts[] = {1, 8, 32};
+    const long base_count = 100000;
+    const long patch_size = 1000;
+    const long lookup_count = 100000;
+    char key[64];
+
+    long base_size;
+    unsigned char *base = make_bundle_mem(base_count, &base_size);
+    long patch_mem_size;
+    unsigned char *patch = make_bundle_mem(patch_size, &patch_mem_size);
+    struct RuckSackBundle *bundles[33];
+    ok(rucksack_bundle_open_read_mem(base, base_size, &bundles[0]));
+    for (int i = 1; i <= 32; i += 1)
+        ok(rucksack_bundle_open_read_mem(patch, patch_mem_size, &bundles[i]));
+
+    for (int p = 0; p < 3; p += 1) {
+        int bundle_count = patch_counts[p] + 1;
+        double start = now();
+        struct RuckSackOverlay *overlay;
+        ok(rucksack_overlay_create(bundles, bundle_count, &overlay));
+        double create_time = now() - start;
+
+        start = now();
+        for (long i = 0; i < lookup_count; i += 1) {
+            int key_size = make_key(key, (i * 7919) % base_count);
+            struct RuckSackFileEntry *e = rucksack_overlay_find_file(overlay, key, key_size);
+            assert(e);
+        }
+        double overlay_time = now() - start;
+
+        start = now();
+        for (long i = 0; i < lookup_count; i += 1) {
+            int key_size = make_key(key, (i * 7919) % base_count);
+            struct RuckSackFileEntry *e = probe_bundles(bundles, bundle_count, key, key_size);
+            assert(e);
+        }
+        double probe_time = now() - start;
+
+        printf("  %2d patches: create %6.1f ms, overlay %6.1f ns/lookup, "
+                "probing each %7.1f ns/lookup\n", patch_counts[p], create_time * 1e3,
+                overlay_time * 1e9 / lookup_count, probe_time * 1e9 / lookup_count);
+        rucksack_overlay_destroy(overlay);
+    }
+
+    for (int i = 0; i <= 32; i += 1)
+        ok(rucksack_bundle_close(bundles[i]));
+    free(patch);
+    free(base);
+}
+
+static long file_size_of(const char *path) {
+    FILE *f = fopen(path, "rb");
+    assert(f);
+    assert(fseek(f, 0, SEEK_END) == 0);
+    long size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+static void bench_diff_apply(void) {
+    const char *old_name = "benchmark.bundle";
+    const char *new_name = "benchmark-new.bundle";
+    const char *patch_name = "benchmark-patch.bundle";
+    const long file_count = 2000;
+    const long changed_count = 20;
+    char key[64];
+
+    unsigned char monkey[32768];
+    long monkey_size = read_monkey(monkey, sizeof(monkey));
+    for (int version = 0; version <= 1; version += 1) {
+        const char *bundle_name = version ? new_name : old_name;
+        remove(bundle_name);
+        struct RuckSackBundle *bundle;
+        ok(rucksack_bundle_open(bundle_name, &bundle));
+        for (long i = 0; i < file_count; i += 1) {
+            int key_size = make_key(key, i);
+            struct RuckSackOutStream *stream;
+            ok(rucksack_bundle_add_stream_precise(bundle, key, key_size,
+                        key_size + 1 + monkey_size, &stream, 0));
+            // every file starts with its key, changed ones have another byte after
+            unsigned char changed = version && i % (file_count / changed_count) == 0;
+            ok(rucksack_stream_write(stream, key, key_size));
+            ok(rucksack_stream_write(stream, &changed, 1));
+            ok(rucksack_stream_write(stream, monkey, monkey_size));
+            ok(rucksack_stream_close(stream));
+        }
+        ok(rucksack_bundle_close(bundle));
+    }
+
+    double start = now();
+    struct RuckSackBundle *old_bundle, *new_bundle, *patch;
+    ok(rucksack_bundle_open_read(old_name, &old_bundle));
+    ok(rucksack_bundle_open_read(new_name, &new_bundle));
+    remove(patch_name);
+    ok(rucksack_bundle_open(patch_name, &patch));
+    ok(rucksack_bundle_diff(old_bundle, new_bundle, patch));
+    assert(rucksack_bundle_file_count(patch) == changed_count);
+    ok(rucksack_bundle_close(patch));
+    ok(rucksack_bundle_close(new_bundle));
+    ok(rucksack_bundle_close(old_bundle));
+    double diff_time = now() - start;
+
+    start = now();
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(old_name, &bundle));
+    ok(rucksack_bundle_open_read(patch_name, &patch));
+    ok(rucksack_bundle_apply(bundle, patch));
+    ok(rucksack_bundle_close(patch));
+    ok(rucksack_bundle_close(bundle));
+    double apply_time = now() - start;
+
+    printf("  %ld of %ld files changed: diff %6.1f ms, apply %6.1f ms, "
+            "patch %8ld bytes, bundle %9ld bytes\n", changed_count, file_count,
+            diff_time * 1e3, apply_time * 1e3, file_size_of(patch_name),
+            file_size_of(new_name));
+    remove(old_name);
+    remove(new_name);
+    remove(patch_name);
+}
+
+static int check_sources(struct RuckSackBundle *bundle, long file_count) {
+    char key[64];
+    char path[64];
+    int up_to_date_count = 0;
+    for (long i = 0; i < file_count; i += 1) {
+        int key_size = make_key(key, i);
+        snprintf(path, sizeof(path), "benchmark-source-%ld", i);
+        struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, key_size);
+        assert(entry);
+        int up_to_date;
+        ok(rucksack_file_check_source(entry, path, &up_to_date));
+        up_to_date_count += up_to_date;
+    }
+    return up_to_date_count;
+}
+
+// the bundle command with --check hash when none of the sources changed, and
+// after all of them were touched, against adding them all again
+static void bench_check_source(void) {
+    const char *bundle_name = "benchmark.bundle";
+    const long file_count = 200;
+    const long copies = 8;
+    char key[64];
+    char path[64];
+
+    unsigned char monkey[32768];
+    long monkey_size = read_monkey(monkey, sizeof(monkey));
+    remove(bundle_name);
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (long i = 0; i < file_count; i += 1) {
+        int key_size = make_key(key, i);
+        snprintf(path, sizeof(path), "benchmark-source-%ld", i);
+        FILE *f = fopen(path, "wb");
+        assert(f);
+        assert(fwrite(key, 1, key_size, f) == (size_t)key_size);
+        for (long j = 0; j < copies; j += 1)
+            assert(fwrite(monkey, 1, monkey_size, f) == (size_t)monkey_size);
+        assert(fclose(f) == 0);
+        ok(rucksack_bundle_add_file(bundle, key, key_size, path));
+    }
+    ok(rucksack_bundle_close(bundle));
+
+    double start = now();
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    assert(check_sources(bundle, file_count) == file_count);
+    ok(rucksack_bundle_close(bundle));
+    double unchanged_time = now() - start;
+
+    // as a checkout would, with the same contents
+    for (long i = 0; i < file_count; i += 1) {
+        snprintf(path, sizeof(path), "benchmark-source-%ld", i);
+        struct timespec times[2] = {{2000000000, 1}, {2000000000, 1}};
+        assert(utimensat(AT_FDCWD, path, times, 0) == 0);
+    }
+    start = now();
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    assert(check_sources(bundle, file_count) == file_count);
+    ok(rucksack_bundle_close(bundle));
+    double touched_time = now() - start;
+
+    start = now();
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    assert(check_sources(bundle, file_count) == file_count);
+    ok(rucksack_bundle_close(bundle));
+    double again_time = now() - start;
+
+    start = now();
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (long i = 0; i < file_count; i += 1) {
+        int key_size = make_key(key, i);
+        snprintf(path, sizeof(path), "benchmark-source-%ld", i);
+        ok(rucksack_bundle_add_file(bundle, key, key_size, path));
+    }
+    ok(rucksack_bundle_close(bundle));
+    double add_time = now() - start;
+
+    printf("  %ld files of %ld KB: unchanged %6.1f ms, touched %6.1f ms, "
+            "touched again %6.1f ms, adding all again %6.1f ms\n", file_count,
+            (copies * monkey_size) / 1024, unchanged_time * 1e3, touched_time * 1e3,
+            again_time * 1e3, add_time * 1e3);
+    for (long i = 0; i < file_count; i += 1) {
+        snprintf(path, sizeof(path), "benchmark-source-%ld", i);
+        remove(path);
+    }
+    remove(bundle_name);
+}
+
+struct Benchmark {
+    const char *name;
+    void (*fn)(void);
+};
+
+static struct Benchmark benchmarks[] = {
+    {"find file", bench_find_file},
+    {"open to first read", bench_open_to_first_read},
+    {"incremental rebuild", bench_incremental_rebuild},
+    {"delete untouched", bench_delete_untouched},
+    {"small streams", bench_small_streams},
+    {"durability", bench_durability},
+    {"compressed read", bench_compressed_read},
+    {"parallel read", bench_parallel_read},
+    {"batch read", bench_batch_read},
+    {"shared contents", bench_shared_contents},
+    {"verify", bench_verify},
+    {"overlay", bench_overlay},
+    {"diff and apply", bench_diff_apply},
+    {"check source", bench_check_source},
+    {NULL, NULL},
+};
+
+static void exec_benchmark(struct Benchmark *benchmark) {
+    printf("%s:\n", benchmark->name);
+    benchmark->fn();
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 2) {
+        int index = atoi(argv[1]);
+        exec_benchmark(&benchmarks[index]);
+        return 0;
+    }
+
+    struct Benchmark *benchmark = &benchmarks[0];
+
+    while (benchmark->name) {
+        exec_benchmark(benchmark);
+        benchmark += 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of rucksack, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#undef NDEBUG
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "hash.h"
+
+static void test_known_values(void) {
+    assert(rucksack_hash("", 0) == 0xef46db3751d8e999ULL);
+    assert(rucksack_hash("a", 1) == 0xd24ec4f1a98c6e5bULL);
+    assert(rucksack_hash("abc", 3) == 0x44bc2cf5ad770999ULL);
+    const char *text = "Nobody inspects the spammish repetition";
+    assert(rucksack_hash(text, strlen(text)) == 0xfbcea83c8a378bf1ULL);
+}
+
+static void test_pieces(void) {
+    const long size = 1000;
+    unsigned char *data = malloc(size);
+    assert(data);
+    uint32_t seed = 1;
+    for (long i = 0; i < size; i += 1) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 24;
+    }
+
+    // any split into pieces gives the same hash as hashing in one go
+    for (long len = 0; len <= size; len += 37) {
+        uint64_t expected = rucksack_hash(data, len);
+        for (long piece = 1; piece <= 70; piece += 3) {
+            struct RuckSackHash hash;
+            rucksack_hash_init(&hash);
+            for (long pos = 0; pos < len; pos += piece) {
+                long amt = (len - pos < piece) ? len - pos : piece;
+                rucksack_hash_update(&hash, &data[pos], amt);
+            }
+            assert(rucksack_hash_final(&hash) == expected);
+        }
+    }
+
+    // a single flipped bit changes the hash
+    uint64_t before = rucksack_hash(data, size);
+    data[size / 2] ^= 1;
+    assert(rucksack_hash(data, size) != before);
+    free(data);
+}
+
+static void test_crc32c(void) {
+    assert(rucksack_crc32c(0, "", 0) == 0);
+    assert(rucksack_crc32c(0, "123456789", 9) == 0xe3069283);
+    assert(rucksack_crc32c_portable(0, "123456789", 9) == 0xe3069283);
+    unsigned char zeros[32] = {0};
+    assert(rucksack_crc32c(0, zeros, 32) == 0x8a9136aa);
+
+    const long size = 1000;
+    unsigned char *data = malloc(size);
+    assert(data);
+    for (long i = 0; i < size; i += 1)
+        data[i] = i * 7 + (i >> 3);
+
+    // both implementations agree at any length and alignment, and a CRC can
+    // be continued from where it stopped
+    for (long start = 0; start < 8; start += 1) {
+        for (long len = 0; start + len <= size; len += 29) {
+            uint32_t expected = rucksack_crc32c_portable(0, &data[start], len);
+            assert(rucksack_crc32c(0, &data[start], len) == expected);
+            long half = len / 2;
+            uint32_t crc = rucksack_crc32c(0, &data[start], half);
+            assert(rucksack_crc32c(crc, &data[start + half], len - half) == expected);
+        }
+    }
+
+    uint32_t before = rucksack_crc32c(0, data, size);
+    data[size / 3] ^= 0x10;
+    assert(rucksack_crc32c(0, data, size) != before);
+    free(data);
+}
+
+struct Test {
+    const char *name;
+    void (*fn)(void);
+};
+
+static struct Test tests[] = {
+    {"known values", test_known_values},
+    {"hash in pieces", test_pieces},
+    {"crc32c", test_crc32c},
+    {NULL, NULL},
+};
+
+static void exec_test(struct Test *test) {
+    fprintf(stderr, "testing %s...", test->name);
+    test->fn();
+    fprintf(stderr, "OK\n");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 2) {
+        int index = atoi(argv[1]);
+        exec_test(&tests[index]);
+        return 0;
+    }
+
+    struct Test *test = &tests[0];
+
+    while (test->name) {
+        exec_test(test);
+        test += 1;
+    }
+
+    return 0;
+}
@@ -9,11 +9,17 @@
 
 #include "rucksack.h"
 #include "spritesheet.h"
+#include "test_hooks.h"
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <FreeImage.h>
 
 static void ok(int err) {
@@ -248,7 +254,7 @@ static void test_three_files(void) {
     ok(rucksack_bundle_add_file(bundle, "g_globby1.txt", -1, "../test/globby/globby1.txt"));
     ok(rucksack_bundle_add_file(bundle, "g_globby2.txt", -1, "../test/globby/globby2.txt"));
 
-    rucksack_bundle_delete_untouched(bundle);
+    ok(rucksack_bundle_delete_untouched(bundle));
 
     ok(rucksack_bundle_close(bundle));
 
@@ -260,7 +266,7 @@ static void test_three_files(void) {
     ok(rucksack_bundle_add_file(bundle, "g_globby1.txt", -1, "../test/globby/globby1.txt"));
     ok(rucksack_bundle_add_file(bundle, "g_globby2.txt", -1, "../test/globby/globby2.txt"));
 
-    rucksack_bundle_delete_untouched(bundle);
+    ok(rucksack_bundle_delete_untouched(bundle));
 
     count = rucksack_bundle_file_count(bundle);
     assert(count == 2);
@@ -427,6 +433,1700 @@ static void test_delete_from_bundle(void) {
     ok(rucksack_bundle_close(bundle));
 }
 
+static void test_find_after_delete(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+
+    char key[32];
+    for (int i = 0; i < 300; i += 1) {
+        int key_size = sprintf(key, "file%d", i);
+        struct RuckSackOutStream *stream;
+        ok(rucksack_bundle_add_stream(bundle, key, key_size, 4, &stream));
+        ok(rucksack_stream_write(stream, &i, sizeof(int)));
+        ok(rucksack_stream_close(stream));
+    }
+    for (int i = 0; i < 300; i += 3) {
+        int key_size = sprintf(key, "file%d", i);
+        ok(rucksack_bundle_delete_file(bundle, key, key_size));
+    }
+
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    assert(rucksack_bundle_file_count(bundle) == 200);
+    for (int i = 0; i < 300; i += 1) {
+        int key_size = sprintf(key, "file%d", i);
+        struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, key_size);
+        if (i % 3 == 0) {
+            assert(!entry);
+            continue;
+        }
+        assert(entry);
+        int value;
+        assert(rucksack_file_size(entry) == sizeof(int));
+        ok(rucksack_file_read(entry, (unsigned char *)&value));
+        assert(value == i);
+    }
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void test_grow_files(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    char key[32];
+    for (int i = 0; i < 100; i += 1) {
+        int key_size = sprintf(key, "file%d", i);
+        struct RuckSackOutStream *stream;
+        ok(rucksack_bundle_add_stream_precise(bundle, key, key_size, sizeof(int), &stream, 0));
+        ok(rucksack_stream_write(stream, &i, sizeof(int)));
+        ok(rucksack_stream_close(stream));
+    }
+    ok(rucksack_bundle_close(bundle));
+
+    // every file is packed tightly, so growing one moves it
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (int i = 0; i < 100; i += 7) {
+        int key_size = sprintf(key, "file%d", i);
+        struct RuckSackOutStream *stream;
+        ok(rucksack_bundle_add_stream(bundle, key, key_size, 4, &stream));
+        for (int j = 0; j < 1000; j += 1)
+            ok(rucksack_stream_write(stream, &i, sizeof(int)));
+        ok(rucksack_stream_close(stream));
+    }
+    for (int i = 3; i < 100; i += 10) {
+        int key_size = sprintf(key, "file%d", i);
+        ok(rucksack_bundle_delete_file(bundle, key, key_size));
+    }
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    assert(rucksack_bundle_file_count(bundle) == 90);
+    int *values = malloc(1000 * sizeof(int));
+    assert(values);
+    for (int i = 0; i < 100; i += 1) {
+        int key_size = sprintf(key, "file%d", i);
+        struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, key_size);
+        if (i % 10 == 3) {
+            assert(!entry);
+            continue;
+        }
+        assert(entry);
+        int count = (i % 7 == 0) ? 1000 : 1;
+        assert(rucksack_file_size(entry) == count * (long)sizeof(int));
+        ok(rucksack_file_read(entry, (unsigned char *)values));
+        for (int j = 0; j < count; j += 1)
+            assert(values[j] == i);
+    }
+    free(values);
+    ok(rucksack_bundle_close(bundle));
+}
+
+// the key goes first so that no two files have the same contents
+static void write_precise(struct RuckSackBundle *bundle, const char *key, int size) {
+    char data[300];
+    memset(data, size, size);
+    memcpy(data, key, strlen(key));
+    struct RuckSackOutStream *stream;
+    ok(rucksack_bundle_add_stream_precise(bundle, key, -1, size, &stream, 0));
+    ok(rucksack_stream_write(stream, data, size));
+    ok(rucksack_stream_close(stream));
+}
+
+static void check_precise(struct RuckSackFileEntry *entry, int size) {
+    unsigned char data[300];
+    int key_size = rucksack_file_name_size(entry);
+    assert(rucksack_file_size(entry) == size);
+    ok(rucksack_file_read(entry, data));
+    assert(memcmp(data, rucksack_file_name(entry), key_size) == 0);
+    for (int j = key_size; j < size; j += 1)
+        assert(data[j] == (unsigned char)size);
+}
+
+static void test_alloc_stats(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    struct RuckSackBundle *bundle;
+    struct RuckSackAllocStats stats;
+    char key[32];
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (int i = 0; i < 20; i += 1) {
+        sprintf(key, "file%d", i);
+        write_precise(bundle, key, 100);
+    }
+    ok(rucksack_bundle_alloc_stats(bundle, &stats));
+    assert(stats.file_count == 20);
+    assert(stats.data_bytes == 2000);
+    assert(stats.allocated_bytes == 2000);
+    assert(stats.hole_count == 0);
+
+    // neighbouring holes are merged
+    ok(rucksack_bundle_delete_file(bundle, "file5", -1));
+    ok(rucksack_bundle_delete_file(bundle, "file7", -1));
+    ok(rucksack_bundle_delete_file(bundle, "file6", -1));
+    ok(rucksack_bundle_delete_file(bundle, "file12", -1));
+    ok(rucksack_bundle_alloc_stats(bundle, &stats));
+    assert(stats.hole_count == 2);
+    assert(stats.free_bytes == 400);
+    assert(stats.largest_hole == 300);
+
+    // the smallest hole that fits is used
+    write_precise(bundle, "new1", 100);
+    ok(rucksack_bundle_alloc_stats(bundle, &stats));
+    assert(stats.hole_count == 1);
+    assert(stats.free_bytes == 300);
+    ok(rucksack_bundle_close(bundle));
+
+    // holes are found again when opening the bundle
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    write_precise(bundle, "new2", 250);
+    ok(rucksack_bundle_alloc_stats(bundle, &stats));
+    assert(stats.file_count == 18);
+    assert(stats.hole_count == 1);
+    assert(stats.free_bytes == 50);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    struct RuckSackFileEntry *entries[18];
+    ok(rucksack_bundle_get_files(bundle, entries));
+    for (int i = 0; i < 18; i += 1)
+        check_precise(entries[i], rucksack_file_size(entries[i]));
+    ok(rucksack_bundle_alloc_stats(bundle, &stats));
+    assert(stats.free_bytes == 50);
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void test_delete_untouched_many(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    struct RuckSackBundle *bundle;
+    char key[32];
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (int i = 0; i < 200; i += 1) {
+        sprintf(key, "file%d", i);
+        write_precise(bundle, key, 10 + i % 50);
+    }
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    for (int i = 0; i < 200; i += 3) {
+        sprintf(key, "file%d", i);
+        struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, -1);
+        assert(entry);
+        rucksack_file_touch(entry);
+    }
+    ok(rucksack_bundle_delete_untouched(bundle));
+    assert(rucksack_bundle_file_count(bundle) == 67);
+    assert(!rucksack_bundle_find_file(bundle, "file1", -1));
+
+    // the freed space is reused by new files
+    for (int i = 0; i < 20; i += 1) {
+        sprintf(key, "new%d", i);
+        write_precise(bundle, key, 40);
+    }
+    struct RuckSackAllocStats stats;
+    ok(rucksack_bundle_alloc_stats(bundle, &stats));
+    assert(stats.file_count == 87);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    assert(rucksack_bundle_delete_untouched(bundle) == RuckSackErrorReadOnly);
+    assert(rucksack_bundle_delete_file(bundle, "file0", -1) == RuckSackErrorReadOnly);
+    assert(rucksack_bundle_file_count(bundle) == 87);
+    for (int i = 0; i < 200; i += 1) {
+        sprintf(key, "file%d", i);
+        struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, -1);
+        if (i % 3 != 0) {
+            assert(!entry);
+            continue;
+        }
+        assert(entry);
+        check_precise(entry, 10 + i % 50);
+    }
+    for (int i = 0; i < 20; i += 1) {
+        sprintf(key, "new%d", i);
+        struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, -1);
+        assert(entry);
+        check_precise(entry, 40);
+    }
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void test_open_mmap(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    ok(rucksack_bundle_add_file(bundle, "blah", -1, "../test/blah.txt"));
+    ok(rucksack_bundle_add_file(bundle, "monkey.obj", -1, "../test/monkey.obj"));
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+    assert(rucksack_bundle_file_count(bundle) == 2);
+
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "blah", -1);
+    assert(entry);
+    char buf[11];
+    ok(rucksack_file_read(entry, (unsigned char *)buf));
+    buf[10] = 0;
+    assert(strcmp(buf, "aoeu\n1234\n") == 0);
+
+    entry = rucksack_bundle_find_file(bundle, "monkey.obj", -1);
+    assert(entry);
+    long size = rucksack_file_size(entry);
+    assert(size == 23875);
+    unsigned char *buffer = malloc(size);
+    ok(rucksack_file_read(entry, buffer));
+    assert(buffer[0] == '#');
+    assert(buffer[size - 2] == '1');
+    free(buffer);
+
+    ok(rucksack_bundle_close(bundle));
+
+    assert(rucksack_bundle_open_mmap("does-not-exist.bundle", &bundle) == RuckSackErrorFileAccess);
+}
+
+static void test_file_data(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    ok(rucksack_bundle_add_file(bundle, "blah", -1, "../test/blah.txt"));
+
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "blah", -1);
+    assert(entry);
+    const unsigned char *ptr;
+    assert(rucksack_file_data(entry, &ptr) == RuckSackErrorNotInMemory);
+    assert(!ptr);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+    entry = rucksack_bundle_find_file(bundle, "blah", -1);
+    assert(entry);
+    ok(rucksack_file_data(entry, &ptr));
+    assert(memcmp(ptr, "aoeu\n1234\n", 10) == 0);
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void *concurrent_reader(void *arg) {
+    struct RuckSackBundle *bundle = arg;
+    struct RuckSackFileEntry *blah = rucksack_bundle_find_file(bundle, "blah", -1);
+    struct RuckSackFileEntry *monkey = rucksack_bundle_find_file(bundle, "monkey.obj", -1);
+    assert(blah && monkey);
+    struct RuckSackFileEntry *entries[2];
+    ok(rucksack_bundle_get_files(bundle, entries));
+    assert((entries[0] == blah && entries[1] == monkey) ||
+            (entries[0] == monkey && entries[1] == blah));
+    long size = rucksack_file_size(monkey);
+    unsigned char *buffer = malloc(size);
+    assert(buffer);
+    for (int i = 0; i < 200; i += 1) {
+        char buf[10];
+        ok(rucksack_file_read(blah, (unsigned char *)buf));
+        assert(memcmp(buf, "aoeu\n1234\n", 10) == 0);
+        ok(rucksack_file_read(monkey, buffer));
+        assert(buffer[0] == '#');
+        assert(buffer[size - 2] == '1');
+    }
+    free(buffer);
+    return NULL;
+}
+
+static void test_concurrent_read(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    ok(rucksack_bundle_add_file(bundle, "blah", -1, "../test/blah.txt"));
+    ok(rucksack_bundle_add_file(bundle, "monkey.obj", -1, "../test/monkey.obj"));
+    ok(rucksack_bundle_close(bundle));
+
+    // lazy bundles decode the entries on whichever thread finds them first
+    for (int lazy = 0; lazy <= 1; lazy += 1) {
+        if (lazy)
+            ok(rucksack_bundle_open_mmap_lazy(bundle_name, &bundle));
+        else
+            ok(rucksack_bundle_open_read(bundle_name, &bundle));
+        pthread_t threads[4];
+        for (int i = 0; i < 4; i += 1)
+            assert(pthread_create(&threads[i], NULL, concurrent_reader, bundle) == 0);
+        for (int i = 0; i < 4; i += 1)
+            assert(pthread_join(threads[i], NULL) == 0);
+        ok(rucksack_bundle_close(bundle));
+    }
+}
+
+static void test_long_keys(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    char key[256];
+    for (int i = 0; i < 50; i += 1) {
+        int key_size = sprintf(key, "%0200d", i);
+        ok(rucksack_bundle_add_file(bundle, key, key_size, "../test/blah.txt"));
+    }
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    assert(rucksack_bundle_file_count(bundle) == 50);
+    for (int i = 0; i < 50; i += 1) {
+        int key_size = sprintf(key, "%0200d", i);
+        struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, key_size);
+        assert(entry);
+        assert(strcmp(rucksack_file_name(entry), key) == 0);
+        assert(rucksack_file_size(entry) == 10);
+    }
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void test_open_lazy(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    ok(rucksack_bundle_add_file(bundle, "blah", -1, "../test/blah.txt"));
+    ok(rucksack_bundle_add_file(bundle, "monkey.obj", -1, "../test/monkey.obj"));
+    ok(rucksack_bundle_add_file(bundle, "g_globby1.txt", -1, "../test/globby/globby1.txt"));
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_mmap_lazy(bundle_name, &bundle));
+    assert(rucksack_bundle_file_count(bundle) == 3);
+    assert(!rucksack_bundle_find_file(bundle, "nope", -1));
+
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "monkey.obj", -1);
+    assert(entry);
+    assert(strcmp(rucksack_file_name(entry), "monkey.obj") == 0);
+    assert(rucksack_file_size(entry) == 23875);
+    assert(rucksack_bundle_find_file(bundle, "monkey.obj", -1) == entry);
+
+    struct RuckSackFileEntry *entries[3];
+    ok(rucksack_bundle_get_files(bundle, entries));
+    int found_blah = 0;
+    for (int i = 0; i < 3; i += 1) {
+        if (strcmp(rucksack_file_name(entries[i]), "blah") == 0) {
+            char buf[11];
+            ok(rucksack_file_read(entries[i], (unsigned char *)buf));
+            buf[10] = 0;
+            assert(strcmp(buf, "aoeu\n1234\n") == 0);
+            found_blah = 1;
+        }
+    }
+    assert(found_blah);
+
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void write_uint32be(unsigned char *buf, uint32_t x) {
+    buf[0] = (x >> 24) & 0xff;
+    buf[1] = (x >> 16) & 0xff;
+    buf[2] = (x >> 8) & 0xff;
+    buf[3] = x & 0xff;
+}
+
+static void write_uint64be(unsigned char *buf, uint64_t x) {
+    write_uint32be(buf, x >> 32);
+    write_uint32be(buf + 4, x & 0xffffffff);
+}
+
+// writes a version 1 bundle with the data of the files right after the headers
+static void write_v1_bundle(const char *bundle_name, int count, const char **keys,
+        const unsigned char **contents, const long *sizes)
+{
+    long headers_size = 0;
+    long total_size = 0;
+    for (int i = 0; i < count; i += 1) {
+        headers_size += 36 + strlen(keys[i]);
+        total_size += sizes[i];
+    }
+    long data_offset = 28 + headers_size;
+    unsigned char *buf = calloc(1, data_offset + total_size);
+    assert(buf);
+    memcpy(buf, "\x60\x70\xc8\x99\x82\xa1\x41\x84\x89\x51\x08\xc9\x1c\xc9\xb6\x20", 16);
+    write_uint32be(&buf[16], 1);
+    write_uint32be(&buf[20], 28);
+    write_uint32be(&buf[24], count);
+    unsigned char *header = &buf[28];
+    for (int i = 0; i < count; i += 1) {
+        int key_size = strlen(keys[i]);
+        write_uint32be(&header[0], 36 + key_size);
+        write_uint64be(&header[4], data_offset);
+        write_uint64be(&header[12], sizes[i]);
+        write_uint64be(&header[20], sizes[i]);
+        write_uint32be(&header[28], 0);
+        write_uint32be(&header[32], key_size);
+        memcpy(&header[36], keys[i], key_size);
+        memcpy(&buf[data_offset], contents[i], sizes[i]);
+        data_offset += sizes[i];
+        header += 36 + key_size;
+    }
+
+    FILE *f = fopen(bundle_name, "wb");
+    assert(f);
+    assert(fwrite(buf, 1, data_offset, f) == (size_t)data_offset);
+    assert(fclose(f) == 0);
+    free(buf);
+}
+
+static void test_open_v1_bundle(void) {
+    const char *bundle_name = "test.bundle";
+
+    const char *keys[] = {"one.txt", "two.txt"};
+    const char *contents[] = {"first", "second!"};
+    const long sizes[] = {5, 7};
+    write_v1_bundle(bundle_name, 2, keys, (const unsigned char **)contents, sizes);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open_mmap_lazy(bundle_name, &bundle));
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "two.txt", -1);
+    assert(entry);
+    assert(rucksack_file_size(entry) == 7);
+    ok(rucksack_bundle_close(bundle));
+
+    // opening it for writing upgrades it to the current version
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    assert(rucksack_bundle_file_count(bundle) == 2);
+    ok(rucksack_bundle_add_file(bundle, "blah", -1, "../test/blah.txt"));
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_mmap_lazy(bundle_name, &bundle));
+    assert(rucksack_bundle_file_count(bundle) == 3);
+    assert(!rucksack_bundle_find_file(bundle, "three.txt", -1));
+    for (int i = 0; i < 2; i += 1) {
+        entry = rucksack_bundle_find_file(bundle, keys[i], -1);
+        assert(entry);
+        char data[16];
+        ok(rucksack_file_read(entry, (unsigned char *)data));
+        assert(memcmp(data, contents[i], strlen(contents[i])) == 0);
+    }
+    entry = rucksack_bundle_find_file(bundle, "blah", -1);
+    assert(entry);
+    assert(rucksack_file_size(entry) == 10);
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void test_move_over_itself(void) {
+    const char *bundle_name = "test.bundle";
+
+    // upgrading the bundle makes room for a bigger header, which moves the
+    // file a few KB forward onto the bytes it occupies
+    const long size = 3 * 1024 * 1024 + 17;
+    unsigned char *data = malloc(size);
+    assert(data);
+    for (long i = 0; i < size; i += 1)
+        data[i] = (i * 7919) >> 8;
+    const char *keys[] = {"big.bin"};
+    const unsigned char *contents[] = {data};
+    write_v1_bundle(bundle_name, 1, keys, contents, &size);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "big.bin", -1);
+    assert(entry);
+    assert(rucksack_file_size(entry) == size);
+    const unsigned char *ptr;
+    ok(rucksack_file_data(entry, &ptr));
+    assert(memcmp(ptr, data, size) == 0);
+    ok(rucksack_bundle_close(bundle));
+    free(data);
+}
+
+static void write_string(struct RuckSackBundle *bundle, const char *key, const char *str) {
+    struct RuckSackOutStream *stream;
+    ok(rucksack_bundle_add_stream(bundle, key, -1, strlen(str), &stream));
+    ok(rucksack_stream_write(stream, str, strlen(str)));
+    ok(rucksack_stream_close(stream));
+}
+
+static void assert_string(struct RuckSackBundle *bundle, const char *key, const char *str) {
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, -1);
+    assert(entry);
+    assert(rucksack_file_size(entry) == (long)strlen(str));
+    char data[64];
+    ok(rucksack_file_read(entry, (unsigned char *)data));
+    assert(memcmp(data, str, strlen(str)) == 0);
+}
+
+static void test_crash_before_close(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    write_string(bundle, "a", "old a");
+    write_string(bundle, "b", "old b");
+    ok(rucksack_bundle_close(bundle));
+
+    // the child dies with the bundle open after changing everything
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        ok(rucksack_bundle_open(bundle_name, &bundle));
+        write_string(bundle, "a", "new a");
+        ok(rucksack_bundle_delete_file(bundle, "b", -1));
+        char key[32];
+        for (int i = 0; i < 100; i += 1) {
+            sprintf(key, "file%d", i);
+            write_string(bundle, key, "some more data for the free space");
+        }
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    assert(rucksack_bundle_file_count(bundle) == 2);
+    assert_string(bundle, "a", "old a");
+    assert_string(bundle, "b", "old b");
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    write_string(bundle, "a", "new a");
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    assert_string(bundle, "a", "new a");
+    assert_string(bundle, "b", "old b");
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void test_torn_superblock(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    write_string(bundle, "a", "first a");
+    write_string(bundle, "b", "first b");
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    write_string(bundle, "a", "second a");
+    ok(rucksack_bundle_delete_file(bundle, "b", -1));
+    write_string(bundle, "c", "second c");
+    ok(rucksack_bundle_close(bundle));
+
+    // generation 2 lives in the first superblock slot. break its checksum as
+    // if the write had been cut short.
+    FILE *f = fopen(bundle_name, "rb+");
+    assert(f);
+    assert(fseek(f, 20 + 40, SEEK_SET) == 0);
+    int byte = fgetc(f);
+    assert(byte != EOF);
+    assert(fseek(f, 20 + 40, SEEK_SET) == 0);
+    assert(fputc(byte ^ 0xff, f) != EOF);
+    assert(fclose(f) == 0);
+
+    // the extents of generation 1 were not reused while writing generation 2
+    ok(rucksack_bundle_open_mmap_lazy(bundle_name, &bundle));
+    assert(rucksack_bundle_file_count(bundle) == 2);
+    assert_string(bundle, "a", "first a");
+    assert_string(bundle, "b", "first b");
+    assert(!rucksack_bundle_find_file(bundle, "c", -1));
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    write_string(bundle, "c", "third c");
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    assert(rucksack_bundle_file_count(bundle) == 3);
+    assert_string(bundle, "a", "first a");
+    assert_string(bundle, "b", "first b");
+    assert_string(bundle, "c", "third c");
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void test_durability_modes(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    struct RuckSackBundleOptions options;
+    rucksack_bundle_options_init(&options);
+    options.durability = RuckSackDurabilityNone;
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open_options(bundle_name, &bundle, &options));
+    write_string(bundle, "a", "old a");
+    ok(rucksack_bundle_commit(bundle));
+    struct RuckSackSyncStats stats;
+    rucksack_bundle_sync_stats(bundle, &stats);
+    assert(stats.commit_count == 1);
+    assert(stats.sync_count == 0);
+    ok(rucksack_bundle_close(bundle));
+
+    // every closed stream survives the child dying
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        options.durability = RuckSackDurabilityPerStream;
+        ok(rucksack_bundle_open_options(bundle_name, &bundle, &options));
+        write_string(bundle, "a", "new a");
+        write_string(bundle, "b", "new b");
+
+        struct RuckSackOutStream *stream;
+        ok(rucksack_bundle_add_stream(bundle, "c", -1, 5, &stream));
+        ok(rucksack_stream_write(stream, "new c", 5));
+        assert(rucksack_bundle_commit(bundle) == RuckSackErrorStreamOpen);
+
+        rucksack_bundle_sync_stats(bundle, &stats);
+        assert(stats.commit_count == 2);
+        assert(stats.sync_count == 4);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    assert(rucksack_bundle_file_count(bundle) == 2);
+    assert_string(bundle, "a", "new a");
+    assert_string(bundle, "b", "new b");
+    ok(rucksack_bundle_close(bundle));
+}
+
+static unsigned char *read_whole_file(const char *path, long *out_size) {
+    FILE *f = fopen(path, "rb");
+    assert(f);
+    assert(fseek(f, 0, SEEK_END) == 0);
+    long size = ftell(f);
+    unsigned char *data = malloc(size);
+    assert(data);
+    assert(fseek(f, 0, SEEK_SET) == 0);
+    assert(fread(data, 1, size, f) == (size_t)size);
+    fclose(f);
+    *out_size = size;
+    return data;
+}
+
+static void test_open_lazy_corrupt(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    ok(rucksack_bundle_add_file(bundle, "blah", -1, "../test/blah.txt"));
+    ok(rucksack_bundle_add_file(bundle, "the corrupt one", -1, "../test/blah.txt"));
+    ok(rucksack_bundle_close(bundle));
+
+    // give the header entry a size too small for its key. the last copy of
+    // the key is the one in the header entries in use.
+    long bundle_size;
+    unsigned char *bundle_data = read_whole_file(bundle_name, &bundle_size);
+    const char *key = "the corrupt one";
+    long key_size = strlen(key);
+    long key_offset = -1;
+    for (long i = 36; i + key_size <= bundle_size; i += 1) {
+        if (memcmp(&bundle_data[i], key, key_size) == 0)
+            key_offset = i;
+    }
+    assert(key_offset != -1);
+    write_uint32be(&bundle_data[key_offset - 36], 36);
+
+    ok(rucksack_bundle_open_read_mem_lazy(bundle_data, bundle_size, &bundle));
+    assert(rucksack_bundle_file_count(bundle) == 2);
+    struct RuckSackFileEntry *entries[2];
+    assert(rucksack_bundle_get_files(bundle, entries) == RuckSackErrorInvalidFormat);
+    ok(rucksack_bundle_close(bundle));
+
+    free(bundle_data);
+}
+
+static void test_compressed_files(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+    long monkey_size;
+    unsigned char *monkey = read_whole_file("../test/monkey.obj", &monkey_size);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    ok(rucksack_bundle_add_file_codec(bundle, "monkey.obj", -1, "../test/monkey.obj",
+                RuckSackCodecLz));
+    // too small to get any smaller
+    ok(rucksack_bundle_add_file_codec(bundle, "blah", -1, "../test/blah.txt",
+                RuckSackCodecLz));
+
+    struct RuckSackOutStream *stream;
+    ok(rucksack_bundle_add_stream(bundle, "runs", -1, 10, &stream));
+    assert(rucksack_stream_set_codec(stream, 99) == RuckSackErrorInvalidCodec);
+    ok(rucksack_stream_set_codec(stream, RuckSackCodecLz));
+    for (int i = 0; i < 1000; i += 1)
+        ok(rucksack_stream_write(stream, "0123456789", 10));
+    ok(rucksack_stream_close(stream));
+
+    ok(rucksack_bundle_add_stream(bundle, "late", -1, 10, &stream));
+    ok(rucksack_stream_write(stream, "x", 1));
+    assert(rucksack_stream_set_codec(stream, RuckSackCodecLz) == RuckSackErrorInvalidCodec);
+    ok(rucksack_stream_close(stream));
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "monkey.obj", -1);
+    assert(entry);
+    assert(rucksack_file_codec(entry) == RuckSackCodecLz);
+    assert(rucksack_file_size(entry) == monkey_size);
+    long stored_size = rucksack_file_stored_size(entry);
+    assert(stored_size < monkey_size);
+    unsigned char *buffer = malloc(monkey_size);
+    assert(buffer);
+    ok(rucksack_file_read(entry, buffer));
+    assert(memcmp(buffer, monkey, monkey_size) == 0);
+    ok(rucksack_file_read_stored(entry, buffer));
+    assert(memcmp(buffer, monkey, stored_size) != 0);
+
+    assert(rucksack_file_written_codec(entry) == RuckSackCodecLz);
+
+    entry = rucksack_bundle_find_file(bundle, "blah", -1);
+    assert(entry);
+    assert(rucksack_file_codec(entry) == RuckSackCodecNone);
+    assert(rucksack_file_written_codec(entry) == RuckSackCodecLz);
+    assert(rucksack_file_size(entry) == 10);
+    assert(rucksack_file_stored_size(entry) == 10);
+
+    entry = rucksack_bundle_find_file(bundle, "runs", -1);
+    assert(entry);
+    assert(rucksack_file_size(entry) == 10000);
+    assert(rucksack_file_stored_size(entry) < 100);
+    ok(rucksack_file_read(entry, buffer));
+    for (int i = 0; i < 10000; i += 1)
+        assert(buffer[i] == '0' + i % 10);
+    ok(rucksack_bundle_close(bundle));
+
+    // in-memory bundles decode in place and cannot lend out decoded bytes
+    ok(rucksack_bundle_open_mmap_lazy(bundle_name, &bundle));
+    entry = rucksack_bundle_find_file(bundle, "monkey.obj", -1);
+    assert(entry);
+    memset(buffer, 0, monkey_size);
+    ok(rucksack_file_read(entry, buffer));
+    assert(memcmp(buffer, monkey, monkey_size) == 0);
+    const unsigned char *ptr;
+    assert(rucksack_file_data(entry, &ptr) == RuckSackErrorCompressed);
+    struct RuckSackTexture *texture;
+    assert(rucksack_file_open_texture(entry, &texture) == RuckSackErrorCompressed);
+    ok(rucksack_bundle_close(bundle));
+
+    // writing the file again without a codec keeps the codec fields in the
+    // header, with codec 0, as the content hash comes after them
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    long headers_size = rucksack_bundle_get_headers_byte_count(bundle);
+    ok(rucksack_bundle_add_file(bundle, "monkey.obj", -1, "../test/monkey.obj"));
+    assert(rucksack_bundle_get_headers_byte_count(bundle) == headers_size);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    entry = rucksack_bundle_find_file(bundle, "monkey.obj", -1);
+    assert(entry);
+    assert(rucksack_file_codec(entry) == RuckSackCodecNone);
+    assert(rucksack_file_written_codec(entry) == RuckSackCodecNone);
+    assert(rucksack_file_stored_size(entry) == monkey_size);
+    ok(rucksack_file_read(entry, buffer));
+    assert(memcmp(buffer, monkey, monkey_size) == 0);
+    ok(rucksack_bundle_close(bundle));
+
+    free(buffer);
+    free(monkey);
+}
+
+// runs of text and of noise, so that some chunks are stored as they are
+static unsigned char *make_mixed_data(long size) {
+    unsigned char *data = malloc(size);
+    assert(data);
+    uint32_t seed = 1;
+    for (long i = 0; i < size; i += 1) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = ((i / 70000) % 2) ? (seed >> 24) : ('a' + i % 7);
+    }
+    return data;
+}
+
+static void add_mixed_file(struct RuckSackBundle *bundle, const char *key,
+        const unsigned char *data, long size, enum RuckSackCodec codec)
+{
+    struct RuckSackOutStream *stream;
+    ok(rucksack_bundle_add_stream(bundle, key, -1, 10, &stream));
+    ok(rucksack_stream_set_codec(stream, codec));
+    // writes which straddle the chunks
+    for (long i = 0; i < size; i += 7001)
+        ok(rucksack_stream_write(stream, &data[i], (size - i < 7001) ? size - i : 7001));
+    ok(rucksack_stream_close(stream));
+}
+
+static void test_chunked_files(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    const long size = 300000;
+    unsigned char *data = make_mixed_data(size);
+    unsigned char *buffer = malloc(size);
+    assert(buffer);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    add_mixed_file(bundle, "mixed", data, size, RuckSackCodecLz);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "mixed", -1);
+    assert(entry);
+    assert(rucksack_file_codec(entry) == RuckSackCodecLz);
+    assert(rucksack_file_size(entry) == size);
+    assert(rucksack_file_stored_size(entry) < size);
+    ok(rucksack_file_read(entry, buffer));
+    assert(memcmp(buffer, data, size) == 0);
+    for (int threads = 1; threads <= 8; threads *= 2) {
+        memset(buffer, 0, size);
+        ok(rucksack_file_read_parallel(entry, buffer, threads));
+        assert(memcmp(buffer, data, size) == 0);
+    }
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+    entry = rucksack_bundle_find_file(bundle, "mixed", -1);
+    assert(entry);
+    memset(buffer, 0, size);
+    ok(rucksack_file_read_parallel(entry, buffer, 3));
+    assert(memcmp(buffer, data, size) == 0);
+    ok(rucksack_bundle_close(bundle));
+
+    free(buffer);
+    free(data);
+}
+
+static void check_ranges(struct RuckSackBundle *bundle, const unsigned char *data, long size) {
+    static const char *keys[] = {"plain", "mixed"};
+    // offsets and sizes which start, end and cross chunks
+    static const long ranges[][2] = {
+        {0, 0}, {0, 1}, {0, 65536}, {65535, 2}, {65536, 65536},
+        {1000, 200000}, {299999, 1}, {300000, 0}, {0, 300000},
+    };
+    unsigned char *buffer = malloc(size);
+    assert(buffer);
+    for (int k = 0; k < 2; k += 1) {
+        struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, keys[k], -1);
+        assert(entry);
+        for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i += 1) {
+            long offset = ranges[i][0];
+            long range_size = ranges[i][1];
+            memset(buffer, 0, size);
+            ok(rucksack_file_read_range(entry, offset, range_size, buffer));
+            assert(memcmp(buffer, &data[offset], range_size) == 0);
+        }
+        assert(rucksack_file_read_range(entry, -1, 1, buffer) == RuckSackErrorInvalidRange);
+        assert(rucksack_file_read_range(entry, 0, -1, buffer) == RuckSackErrorInvalidRange);
+        assert(rucksack_file_read_range(entry, 1, size, buffer) == RuckSackErrorInvalidRange);
+        assert(rucksack_file_read_range(entry, size + 1, 0, buffer) == RuckSackErrorInvalidRange);
+    }
+    free(buffer);
+}
+
+static void test_read_range(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    const long size = 300000;
+    unsigned char *data = make_mixed_data(size);
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    add_mixed_file(bundle, "plain", data, size, RuckSackCodecNone);
+    add_mixed_file(bundle, "mixed", data, size, RuckSackCodecLz);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    check_ranges(bundle, data, size);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+    check_ranges(bundle, data, size);
+    ok(rucksack_bundle_close(bundle));
+
+    long bundle_size;
+    unsigned char *bundle_data = read_whole_file(bundle_name, &bundle_size);
+    ok(rucksack_bundle_open_read_mem(bundle_data, bundle_size, &bundle));
+    check_ranges(bundle, data, size);
+    ok(rucksack_bundle_close(bundle));
+
+    free(bundle_data);
+    free(data);
+}
+
+static void check_streams(struct RuckSackBundle *bundle, const unsigned char *data, long size) {
+    static const char *keys[] = {"plain", "mixed"};
+    // small reads which are served from the read-ahead buffer and reads
+    // larger than the buffer
+    static const long read_sizes[] = {1, 1000, 70001, 300000, 4096};
+    unsigned char *buffer = malloc(size);
+    assert(buffer);
+    for (int k = 0; k < 2; k += 1) {
+        struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, keys[k], -1);
+        assert(entry);
+        for (size_t i = 0; i < sizeof(read_sizes) / sizeof(read_sizes[0]); i += 1) {
+            struct RuckSackInStream *stream;
+            ok(rucksack_file_open_stream(entry, &stream));
+            memset(buffer, 0, size);
+            long pos = 0;
+            long amt_read;
+            do {
+                ok(rucksack_instream_read(stream, buffer + pos,
+                            (size - pos < read_sizes[i]) ? size - pos : read_sizes[i], &amt_read));
+                pos += amt_read;
+            } while (amt_read > 0);
+            assert(pos == size);
+            assert(memcmp(buffer, data, size) == 0);
+
+            // reading at the end gives nothing
+            ok(rucksack_instream_read(stream, buffer, 10, &amt_read));
+            assert(amt_read == 0);
+            rucksack_instream_close(stream);
+        }
+    }
+    free(buffer);
+}
+
+static void test_in_streams(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    const long size = 300000;
+    unsigned char *data = make_mixed_data(size);
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    add_mixed_file(bundle, "plain", data, size, RuckSackCodecNone);
+    add_mixed_file(bundle, "mixed", data, size, RuckSackCodecLz);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    check_streams(bundle, data, size);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+    check_streams(bundle, data, size);
+    ok(rucksack_bundle_close(bundle));
+
+    long bundle_size;
+    unsigned char *bundle_data = read_whole_file(bundle_name, &bundle_size);
+    ok(rucksack_bundle_open_read_mem(bundle_data, bundle_size, &bundle));
+    check_streams(bundle, data, size);
+    ok(rucksack_bundle_close(bundle));
+
+    free(bundle_data);
+    free(data);
+}
+
+static long batch_completed_count;
+
+static void on_batch_read(struct RuckSackReadRequest *request) {
+    ok(request->err);
+    int *completed = request->userdata;
+    assert(!*completed);
+    *completed = 1;
+    batch_completed_count += 1;
+}
+
+static void check_batch(struct RuckSackBundle *bundle, const unsigned char *data, long size) {
+    const long count = rucksack_bundle_file_count(bundle);
+    struct RuckSackFileEntry **entries = malloc(count * sizeof(struct RuckSackFileEntry *));
+    struct RuckSackReadRequest *requests = calloc(count, sizeof(struct RuckSackReadRequest));
+    int *completed = calloc(count, sizeof(int));
+    assert(entries && requests && completed);
+    ok(rucksack_bundle_get_files(bundle, entries));
+
+    // in reverse so that the reads have to be sorted
+    for (long i = 0; i < count; i += 1) {
+        requests[i].entry = entries[count - 1 - i];
+        requests[i].buffer = malloc(rucksack_file_size(requests[i].entry) + 1);
+        requests[i].userdata = &completed[i];
+        assert(requests[i].buffer);
+    }
+    batch_completed_count = 0;
+    ok(rucksack_bundle_read_batch(bundle, requests, count, on_batch_read));
+    assert(batch_completed_count == count);
+
+    for (long i = 0; i < count; i += 1) {
+        struct RuckSackFileEntry *entry = requests[i].entry;
+        long file_size = rucksack_file_size(entry);
+        const char *name = rucksack_file_name(entry);
+        assert(completed[i]);
+        if (strcmp(name, "plain") == 0 || strcmp(name, "mixed") == 0) {
+            assert(file_size == size);
+            assert(memcmp(requests[i].buffer, data, size) == 0);
+        } else if (strcmp(name, "empty") == 0) {
+            assert(file_size == 0);
+        } else {
+            // the small files hold their own names
+            assert(file_size == (long)strlen(name));
+            assert(memcmp(requests[i].buffer, name, file_size) == 0);
+        }
+        free(requests[i].buffer);
+    }
+
+    // without a callback
+    ok(rucksack_bundle_read_batch(bundle, requests, 0, NULL));
+
+    free(completed);
+    free(requests);
+    free(entries);
+}
+
+static void test_batch_read(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    const long size = 300000;
+    unsigned char *data = make_mixed_data(size);
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    add_mixed_file(bundle, "plain", data, size, RuckSackCodecNone);
+    add_mixed_file(bundle, "mixed", data, size, RuckSackCodecLz);
+    add_mixed_file(bundle, "empty", data, 0, RuckSackCodecNone);
+    // more files than reads in flight at once
+    for (int i = 0; i < 100; i += 1) {
+        char key[32];
+        sprintf(key, "small file %d", i);
+        write_string(bundle, key, key);
+    }
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    check_batch(bundle, data, size);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+    check_batch(bundle, data, size);
+    ok(rucksack_bundle_close(bundle));
+
+    long bundle_size;
+    unsigned char *bundle_data = read_whole_file(bundle_name, &bundle_size);
+    ok(rucksack_bundle_open_read_mem(bundle_data, bundle_size, &bundle));
+    check_batch(bundle, data, size);
+    ok(rucksack_bundle_close(bundle));
+
+    free(bundle_data);
+    free(data);
+}
+
+static void test_batch_read_failed_submit(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    const long size = 300000;
+    unsigned char *data = make_mixed_data(size);
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    add_mixed_file(bundle, "plain", data, size, RuckSackCodecNone);
+    add_mixed_file(bundle, "mixed", data, size, RuckSackCodecLz);
+    for (int i = 0; i < 100; i += 1) {
+        char key[32];
+        sprintf(key, "small file %d", i);
+        write_string(bundle, key, key);
+    }
+    ok(rucksack_bundle_close(bundle));
+
+    // the first submission fails before anything was reported, a later one
+    // with reads done and slots refilled, and then the same with waiting
+    // failing as well. every read is reported once and ends up with the
+    // right bytes.
+    for (int fail_wait = 0; fail_wait <= 1; fail_wait += 1) {
+        for (int i = 1; i <= 3; i += 1) {
+            ok(rucksack_bundle_open_read(bundle_name, &bundle));
+            rucksack_test_fail_uring(i, fail_wait);
+            check_batch(bundle, data, size);
+            rucksack_test_fail_uring(0, 0);
+            ok(rucksack_bundle_close(bundle));
+        }
+    }
+
+    free(data);
+}
+
+static void assert_aligned(const char *bundle_name, long alignment) {
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+    assert(rucksack_bundle_alignment(bundle) == alignment);
+    long count = rucksack_bundle_file_count(bundle);
+    struct RuckSackFileEntry **entries = malloc(count * sizeof(struct RuckSackFileEntry *));
+    assert(entries);
+    ok(rucksack_bundle_get_files(bundle, entries));
+    // the mapping starts at a page
+    for (long i = 0; i < count; i += 1) {
+        const unsigned char *ptr;
+        ok(rucksack_file_data(entries[i], &ptr));
+        assert((uintptr_t)ptr % alignment == 0);
+    }
+    free(entries);
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void test_alignment(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    struct RuckSackBundleOptions options;
+    rucksack_bundle_options_init(&options);
+    struct RuckSackBundle *bundle;
+    options.alignment = 3;
+    assert(rucksack_bundle_open_options(bundle_name, &bundle, &options) ==
+            RuckSackErrorInvalidAlignment);
+
+    options.alignment = 4096;
+    ok(rucksack_bundle_open_options(bundle_name, &bundle, &options));
+    for (int i = 0; i < 20; i += 1) {
+        char key[32];
+        sprintf(key, "file %d", i);
+        write_string(bundle, key, key);
+    }
+    ok(rucksack_bundle_add_file(bundle, "monkey.obj", -1, "../test/monkey.obj"));
+    ok(rucksack_bundle_close(bundle));
+    assert_aligned(bundle_name, 4096);
+
+    // the alignment is kept, also for files put in the space of deleted ones
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    assert(rucksack_bundle_alignment(bundle) == 4096);
+    for (int i = 0; i < 20; i += 3) {
+        char key[32];
+        sprintf(key, "file %d", i);
+        ok(rucksack_bundle_delete_file(bundle, key, -1));
+    }
+    write_string(bundle, "a", "a longer string than the ones before");
+    write_string(bundle, "file 1", "file 1 grew");
+    ok(rucksack_bundle_close(bundle));
+    assert_aligned(bundle_name, 4096);
+
+    options.alignment = 16;
+    ok(rucksack_bundle_open_options(bundle_name, &bundle, &options));
+    write_string(bundle, "b", "b");
+    ok(rucksack_bundle_close(bundle));
+    assert_aligned(bundle_name, 16);
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    assert_string(bundle, "a", "a longer string than the ones before");
+    assert_string(bundle, "file 1", "file 1 grew");
+    assert_string(bundle, "file 2", "file 2");
+    assert(!rucksack_bundle_find_file(bundle, "file 3", -1));
+    ok(rucksack_bundle_close(bundle));
+}
+
+static void assert_mixed_file(struct RuckSackBundle *bundle, const char *key,
+        const unsigned char *data, long size)
+{
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, -1);
+    assert(entry);
+    assert(rucksack_file_size(entry) == size);
+    unsigned char *buffer = malloc(size);
+    assert(buffer);
+    ok(rucksack_file_read(entry, buffer));
+    assert(memcmp(buffer, data, size) == 0);
+    free(buffer);
+}
+
+static const unsigned char *file_data(struct RuckSackBundle *bundle, const char *key) {
+    const unsigned char *ptr;
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, key, -1);
+    assert(entry);
+    ok(rucksack_file_data(entry, &ptr));
+    return ptr;
+}
+
+static void test_shared_contents(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    const long size = 200000;
+    unsigned char *data = make_mixed_data(size);
+    unsigned char *other = make_mixed_data(size);
+    other[size / 2] ^= 1;
+
+    // files with the same contents and codec are stored once
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    add_mixed_file(bundle, "raw 1", data, size, RuckSackCodecNone);
+    add_mixed_file(bundle, "raw 2", data, size, RuckSackCodecNone);
+    add_mixed_file(bundle, "raw 3", data, size, RuckSackCodecNone);
+    add_mixed_file(bundle, "lz 1", data, size, RuckSackCodecLz);
+    add_mixed_file(bundle, "lz 2", data, size, RuckSackCodecLz);
+    add_mixed_file(bundle, "other", other, size, RuckSackCodecNone);
+    long lz_size = rucksack_file_stored_size(rucksack_bundle_find_file(bundle, "lz 1", -1));
+    struct RuckSackAllocStats stats;
+    ok(rucksack_bundle_alloc_stats(bundle, &stats));
+    assert(stats.file_count == 6);
+    assert(stats.data_bytes == 2 * size + lz_size);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+    assert(file_data(bundle, "raw 1") == file_data(bundle, "raw 2"));
+    assert(file_data(bundle, "raw 1") == file_data(bundle, "raw 3"));
+    assert(file_data(bundle, "raw 1") != file_data(bundle, "other"));
+    assert_mixed_file(bundle, "lz 2", data, size);
+    assert_mixed_file(bundle, "other", other, size);
+    ok(rucksack_bundle_alloc_stats(bundle, &stats));
+    assert(stats.data_bytes == 2 * size + lz_size);
+    ok(rucksack_bundle_close(bundle));
+
+    // the contents stay while any file refers to them
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    ok(rucksack_bundle_delete_file(bundle, "raw 1", -1));
+    add_mixed_file(bundle, "raw 2", other, size, RuckSackCodecNone);
+    add_mixed_file(bundle, "lz 1", other, size, RuckSackCodecLz);
+    add_mixed_file(bundle, "raw 4", data, size, RuckSackCodecNone);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_mmap(bundle_name, &bundle));
+    assert(file_data(bundle, "raw 3") == file_data(bundle, "raw 4"));
+    assert(file_data(bundle, "raw 2") == file_data(bundle, "other"));
+    assert_mixed_file(bundle, "raw 3", data, size);
+    assert_mixed_file(bundle, "raw 2", other, size);
+    assert_mixed_file(bundle, "lz 1", other, size);
+    assert_mixed_file(bundle, "lz 2", data, size);
+    ok(rucksack_bundle_close(bundle));
+
+    // deleting untouched files keeps the contents of the touched ones
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    rucksack_file_touch(rucksack_bundle_find_file(bundle, "raw 4", -1));
+    rucksack_file_touch(rucksack_bundle_find_file(bundle, "lz 2", -1));
+    ok(rucksack_bundle_delete_untouched(bundle));
+    ok(rucksack_bundle_alloc_stats(bundle, &stats));
+    assert(stats.file_count == 2);
+    assert(stats.data_bytes == size + lz_size);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    assert_mixed_file(bundle, "raw 4", data, size);
+    assert_mixed_file(bundle, "lz 2", data, size);
+    ok(rucksack_bundle_close(bundle));
+
+    // a copy written last does not leave its bytes at the end of the file
+    long sizes[2];
+    for (int copies = 1; copies <= 2; copies += 1) {
+        remove(bundle_name);
+        ok(rucksack_bundle_open(bundle_name, &bundle));
+        for (int i = 0; i < copies; i += 1) {
+            char key[32];
+            sprintf(key, "copy %d", i);
+            add_mixed_file(bundle, key, data, size, RuckSackCodecNone);
+        }
+        ok(rucksack_bundle_close(bundle));
+        free(read_whole_file(bundle_name, &sizes[copies - 1]));
+    }
+    assert(sizes[1] < sizes[0] + 1000);
+
+    free(data);
+    free(other);
+}
+
+// finds the stored bytes of a file in the bundle and flips a bit in the
+// middle of them
+static void damage_stored(const char *bundle_name, struct RuckSackFileEntry *entry) {
+    long stored_size = rucksack_file_stored_size(entry);
+    unsigned char *stored = malloc(stored_size);
+    assert(stored);
+    ok(rucksack_file_read_stored(entry, stored));
+    long bundle_size;
+    unsigned char *contents = read_whole_file(bundle_name, &bundle_size);
+    long offset = 0;
+    while (memcmp(&contents[offset], stored, stored_size) != 0) {
+        offset += 1;
+        assert(offset + stored_size <= bundle_size);
+    }
+    free(contents);
+    free(stored);
+
+    FILE *f = fopen(bundle_name, "rb+");
+    assert(f);
+    assert(fseek(f, offset + stored_size / 2, SEEK_SET) == 0);
+    int byte = fgetc(f);
+    assert(byte != EOF);
+    assert(fseek(f, offset + stored_size / 2, SEEK_SET) == 0);
+    assert(fputc(byte ^ 0x04, f) != EOF);
+    assert(fclose(f) == 0);
+}
+
+static void test_checksums(void) {
+    const char *bundle_name = "test.bundle";
+    remove(bundle_name);
+
+    const long size = 200000;
+    unsigned char *data = make_mixed_data(size);
+    unsigned char *other = make_mixed_data(size);
+    other[0] ^= 1;
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    add_mixed_file(bundle, "raw", data, size, RuckSackCodecNone);
+    add_mixed_file(bundle, "lz", other, size, RuckSackCodecLz);
+    add_mixed_file(bundle, "empty", data, 0, RuckSackCodecNone);
+    ok(rucksack_bundle_close(bundle));
+
+    int errs[3];
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    rucksack_bundle_set_verify(bundle, 1);
+    ok(rucksack_file_verify(rucksack_bundle_find_file(bundle, "raw", -1)));
+    ok(rucksack_file_verify(rucksack_bundle_find_file(bundle, "empty", -1)));
+    ok(rucksack_bundle_verify(bundle, errs, 3));
+    for (int i = 0; i < 3; i += 1)
+        ok(errs[i]);
+    assert_mixed_file(bundle, "raw", data, size);
+    assert_mixed_file(bundle, "lz", other, size);
+    damage_stored(bundle_name, rucksack_bundle_find_file(bundle, "raw", -1));
+    damage_stored(bundle_name, rucksack_bundle_find_file(bundle, "lz", -1));
+    ok(rucksack_bundle_close(bundle));
+
+    // reads only fail on damaged bytes when asked to check them
+    unsigned char *buffer = malloc(size);
+    assert(buffer);
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    struct RuckSackFileEntry *raw = rucksack_bundle_find_file(bundle, "raw", -1);
+    struct RuckSackFileEntry *lz = rucksack_bundle_find_file(bundle, "lz", -1);
+    ok(rucksack_file_read(raw, buffer));
+    assert(memcmp(buffer, data, size) != 0);
+    rucksack_bundle_set_verify(bundle, 1);
+    assert(rucksack_file_read(raw, buffer) == RuckSackErrorChecksum);
+    assert(rucksack_file_read(lz, buffer) == RuckSackErrorChecksum);
+    assert(rucksack_file_read_parallel(lz, buffer, 4) == RuckSackErrorChecksum);
+    assert(rucksack_file_verify(raw) == RuckSackErrorChecksum);
+
+    struct RuckSackReadRequest requests[2];
+    memset(requests, 0, sizeof(requests));
+    unsigned char *other_buffer = malloc(size);
+    assert(other_buffer);
+    requests[0].entry = raw;
+    requests[0].buffer = buffer;
+    requests[1].entry = lz;
+    requests[1].buffer = other_buffer;
+    assert(rucksack_bundle_read_batch(bundle, requests, 2, NULL) == RuckSackErrorChecksum);
+    assert(requests[0].err == RuckSackErrorChecksum);
+    assert(requests[1].err == RuckSackErrorChecksum);
+    free(other_buffer);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_mmap_lazy(bundle_name, &bundle));
+    struct RuckSackFileEntry *entries[3];
+    ok(rucksack_bundle_get_files(bundle, entries));
+    ok(rucksack_bundle_verify(bundle, errs, 2));
+    for (int i = 0; i < 3; i += 1) {
+        int damaged = rucksack_file_size(entries[i]) > 0;
+        assert(errs[i] == (damaged ? RuckSackErrorChecksum : RuckSackErrorNone));
+    }
+    ok(rucksack_bundle_close(bundle));
+
+    // rewriting a file gives it a new checksum
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    add_mixed_file(bundle, "raw", data, size, RuckSackCodecNone);
+    ok(rucksack_bundle_close(bundle));
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    rucksack_bundle_set_verify(bundle, 1);
+    assert_mixed_file(bundle, "raw", data, size);
+    ok(rucksack_bundle_close(bundle));
+
+    free(buffer);
+    free(data);
+    free(other);
+}
+
+static void assert_overlay_string(struct RuckSackOverlay *overlay, const char *key,
+        const char *str)
+{
+    struct RuckSackFileEntry *entry = rucksack_overlay_find_file(overlay, key, -1);
+    if (!str) {
+        assert(!entry);
+        return;
+    }
+    assert(entry);
+    assert(rucksack_file_size(entry) == (long)strlen(str));
+    char data[64];
+    ok(rucksack_file_read(entry, (unsigned char *)data));
+    assert(memcmp(data, str, strlen(str)) == 0);
+}
+
+static void test_overlay(void) {
+    const char *bundle_names[] = {"base.bundle", "patch1.bundle", "patch2.bundle"};
+    for (int i = 0; i < 3; i += 1)
+        remove(bundle_names[i]);
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_names[0], &bundle));
+    write_string(bundle, "a", "base a");
+    write_string(bundle, "b", "base b");
+    write_string(bundle, "c", "base c");
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open(bundle_names[1], &bundle));
+    write_string(bundle, "b", "patch 1 b");
+    ok(rucksack_bundle_add_tombstone(bundle, "c", -1));
+    write_string(bundle, "d", "patch 1 d");
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open(bundle_names[2], &bundle));
+    ok(rucksack_bundle_add_tombstone(bundle, "a", -1));
+    write_string(bundle, "d", "patch 2 d");
+    ok(rucksack_bundle_close(bundle));
+
+    // in a bundle of its own a tombstone is an empty file
+    ok(rucksack_bundle_open_read(bundle_names[1], &bundle));
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "c", -1);
+    assert(entry);
+    assert(rucksack_file_is_tombstone(entry));
+    assert(rucksack_file_size(entry) == 0);
+    assert(!rucksack_file_is_tombstone(rucksack_bundle_find_file(bundle, "b", -1)));
+    ok(rucksack_bundle_close(bundle));
+
+    struct RuckSackBundle *bundles[3];
+    ok(rucksack_bundle_open_read(bundle_names[0], &bundles[0]));
+    ok(rucksack_bundle_open_mmap_lazy(bundle_names[1], &bundles[1]));
+    ok(rucksack_bundle_open_mmap_lazy(bundle_names[2], &bundles[2]));
+
+    struct RuckSackOverlay *overlay;
+    ok(rucksack_overlay_create(bundles, 2, &overlay));
+    assert_overlay_string(overlay, "a", "base a");
+    assert_overlay_string(overlay, "b", "patch 1 b");
+    assert_overlay_string(overlay, "c", NULL);
+    assert_overlay_string(overlay, "d", "patch 1 d");
+    assert_overlay_string(overlay, "e", NULL);
+    assert(rucksack_overlay_file_count(overlay) == 3);
+    rucksack_overlay_destroy(overlay);
+
+    ok(rucksack_overlay_create(bundles, 3, &overlay));
+    assert_overlay_string(overlay, "a", NULL);
+    assert_overlay_string(overlay, "b", "patch 1 b");
+    assert_overlay_string(overlay, "c", NULL);
+    assert_overlay_string(overlay, "d", "patch 2 d");
+    assert(rucksack_overlay_file_count(overlay) == 2);
+    struct RuckSackFileEntry *entries[2];
+    ok(rucksack_overlay_get_files(overlay, entries));
+    assert(strcmp(rucksack_file_name(entries[0]), "d") == 0);
+    assert(strcmp(rucksack_file_name(entries[1]), "b") == 0);
+    rucksack_overlay_destroy(overlay);
+    for (int i = 0; i < 3; i += 1)
+        ok(rucksack_bundle_close(bundles[i]));
+
+    // writing a file over a tombstone brings the key back
+    ok(rucksack_bundle_open(bundle_names[1], &bundle));
+    write_string(bundle, "c", "patch 1 c");
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open_read(bundle_names[0], &bundles[0]));
+    ok(rucksack_bundle_open_read(bundle_names[1], &bundles[1]));
+    assert(!rucksack_file_is_tombstone(rucksack_bundle_find_file(bundles[1], "c", -1)));
+    ok(rucksack_overlay_create(bundles, 2, &overlay));
+    assert_overlay_string(overlay, "c", "patch 1 c");
+    assert(rucksack_overlay_file_count(overlay) == 4);
+    rucksack_overlay_destroy(overlay);
+    for (int i = 0; i < 2; i += 1)
+        ok(rucksack_bundle_close(bundles[i]));
+
+    for (int i = 0; i < 3; i += 1)
+        remove(bundle_names[i]);
+}
+
+static void write_string_mtime(struct RuckSackBundle *bundle, const char *key,
+        const char *str, long mtime, enum RuckSackCodec codec)
+{
+    struct RuckSackOutStream *stream;
+    ok(rucksack_bundle_add_stream_precise(bundle, key, -1, strlen(str), &stream, mtime));
+    ok(rucksack_stream_set_codec(stream, codec));
+    ok(rucksack_stream_write(stream, str, strlen(str)));
+    ok(rucksack_stream_close(stream));
+}
+
+static void test_diff_apply(void) {
+    const char *old_name = "old.bundle";
+    const char *new_name = "new.bundle";
+    const char *patch_name = "patch.bundle";
+    remove(old_name);
+    remove(new_name);
+    remove(patch_name);
+
+    const long size = 200000;
+    unsigned char *data = make_mixed_data(size);
+    unsigned char *other = make_mixed_data(size);
+    other[size / 2] ^= 1;
+
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(old_name, &bundle));
+    write_string_mtime(bundle, "same", "same contents", 100, RuckSackCodecNone);
+    write_string_mtime(bundle, "edited", "old contents", 100, RuckSackCodecNone);
+    write_string_mtime(bundle, "touched", "touched contents", 100, RuckSackCodecNone);
+    write_string_mtime(bundle, "removed", "removed contents", 100, RuckSackCodecNone);
+    add_mixed_file(bundle, "lz same", data, size, RuckSackCodecLz);
+    add_mixed_file(bundle, "lz edited", data, size, RuckSackCodecLz);
+    ok(rucksack_bundle_close(bundle));
+
+    ok(rucksack_bundle_open(new_name, &bundle));
+    write_string_mtime(bundle, "same", "same contents", 100, RuckSackCodecNone);
+    write_string_mtime(bundle, "edited", "new contents", 100, RuckSackCodecNone);
+    write_string_mtime(bundle, "touched", "touched contents", 200, RuckSackCodecNone);
+    write_string_mtime(bundle, "added", "added contents", 100, RuckSackCodecNone);
+    struct RuckSackBundle *old_bundle;
+    ok(rucksack_bundle_open_read(old_name, &old_bundle));
+    ok(rucksack_bundle_copy_file(bundle, rucksack_bundle_find_file(old_bundle, "lz same", -1)));
+    ok(rucksack_bundle_close(old_bundle));
+    add_mixed_file(bundle, "lz edited", other, size, RuckSackCodecLz);
+    ok(rucksack_bundle_close(bundle));
+
+    struct RuckSackBundle *new_bundle;
+    struct RuckSackBundle *patch;
+    ok(rucksack_bundle_open_read(old_name, &old_bundle));
+    ok(rucksack_bundle_open_mmap_lazy(new_name, &new_bundle));
+    ok(rucksack_bundle_open(patch_name, &patch));
+    ok(rucksack_bundle_diff(old_bundle, new_bundle, patch));
+    ok(rucksack_bundle_close(patch));
+    ok(rucksack_bundle_close(new_bundle));
+    ok(rucksack_bundle_close(old_bundle));
+
+    // the patch has the changed files and a tombstone for the removed one
+    ok(rucksack_bundle_open_read(patch_name, &patch));
+    assert(rucksack_bundle_file_count(patch) == 5);
+    assert(!rucksack_bundle_find_file(patch, "same", -1));
+    assert(!rucksack_bundle_find_file(patch, "lz same", -1));
+    assert_string(patch, "edited", "new contents");
+    assert_string(patch, "added", "added contents");
+    assert(rucksack_file_mtime(rucksack_bundle_find_file(patch, "touched", -1)) == 200);
+    assert(rucksack_file_is_tombstone(rucksack_bundle_find_file(patch, "removed", -1)));
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(patch, "lz edited", -1);
+    assert(entry);
+    assert(rucksack_file_codec(entry) == RuckSackCodecLz);
+    assert_mixed_file(patch, "lz edited", other, size);
+
+    ok(rucksack_bundle_open(old_name, &bundle));
+    ok(rucksack_bundle_apply(bundle, patch));
+    ok(rucksack_bundle_close(bundle));
+    ok(rucksack_bundle_close(patch));
+
+    // the patched bundle has the files of the new one
+    ok(rucksack_bundle_open_read(old_name, &bundle));
+    ok(rucksack_bundle_open_read(new_name, &new_bundle));
+    assert(rucksack_bundle_file_count(bundle) == 6);
+    assert(!rucksack_bundle_find_file(bundle, "removed", -1));
+    long count = rucksack_bundle_file_count(new_bundle);
+    struct RuckSackFileEntry **entries = malloc(count * sizeof(struct RuckSackFileEntry *));
+    assert(entries);
+    ok(rucksack_bundle_get_files(new_bundle, entries));
+    unsigned char *expected = malloc(size);
+    unsigned char *actual = malloc(size);
+    assert(expected && actual);
+    for (long i = 0; i < count; i += 1) {
+        entry = rucksack_bundle_find_file(bundle, rucksack_file_name(entries[i]), -1);
+        assert(entry);
+        assert(rucksack_file_mtime(entry) == rucksack_file_mtime(entries[i]));
+        assert(rucksack_file_size(entry) == rucksack_file_size(entries[i]));
+        ok(rucksack_file_read(entries[i], expected));
+        ok(rucksack_file_read(entry, actual));
+        assert(memcmp(expected, actual, rucksack_file_size(entry)) == 0);
+    }
+    int errs[6];
+    ok(rucksack_bundle_verify(bundle, errs, 2));
+    for (int i = 0; i < 6; i += 1)
+        ok(errs[i]);
+    free(entries);
+    ok(rucksack_bundle_close(new_bundle));
+    ok(rucksack_bundle_close(bundle));
+
+    free(expected);
+    free(actual);
+    free(data);
+    free(other);
+    remove(old_name);
+    remove(new_name);
+    remove(patch_name);
+}
+
+static void write_source(const char *path, const char *contents, time_t sec, long nsec) {
+    FILE *f = fopen(path, "wb");
+    assert(f);
+    assert(fwrite(contents, 1, strlen(contents), f) == strlen(contents));
+    assert(fclose(f) == 0);
+    struct timespec times[2] = {{sec, nsec}, {sec, nsec}};
+    assert(utimensat(AT_FDCWD, path, times, 0) == 0);
+}
+
+static void assert_check_source(struct RuckSackBundle *bundle, const char *path,
+        int expected)
+{
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "source", -1);
+    assert(entry);
+    int up_to_date;
+    ok(rucksack_file_check_source(entry, path, &up_to_date));
+    assert(up_to_date == expected);
+}
+
+static void test_check_source(void) {
+    const char *bundle_name = "test.bundle";
+    const char *path = "source.txt";
+    remove(bundle_name);
+    write_source(path, "first contents", 1000, 250);
+
+    // the entry gets the mtime of the file
+    struct RuckSackBundle *bundle;
+    ok(rucksack_bundle_open(bundle_name, &bundle));
+    ok(rucksack_bundle_add_file(bundle, "source", -1, path));
+    struct RuckSackFileEntry *entry = rucksack_bundle_find_file(bundle, "source", -1);
+    assert(rucksack_file_mtime(entry) == 1000);
+    assert(rucksack_file_mtime_ns(entry) == 1000000000250LL);
+    assert_check_source(bundle, path, 1);
+
+    // the same size with other contents
+    write_source(path, "other contents", 1000, 500);
+    assert_check_source(bundle, path, 0);
+    // a different size
+    write_source(path, "first contents!", 1000, 250);
+    assert_check_source(bundle, path, 0);
+    // the same contents with a new mtime, which is kept
+    write_source(path, "first contents", 2000, 750);
+    assert_check_source(bundle, path, 1);
+    assert(rucksack_file_mtime_ns(entry) == 2000000000750LL);
+    // an mtime of whole seconds is not trusted on its own
+    write_source(path, "first contents", 3000, 0);
+    assert_check_source(bundle, path, 1);
+    write_source(path, "other contents", 3000, 0);
+    assert_check_source(bundle, path, 0);
+    write_source(path, "first contents", 3000, 0);
+    int up_to_date = 1;
+    assert(rucksack_file_check_source(entry, "missing.txt", &up_to_date) ==
+            RuckSackErrorFileAccess);
+    assert(!up_to_date);
+    ok(rucksack_bundle_close(bundle));
+
+    // the new mtime is written to the bundle. read-only bundles keep theirs.
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    entry = rucksack_bundle_find_file(bundle, "source", -1);
+    assert(rucksack_file_mtime(entry) == 3000);
+    assert(rucksack_file_mtime_ns(entry) == 3000000000000LL);
+    write_source(path, "first contents", 4000, 1);
+    assert_check_source(bundle, path, 1);
+    assert(rucksack_file_mtime_ns(entry) == 3000000000000LL);
+    ok(rucksack_bundle_close(bundle));
+
+    // copying a file keeps the nanoseconds
+    ok(rucksack_bundle_open_read(bundle_name, &bundle));
+    struct RuckSackBundle *copy;
+    remove("copy.bundle");
+    ok(rucksack_bundle_open("copy.bundle", &copy));
+    ok(rucksack_bundle_copy_file(copy, rucksack_bundle_find_file(bundle, "source", -1)));
+    ok(rucksack_bundle_close(copy));
+    ok(rucksack_bundle_close(bundle));
+    ok(rucksack_bundle_open_read("copy.bundle", &copy));
+    entry = rucksack_bundle_find_file(copy, "source", -1);
+    assert(rucksack_file_mtime_ns(entry) == 3000000000000LL);
+    ok(rucksack_bundle_close(copy));
+
+    remove("copy.bundle");
+    remove(bundle_name);
+    remove(path);
+}
+
 struct Test {
     const char *name;
     void (*fn)(void);
@@ -443,6 +2143,33 @@ static struct Test tests[] = {
     {"non-default texture properties", test_non_default_texture_props},
     {"open bundle read-only", test_open_read_only},
     {"delete from a bundle", test_delete_from_bundle},
+    {"find files after deleting some", test_find_after_delete},
+    {"grow files in the middle of a bundle", test_grow_files},
+    {"reuse the space of deleted files", test_alloc_stats},
+    {"delete many untouched files", test_delete_untouched_many},
+    {"open bundle with mmap", test_open_mmap},
+    {"borrow file data from a mapped bundle", test_file_data},
+    {"read from several threads at once", test_concurrent_read},
+    {"keys longer than the header size guess", test_long_keys},
+    {"open bundle lazily", test_open_lazy},
+    {"open a corrupt bundle lazily", test_open_lazy_corrupt},
+    {"open a version 1 bundle", test_open_v1_bundle},
+    {"move a file onto its own old location", test_move_over_itself},
+    {"crash before closing a bundle", test_crash_before_close},
+    {"fall back to the previous superblock", test_torn_superblock},
+    {"durability modes", test_durability_modes},
+    {"compressed files", test_compressed_files},
+    {"chunked files", test_chunked_files},
+    {"read range", test_read_range},
+    {"in streams", test_in_streams},
+    {"batch read", test_batch_read},
+    {"batch read after a failed submission", test_batch_read_failed_submit},
+    {"alignment", test_alignment},
+    {"shared contents", test_shared_contents},
+    {"checksums", test_checksums},
+    {"overlay bundles", test_overlay},
+    {"diff and apply", test_diff_apply},
+    {"check source", test_check_source},
     {NULL, NULL},
 };
 
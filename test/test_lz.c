@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of rucksack, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#undef NDEBUG
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "lz.h"
+
+// compresses and decompresses data and returns the compressed size
+static long round_trip(const unsigned char *data, long size) {
+    long bound = rucksack_lz_compress_bound(size);
+    unsigned char *compressed = malloc(bound);
+    unsigned char *decompressed = malloc(size + 1);
+    assert(compressed && decompressed);
+
+    long compressed_size = rucksack_lz_compress(data, size, compressed, bound);
+    assert(compressed_size > 0 && compressed_size <= bound);
+    assert(rucksack_lz_decompress(compressed, compressed_size, decompressed, size) == 0);
+    assert(memcmp(decompressed, data, size) == 0);
+
+    // the decompressed size must match exactly
+    assert(rucksack_lz_decompress(compressed, compressed_size, decompressed, size + 1) == -1);
+    if (size > 0)
+        assert(rucksack_lz_decompress(compressed, compressed_size, decompressed, size - 1) == -1);
+
+    free(compressed);
+    free(decompressed);
+    return compressed_size;
+}
+
+static void test_small_inputs(void) {
+    const unsigned char *text = (const unsigned char *)"abcabcabcabcabcabcabcabcabcabc";
+    for (long size = 0; size <= 30; size += 1)
+        round_trip(text, size);
+}
+
+static void test_text_file(void) {
+    FILE *f = fopen("../test/monkey.obj", "rb");
+    assert(f);
+    unsigned char *data = malloc(65536);
+    assert(data);
+    long size = fread(data, 1, 65536, f);
+    assert(size > 0);
+    fclose(f);
+
+    long compressed_size = round_trip(data, size);
+    assert(compressed_size < size * 3 / 4);
+    free(data);
+}
+
+static void test_runs_and_noise(void) {
+    const long size = 300000;
+    unsigned char *data = malloc(size);
+    assert(data);
+
+    // long runs need several length bytes and matches which overlap
+    memset(data, 'x', size);
+    assert(round_trip(data, size) < 2000);
+
+    // matches further back than the largest offset are not used
+    uint32_t seed = 1;
+    for (long i = 0; i < size; i += 1) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 24;
+    }
+    memcpy(&data[100000], &data[0], 1000);
+    round_trip(data, size);
+
+    // incompressible data does not fit in its own size
+    unsigned char *compressed = malloc(size);
+    assert(compressed);
+    assert(rucksack_lz_compress(&data[200000], 10000, compressed, 10000) == 0);
+
+    free(compressed);
+    free(data);
+}
+
+static void test_corrupt_input(void) {
+    const unsigned char *text = (const unsigned char *)"hello hello hello hello hello!";
+    long size = strlen((const char *)text);
+    unsigned char compressed[64];
+    unsigned char out[64];
+    long compressed_size = rucksack_lz_compress(text, size, compressed, sizeof(compressed));
+    assert(compressed_size > 0);
+
+    for (long cut = 0; cut < compressed_size; cut += 1)
+        assert(rucksack_lz_decompress(compressed, cut, out, size) == -1);
+
+    // an offset pointing before the start of the output
+    const unsigned char bad_offset[] = {0x10, 'a', 0x05, 0x00, 0x00};
+    assert(rucksack_lz_decompress(bad_offset, sizeof(bad_offset), out, 6) == -1);
+
+    // every flipped byte is either caught or stays within the buffers
+    for (long i = 0; i < compressed_size; i += 1) {
+        unsigned char flipped[64];
+        memcpy(flipped, compressed, compressed_size);
+        flipped[i] ^= 0xff;
+        rucksack_lz_decompress(flipped, compressed_size, out, size);
+    }
+}
+
+struct Test {
+    const char *name;
+    void (*fn)(void);
+};
+
+static struct Test tests[] = {
+    {"small inputs", test_small_inputs},
+    {"compress a text file", test_text_file},
+    {"runs and noise", test_runs_and_noise},
+    {"corrupt input", test_corrupt_input},
+    {NULL, NULL},
+};
+
+static void exec_test(struct Test *test) {
+    fprintf(stderr, "testing %s...", test->name);
+    test->fn();
+    fprintf(stderr, "OK\n");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 2) {
+        int index = atoi(argv[1]);
+        exec_test(&tests[index]);
+        return 0;
+    }
+
+    struct Test *test = &tests[0];
+
+    while (test->name) {
+        exec_test(test);
+        test += 1;
+    }
+
+    return 0;
+}